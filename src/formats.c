@@ -0,0 +1,459 @@
+#include "formats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "util.h"
+
+file_format_t
+input_t_detect_format
+   (  input_t* const input
+   )
+{
+   const unsigned char* magic = input_t_peek(input, 4);
+   if(!magic)
+      return FORMAT_UNKNOWN;
+
+   if(magic[0] == 0x89 && magic[1] == 'P' && magic[2] == 'N' && magic[3] == 'G')
+      return FORMAT_PNG;
+   if(memcmp(magic, "qoif", 4) == 0)
+      return FORMAT_QOI;
+   if(magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6' || magic[1] == '7') && isspace(magic[2]))
+      return FORMAT_PNM;
+
+   return FORMAT_UNKNOWN;
+}
+
+/**
+ * Heap memory a read may take is limited to max_memory bytes (0 for no limit), which is checked before pixels are read,
+ * so an image that does not fit is reported rather than read. Pixels used in place from a mapped file are not counted.
+ **/
+static void
+input_t_check_memory
+   (  const input_t* const input
+   ,  size_t               size
+   ,  size_t               max_memory
+   )
+{
+   if(max_memory && size > max_memory)
+      abort_("[read_image] Reading %s takes %zu bytes of memory, more than the %zu bytes allowed for reading it", input->name, size, max_memory);
+}
+
+//! Heap memory image_t_load_payload takes for size bytes of input.
+static size_t
+input_t_payload_memory
+   (  const input_t* const input
+   ,  size_t               size
+   )
+{
+   return (input->map && input->end - input->begin == size) ? 0 : size;
+}
+
+/**
+ * Set image data to the next size bytes of input.
+ * If input is mapped and the payload runs to the end of it, data points straight into the mapping and the image takes ownership of it.
+ * Otherwise (e.g. stdin, or more frames following in the file) the bytes are read into a heap buffer.
+ **/
+static void
+image_t_load_payload
+   (  image_t* const image
+   ,  input_t* const input
+   ,  size_t         size
+   )
+{
+   if(input->map && input->end - input->begin == size)
+   {
+      const unsigned char* payload = input_t_peek(input, size);
+      if(!payload)
+         abort_("[read_image] File %s is truncated", input->name);
+      image->data    = (void*) payload;
+      image->map     = input_t_take_map(input, &image->map_size);
+      image->storage = STORAGE_MAPPED;
+   }
+   else
+   {
+      image->data    = malloc(size);
+      image->storage = STORAGE_HEAP;
+      if(input_t_read(input, image->data, size) != size)
+         abort_("[read_image] File %s is truncated", input->name);
+   }
+}
+
+/**
+ * Get the rest of the input as one contiguous block.
+ * Mapped input is returned in place, otherwise it is read into *allocated, which must be free'd by the caller,
+ * and which may grow to max_memory bytes (0 for no limit).
+ **/
+static const unsigned char*
+input_t_read_all
+   (  input_t* const  input
+   ,  size_t*         size
+   ,  unsigned char** allocated
+   ,  size_t          max_memory
+   )
+{
+   *allocated = NULL;
+   if(input->map)
+   {
+      *size = input->end - input->begin;
+      return input_t_peek(input, *size);
+   }
+
+   size_t capacity = 1024 * 1024;
+   *size      = 0;
+   *allocated = (unsigned char*) malloc(capacity);
+   size_t nread;
+   while((nread = input_t_read(input, *allocated + *size, capacity - *size)) > 0)
+   {
+      *size += nread;
+      if(*size == capacity)
+      {
+         input_t_check_memory(input, 2 * capacity, max_memory);
+         capacity  *= 2;
+         *allocated = (unsigned char*) realloc(*allocated, capacity);
+      }
+   }
+   return *allocated;
+}
+
+/**
+ * QOI, see https://qoiformat.org/qoi-specification.pdf
+ **/
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+#define QOI_HEADER_SIZE 14
+#define QOI_PIXELS_MAX  400000000 // Largest image the QOI specification allows, so sizes always fit in an int and a size_t
+
+static inline uint32_t
+qoi_read_32
+   (  const unsigned char* bytes
+   )
+{
+   return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+status_t
+image_t_read_qoi
+   (  input_t* const input
+   ,  image_t* const image
+   ,  size_t         max_memory
+   )
+{
+   size_t size;
+   unsigned char* allocated;
+   const unsigned char* bytes = input_t_read_all(input, &size, &allocated, max_memory);
+
+   if(size < QOI_HEADER_SIZE || memcmp(bytes, "qoif", 4) != 0)
+      abort_("[read_qoi] File %s is not recognized as a QOI file", input->name);
+
+   const int channels = bytes[12];
+   if(channels != 3 && channels != 4)
+      abort_("[read_qoi] File %s has unsupported number of channels %i", input->name, channels);
+
+   const uint32_t width  = qoi_read_32(bytes + 4);
+   const uint32_t height = qoi_read_32(bytes + 8);
+   if(width == 0 || height == 0 || height > QOI_PIXELS_MAX / width)
+      abort_("[read_qoi] File %s has invalid size %ux%u", input->name, width, height);
+   input_t_check_memory(input, (size_t) width * height * channels + (allocated ? size : 0), max_memory);
+
+   image_t_init(image);
+   image->width      = width;
+   image->height     = height;
+   image->color_type = (channels == 4) ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+   image->bit_depth  = 8;
+   image->format     = (channels == 4) ? PIXEL_RGBA32 : PIXEL_RGB24;
+   image->data       = malloc((size_t) width * height * channels);
+   if(!image->data)
+      abort_("[read_qoi] Could not allocate %ux%u image for file %s", width, height, input->name);
+
+   unsigned char  index[64][4];
+   unsigned char  px[4] = { 0, 0, 0, 255 };
+   unsigned char* out   = (unsigned char*) image->data;
+   unsigned char* end   = out + (size_t) image->width * image->height * channels;
+   const unsigned char* p     = bytes + QOI_HEADER_SIZE;
+   const unsigned char* p_end = bytes + size;
+   int run = 0;
+
+   memset(index, 0, sizeof(index));
+
+   while(out < end)
+   {
+      if(run > 0)
+      {
+         --run;
+      }
+      else if(p < p_end)
+      {
+         int b1 = *p++;
+
+         if(b1 == QOI_OP_RGB)
+         {
+            if(p + 3 > p_end) break;
+            px[0] = p[0]; px[1] = p[1]; px[2] = p[2];
+            p += 3;
+         }
+         else if(b1 == QOI_OP_RGBA)
+         {
+            if(p + 4 > p_end) break;
+            px[0] = p[0]; px[1] = p[1]; px[2] = p[2]; px[3] = p[3];
+            p += 4;
+         }
+         else if((b1 & QOI_MASK_2) == QOI_OP_INDEX)
+         {
+            memcpy(px, index[b1], 4);
+         }
+         else if((b1 & QOI_MASK_2) == QOI_OP_DIFF)
+         {
+            px[0] += ((b1 >> 4) & 0x03) - 2;
+            px[1] += ((b1 >> 2) & 0x03) - 2;
+            px[2] += ( b1       & 0x03) - 2;
+         }
+         else if((b1 & QOI_MASK_2) == QOI_OP_LUMA)
+         {
+            if(p + 1 > p_end) break;
+            int b2 = *p++;
+            int vg = (b1 & 0x3f) - 32;
+            px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+            px[1] += vg;
+            px[2] += vg - 8 +  (b2       & 0x0f);
+         }
+         else if((b1 & QOI_MASK_2) == QOI_OP_RUN)
+         {
+            run = (b1 & 0x3f);
+         }
+
+         memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+      }
+      else
+      {
+         break;
+      }
+
+      memcpy(out, px, channels);
+      out += channels;
+   }
+
+   if(allocated)
+      free(allocated);
+
+   if(out < end)
+      abort_("[read_qoi] File %s is truncated", input->name);
+
+   return SUCCESS;
+}
+
+/**
+ * PGM (P5), PPM (P6) and PAM (P7).
+ **/
+//! Get next header byte, or -1 at end of input.
+static int
+pnm_getc
+   (  input_t* const input
+   )
+{
+   unsigned char c;
+   return input_t_read(input, &c, 1) == 1 ? c : -1;
+}
+
+//! Read next whitespace separated token of a PGM/PPM header, skipping comments. Consumes the single whitespace after the token.
+static int
+pnm_read_token
+   (  input_t* const input
+   ,  char*          token
+   ,  int            size
+   )
+{
+   int c, n = 0;
+   do
+   {
+      c = pnm_getc(input);
+      if(c == '#')
+      {
+         while(c != '\n' && c != -1)
+            c = pnm_getc(input);
+      }
+   } while(c != -1 && isspace(c));
+
+   while(c != -1 && !isspace(c) && n < size - 1)
+   {
+      token[n++] = c;
+      c = pnm_getc(input);
+   }
+   token[n] = '\0';
+
+   return n;
+}
+
+//! Read a PAM header line into line. Returns number of characters read.
+static int
+pnm_read_line
+   (  input_t* const input
+   ,  char*          line
+   ,  int            size
+   )
+{
+   int c, n = 0;
+   while((c = pnm_getc(input)) != -1 && c != '\n')
+   {
+      if(n < size - 1)
+         line[n++] = c;
+   }
+   line[n] = '\0';
+   return (c == -1 && n == 0) ? -1 : n;
+}
+
+//! Convert samples of the given max value and depth (1 to 4 channels) to 8 bit, or 16 bit RGBA64 if max value > 255.
+static void
+pnm_convert
+   (  const unsigned char* samples
+   ,  image_t* const       image
+   ,  int                  depth
+   ,  int                  maxval
+   )
+{
+   const size_t size = (size_t) image->width * image->height;
+   size_t i;
+   int c;
+
+   if(maxval < 256)
+   {
+      // Rescale 8 bit samples to 0-255, keeping the channel layout
+      const size_t n = size * depth;
+      unsigned char* out = (unsigned char*) malloc(n);
+      for(i = 0; i < n; ++i)
+      {
+         out[i] = (min((int) samples[i], maxval) * 255 + maxval / 2) / maxval;
+      }
+      image->data = out;
+      return;
+   }
+
+   // 16 bit big endian samples, rescaled to 0-65535 and expanded to RGBA64
+   uint16_t* out = (uint16_t*) malloc(size * 4 * sizeof(uint16_t));
+   for(i = 0; i < size; ++i)
+   {
+      int v[4];
+      for(c = 0; c < depth; ++c)
+      {
+         int sample = (samples[0] << 8) | samples[1];
+         v[c] = ((int64_t) min(sample, maxval) * 65535 + maxval / 2) / maxval;
+         samples += 2;
+      }
+
+      const int has_alpha = (depth == 2 || depth == 4);
+      const int gray      = (depth < 3);
+      out[4 * i + 0] = v[0];
+      out[4 * i + 1] = gray ? v[0] : v[1];
+      out[4 * i + 2] = gray ? v[0] : v[2];
+      out[4 * i + 3] = has_alpha ? v[depth - 1] : 65535;
+   }
+   image->data   = out;
+   image->format = PIXEL_RGBA64;
+}
+
+status_t
+image_t_read_pnm
+   (  input_t* const input
+   ,  image_t* const image
+   ,  size_t         max_memory
+   )
+{
+   char token[64];
+   int  width = 0, height = 0, depth = 0, maxval = 0;
+
+   pnm_read_token(input, token, sizeof(token));
+   if(strcmp(token, "P5") == 0 || strcmp(token, "P6") == 0)
+   {
+      depth = (token[1] == '5') ? 1 : 3;
+      pnm_read_token(input, token, sizeof(token)); width  = atoi(token);
+      pnm_read_token(input, token, sizeof(token)); height = atoi(token);
+      pnm_read_token(input, token, sizeof(token)); maxval = atoi(token);
+   }
+   else if(strcmp(token, "P7") == 0)
+   {
+      char line[256];
+      while(pnm_read_line(input, line, sizeof(line)) >= 0)
+      {
+         char key[64];
+         int  value;
+         if(strncmp(line, "ENDHDR", 6) == 0)
+            break;
+         if(sscanf(line, "%63s %i", key, &value) != 2)
+            continue; // Comments, TUPLTYPE etc.
+         if     (strcmp(key, "WIDTH" ) == 0) width  = value;
+         else if(strcmp(key, "HEIGHT") == 0) height = value;
+         else if(strcmp(key, "DEPTH" ) == 0) depth  = value;
+         else if(strcmp(key, "MAXVAL") == 0) maxval = value;
+      }
+   }
+   else
+   {
+      abort_("[read_pnm] File %s is not recognized as a binary PGM/PPM/PAM file", input->name);
+   }
+
+   if(width <= 0 || height <= 0 || depth < 1 || depth > 4 || maxval < 1 || maxval > 65535)
+      abort_("[read_pnm] File %s has an unsupported header", input->name);
+
+   static const pixel_format_t formats[] = { PIXEL_GRAY8, PIXEL_GRAY_ALPHA16, PIXEL_RGB24, PIXEL_RGBA32 };
+   static const png_byte color_types[]   = { PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGBA };
+
+   image_t_init(image);
+   image->width      = width;
+   image->height     = height;
+   image->color_type = color_types[depth - 1];
+   image->bit_depth  = (maxval > 255) ? 16 : 8;
+   image->format     = formats[depth - 1];
+
+   const size_t size = (size_t) width * height * depth * (maxval > 255 ? 2 : 1);
+   if(maxval == 255)
+   {
+      input_t_check_memory(input, input_t_payload_memory(input, size), max_memory);
+      // Pixels are already in our format, use them directly
+      image_t_load_payload(image, input, size);
+   }
+   else
+   {
+      // The samples are converted into an image of their own, 8 bit or rgba64
+      input_t_check_memory(input, input_t_payload_memory(input, size) + (size_t) width * height * (maxval > 255 ? 8 : depth), max_memory);
+      image_t samples;
+      image_t_init(&samples);
+      image_t_load_payload(&samples, input, size);
+      pnm_convert((const unsigned char*) samples.data, image, depth, maxval);
+      image_t_destroy(&samples);
+   }
+
+   return SUCCESS;
+}
+
+/**
+ * Raw rgba32.
+ **/
+status_t
+image_t_read_raw
+   (  input_t* const input
+   ,  image_t* const image
+   ,  int            width
+   ,  int            height
+   ,  size_t         max_memory
+   )
+{
+   const size_t size = (size_t) width * height * sizeof(color32_t);
+   input_t_check_memory(input, input_t_payload_memory(input, size), max_memory);
+
+   image_t_init(image);
+   image->width      = width;
+   image->height     = height;
+   image->color_type = PNG_COLOR_TYPE_RGBA;
+   image->bit_depth  = 8;
+   image->format     = PIXEL_RGBA32;
+
+   image_t_load_payload(image, input, size);
+
+   return SUCCESS;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#ifndef FORMATS_H_INCLUDED
+#define FORMATS_H_INCLUDED
+
+#include "image.h"
+#include "input.h"
+
+/**
+ * Fast-path readers for uncompressed or cheaply compressed image formats.
+ * When the input is memory-mapped, uncompressed pixel data is used directly from the mapping (STORAGE_MAPPED),
+ * so no copy of the pixels is ever made.
+ * The heap memory a read takes (decoded pixels, and buffered input) is limited to max_memory bytes, 0 for no limit.
+ * It is checked from the header before any pixels are read, and reads that do not fit abort.
+ **/
+typedef enum
+{  FORMAT_UNKNOWN
+,  FORMAT_PNG
+,  FORMAT_QOI
+,  FORMAT_PNM   // Binary PGM (P5), PPM (P6) and PAM (P7)
+}  file_format_t;
+
+//! Detect file format from the magic bytes at the current input position, without consuming them.
+file_format_t 
+input_t_detect_format
+   (  input_t* const input
+   );
+
+//! Read a QOI image as rgb24 or rgba32.
+status_t 
+image_t_read_qoi
+   (  input_t* const input
+   ,  image_t* const image
+   ,  size_t         max_memory
+   );
+
+//! Read a binary PGM/PPM/PAM image. 8 bit data is used as is, other max values are rescaled.
+status_t 
+image_t_read_pnm
+   (  input_t* const input
+   ,  image_t* const image
+   ,  size_t         max_memory
+   );
+
+//! Read headerless raw rgba32 data of the given size.
+status_t 
+image_t_read_raw
+   (  input_t* const input
+   ,  image_t* const image
+   ,  int            width
+   ,  int            height
+   ,  size_t         max_memory
+   );
+
+#endif /* FORMATS_H_INCLUDED */
@@ -0,0 +1,112 @@
+#include "frame_queue.h"
+
+#include <stdlib.h>
+
+void 
+frame_queue_t_init
+   (  frame_queue_t* const queue
+   ,  int                  capacity
+   )
+{
+   queue->frames   = (image_t*) malloc(capacity * sizeof(image_t));
+   queue->capacity = capacity;
+   queue->head     = 0;
+   queue->count    = 0;
+   queue->closed   = 0;
+   
+   int i;
+   for(i = 0; i < capacity; ++i)
+   {
+      image_t_init(&queue->frames[i]);
+   }
+
+   pthread_mutex_init(&queue->mutex, NULL);
+   pthread_cond_init (&queue->not_empty, NULL);
+   pthread_cond_init (&queue->not_full, NULL);
+}
+
+void 
+frame_queue_t_destroy
+   (  frame_queue_t* const queue
+   )
+{
+   int i;
+   for(i = 0; i < queue->capacity; ++i)
+   {
+      image_t_destroy(&queue->frames[i]);
+   }
+   free(queue->frames);
+   
+   pthread_mutex_destroy(&queue->mutex);
+   pthread_cond_destroy (&queue->not_empty);
+   pthread_cond_destroy (&queue->not_full);
+}
+
+int 
+frame_queue_t_push
+   (  frame_queue_t* const queue
+   ,  image_t* const       frame
+   )
+{
+   pthread_mutex_lock(&queue->mutex);
+   while(queue->count == queue->capacity && !queue->closed)
+   {
+      pthread_cond_wait(&queue->not_full, &queue->mutex);
+   }
+
+   if(queue->closed)
+   {
+      pthread_mutex_unlock(&queue->mutex);
+      return 0;
+   }
+   
+   image_t_swap(&queue->frames[(queue->head + queue->count) % queue->capacity], frame);
+   ++queue->count;
+
+   pthread_cond_signal(&queue->not_empty);
+   pthread_mutex_unlock(&queue->mutex);
+
+   return 1;
+}
+
+int 
+frame_queue_t_pop
+   (  frame_queue_t* const queue
+   ,  image_t* const       frame
+   )
+{
+   pthread_mutex_lock(&queue->mutex);
+   while(queue->count == 0 && !queue->closed)
+   {
+      pthread_cond_wait(&queue->not_empty, &queue->mutex);
+   }
+
+   if(queue->count == 0)
+   {
+      pthread_mutex_unlock(&queue->mutex);
+      return 0;
+   }
+   
+   // Leave an empty image in the slot, ready for the next push
+   image_t_destroy(frame);
+   image_t_swap(&queue->frames[queue->head], frame);
+   queue->head = (queue->head + 1) % queue->capacity;
+   --queue->count;
+
+   pthread_cond_signal(&queue->not_full);
+   pthread_mutex_unlock(&queue->mutex);
+
+   return 1;
+}
+
+void 
+frame_queue_t_close
+   (  frame_queue_t* const queue
+   )
+{
+   pthread_mutex_lock(&queue->mutex);
+   queue->closed = 1;
+   pthread_cond_broadcast(&queue->not_empty);
+   pthread_cond_broadcast(&queue->not_full);
+   pthread_mutex_unlock(&queue->mutex);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#ifndef FRAME_QUEUE_H_INCLUDED
+#define FRAME_QUEUE_H_INCLUDED
+
+#include <pthread.h>
+
+#include "image.h"
+
+/**
+ * Bounded FIFO of decoded frames, handing images from a producer thread to a consumer thread.
+ * Frames are moved in and out with image_t_swap, so pixel data is never copied.
+ **/
+typedef struct
+{
+   image_t*        frames;     // Ring buffer of capacity frames
+   int             capacity;
+   int             head;       // Index of oldest frame
+   int             count;      // Number of frames in queue
+   int             closed;     // Set when no more frames will be pushed (or popped)
+   pthread_mutex_t mutex;
+   pthread_cond_t  not_empty;
+   pthread_cond_t  not_full;
+}  frame_queue_t;
+
+//! Initialize an empty queue holding at most capacity frames.
+void 
+frame_queue_t_init
+   (  frame_queue_t* const queue
+   ,  int                  capacity
+   );
+
+//! Destroy queue, freeing any frames left in it.
+void 
+frame_queue_t_destroy
+   (  frame_queue_t* const queue
+   );
+
+/**
+ * Move frame into the queue, blocking while the queue is full. On return frame is empty.
+ * Returns 0 if the queue has been closed, in which case frame is left untouched.
+ **/
+int 
+frame_queue_t_push
+   (  frame_queue_t* const queue
+   ,  image_t* const       frame
+   );
+
+/**
+ * Move the oldest frame out of the queue into frame, blocking while the queue is empty. Any previous contents of frame are destroyed.
+ * Returns 0 when the queue is closed and has been drained.
+ **/
+int 
+frame_queue_t_pop
+   (  frame_queue_t* const queue
+   ,  image_t* const       frame
+   );
+
+//! Close queue. Wakes up all waiting threads, after which push fails and pop drains the remaining frames.
+void 
+frame_queue_t_close
+   (  frame_queue_t* const queue
+   );
+
+#endif /* FRAME_QUEUE_H_INCLUDED */
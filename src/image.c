@@ -1,10 +1,19 @@
 #include "image.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <sys/uio.h>
 
 #include "util.h"
+#include "input.h"
+#include "ssaa.h"
 
 int color32_t_is_equal_rgb
    (  const color32_t   color1
@@ -39,6 +48,92 @@ convert_color64_t_to_color32_t
    color32->a = round((double) color64->a / (double) range64 * (double) range32);
 }
 
+/**
+ * Pixel formats.
+ **/
+typedef struct
+{
+   int size;     // Bytes per pixel
+   int channels; // Number of channels
+   int depth;    // Bytes per channel
+}  pixel_format_info_t;
+
+static const pixel_format_info_t pixel_format_info[] =
+{  {  1, 1, 1 }  // PIXEL_GRAY8
+,  {  2, 2, 1 }  // PIXEL_GRAY_ALPHA16
+,  {  3, 3, 1 }  // PIXEL_RGB24
+,  {  4, 4, 1 }  // PIXEL_RGBA32
+,  {  8, 4, 2 }  // PIXEL_RGBA64
+,  {  1, 1, 1 }  // PIXEL_INDEX8
+};
+
+int 
+pixel_format_size
+   (  pixel_format_t format
+   )
+{
+   return pixel_format_info[format].size;
+}
+
+//! Get channel c of a pixel with 1 or 2 bytes per channel.
+static inline int
+pixel_channel
+   (  const unsigned char* pixel
+   ,  int                  c
+   ,  const int            depth
+   )
+{
+   return depth == 2 ? ((const uint16_t*) pixel)[c] : pixel[c];
+}
+
+//! Set channel c of a pixel with 1 or 2 bytes per channel.
+static inline void
+pixel_set_channel
+   (  unsigned char* pixel
+   ,  int            c
+   ,  int            value
+   ,  const int      depth
+   )
+{
+   if(depth == 2)
+      ((uint16_t*) pixel)[c] = value;
+   else
+      pixel[c] = value;
+}
+
+/**
+ * Get the 8 bit rgb color of a pixel packed as 0x00BBGGRR (the same layout as color32_t without alpha).
+ * 16 bit channels are rounded to 8 bits.
+ **/
+static inline uint32_t
+pixel_rgb
+   (  const unsigned char* pixel
+   ,  const int            channels
+   ,  const int            depth
+   )
+{
+   int r, g, b;
+   if(channels < 3)
+   {
+      r = g = b = pixel_channel(pixel, 0, depth);
+   }
+   else
+   {
+      r = pixel_channel(pixel, 0, depth);
+      g = pixel_channel(pixel, 1, depth);
+      b = pixel_channel(pixel, 2, depth);
+   }
+
+   if(depth == 2)
+   {
+      r = (r * 255 + 32767) / 65535;
+      g = (g * 255 + 32767) / 65535;
+      b = (b * 255 + 32767) / 65535;
+   }
+
+   return (uint32_t) r | ((uint32_t) g << 8) | ((uint32_t) b << 16);
+}
+
 void apply_gamma_correction(color32_t* color, float exposure, float gamma)
 {
    color->r = pow((exposure * color->r), gamma);
@@ -60,6 +155,27 @@ void swap_png_byte(png_byte* b1, png_byte* b2)
    *b2 = temp;
 }
 
+void swap_pixel_format(pixel_format_t* f1, pixel_format_t* f2)
+{
+   pixel_format_t temp = *f1;
+   *f1 = *f2;
+   *f2 = temp;
+}
+
+void swap_storage(image_storage_t* s1, image_storage_t* s2)
+{
+   image_storage_t temp = *s1;
+   *s1 = *s2;
+   *s2 = temp;
+}
+
+void swap_size(size_t* s1, size_t* s2)
+{
+   size_t temp = *s1;
+   *s1 = *s2;
+   *s2 = temp;
+}
+
 void swap_ptr(void** p1, void** p2)
 {
    void* temp = *p1;
@@ -70,13 +186,46 @@ void swap_ptr(void** p1, void** p2)
 /**
  * Image
  **/
+//! Initialize an empty image owning no data.
+void 
+image_t_init
+   (  image_t* image
+   )
+{
+   image->width      = 0;
+   image->height     = 0;
+   image->color_type = 0;
+   image->bit_depth  = 0;
+   image->format     = PIXEL_RGBA32;
+   image->data       = NULL;
+   image->palette    = NULL;
+   image->storage    = STORAGE_HEAP;
+   image->map        = NULL;
+   image->map_size   = 0;
+}
+
 void 
 image_t_destroy
    (  image_t* image
    )
 {
-   if(image->data)
-      free(image->data);
+   switch(image->storage)
+   {
+      case STORAGE_HEAP:
+         if(image->data)
+            free(image->data);
+         break;
+      case STORAGE_MAPPED:
+         if(image->map)
+            munmap(image->map, image->map_size);
+         break;
+      case STORAGE_BORROWED:
+         /* Not ours to free */
+         break;
+   }
+   if(image->palette)
+      free(image->palette);
+   image_t_init(image);
 }
 
 void 
@@ -89,7 +238,77 @@ image_t_swap
    swap_int(&image1->height, &image2->height);
    swap_png_byte(&image1->color_type, &image2->color_type);
    swap_png_byte(&image1->bit_depth , &image2->bit_depth );
+   swap_pixel_format(&image1->format, &image2->format);
    swap_ptr(&image1->data, &image2->data);
+   swap_ptr((void**) &image1->palette, (void**) &image2->palette);
+   swap_storage(&image1->storage, &image2->storage);
+   swap_ptr(&image1->map, &image2->map);
+   swap_size(&image1->map_size, &image2->map_size);
+}
+
+//! Release the current pixel data of image, and replace it with heap allocated data in the given format.
+static void
+image_t_replace_data
+   (  image_t* const image
+   ,  void*          data
+   ,  pixel_format_t format
+   )
+{
+   image_t replaced = *image;
+   replaced.palette = NULL;
+   image_t_destroy(&replaced);
+
+   image->data     = data;
+   image->format   = format;
+   image->storage  = STORAGE_HEAP;
+   image->map      = NULL;
+   image->map_size = 0;
+}
+
+//! Give copy its own copy of the palette of image (or NULL if image has none).
+static void
+image_t_copy_palette
+   (  const image_t* const image
+   ,        image_t* const copy
+   )
+{
+   copy->palette = NULL;
+   if(image->palette)
+   {
+      copy->palette = (color32_t*) malloc(256 * sizeof(color32_t));
+      memcpy(copy->palette, image->palette, 256 * sizeof(color32_t));
+   }
+}
+
+//! Make sure image data can be modified in place, by copying borrowed data to the heap.
+static void
+image_t_make_writable
+   (  image_t* const image
+   )
+{
+   if(image->storage != STORAGE_BORROWED)
+      return;
+
+   size_t size = (size_t) image->width * image->height * pixel_format_size(image->format);
+   void*  data = malloc(size);
+   memcpy(data, image->data, size);
+   image_t_replace_data(image, data, image->format);
+}
+
+void 
+image_t_copy
+   (  const image_t* const image
+   ,        image_t* const copy
+   )
+{
+   size_t size = (size_t) image->width * image->height * pixel_format_size(image->format);
+   *copy      = *image;
+   copy->storage  = STORAGE_HEAP;
+   copy->map      = NULL;
+   copy->map_size = 0;
+   copy->data = malloc(size);
+   memcpy(copy->data, image->data, size);
+   image_t_copy_palette(image, copy);
 }
 
 void 
@@ -102,299 +321,4133 @@ image_t_print
    printf("   height    : %i\n", image->height);
    printf("   color_type: %i\n", image->color_type);
    printf("   bit_depth : %i\n", image->bit_depth);
+   printf("   format    : %i\n", image->format);
 }
 
-status_t 
-image_t_read_png
-   (  const char* const file_name
-   ,  image_t* image
+/**
+ * PNG reading helpers.
+ **/
+typedef struct
+{
+   input_t*    input;
+   png_structp png_ptr;
+   png_infop   info_ptr;
+   int         interlace_type;
+} png_reader_t;
+
+//! libpng read callback, feeding libpng from our input_t.
+static void
+png_reader_read_data
+   (  png_structp png_ptr
+   ,  png_bytep   data
+   ,  png_size_t  length
+   )
+{
+   input_t* input = (input_t*) png_get_io_ptr(png_ptr);
+   if(input_t_read(input, data, length) != length)
+      png_error(png_ptr, "Unexpected end of input");
+}
+
+//! Start reading a PNG from input and read the header info. Image dimensions are set on image, but no data is allocated.
+static void
+png_reader_open
+   (  png_reader_t* const reader
+   ,  input_t* const      input
+   ,  image_t* const      image
    )
 {
    unsigned char header[8];    // 8 is the maximum size that can be checked
 
-   /* open file and test for it being a png */
-   FILE *fp = fopen(file_name, "rb");
-   if (!fp)
-      abort_("[read_png_file] File %s could not be opened for reading", file_name);
-   if(fread(header, 1, 8, fp) != 8)
-      abort_("[read_png_file] File %s, could not read header", file_name);
+   /* test for input being a png */
+   reader->input = input;
+   if(input_t_read(input, header, 8) != 8)
+      abort_("[read_png_file] File %s, could not read header", input->name);
    if (png_sig_cmp(header, 0, 8))
-      abort_("[read_png_file] File %s is not recognized as a PNG file", file_name);
+      abort_("[read_png_file] File %s is not recognized as a PNG file", input->name);
 
    /* initialize stuff */
-   png_structp png_ptr;
-   png_infop info_ptr;
-   int number_of_passes __termpng_attribute_unused__;
+   reader->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
-   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-   if (!png_ptr)
+   if (!reader->png_ptr)
       abort_("[read_png_file] png_create_read_struct failed");
 
-   info_ptr = png_create_info_struct(png_ptr);
-   if (!info_ptr)
+   reader->info_ptr = png_create_info_struct(reader->png_ptr);
+   if (!reader->info_ptr)
       abort_("[read_png_file] png_create_info_struct failed");
 
-   if (setjmp(png_jmpbuf(png_ptr)))
+   if (setjmp(png_jmpbuf(reader->png_ptr)))
       abort_("[read_png_file] Error during init_io");
 
-   png_init_io(png_ptr, fp);
-   png_set_sig_bytes(png_ptr, 8);
+   png_set_read_fn(reader->png_ptr, input, png_reader_read_data);
+   png_set_sig_bytes(reader->png_ptr, 8);
 
-   png_read_info(png_ptr, info_ptr);
+   png_read_info(reader->png_ptr, reader->info_ptr);
 
-   image->width      = png_get_image_width(png_ptr, info_ptr);
-   image->height     = png_get_image_height(png_ptr, info_ptr);
-   image->color_type = png_get_color_type(png_ptr, info_ptr);
-   image->bit_depth  = png_get_bit_depth(png_ptr, info_ptr);
+   image_t_init(image);
+   image->width      = png_get_image_width(reader->png_ptr, reader->info_ptr);
+   image->height     = png_get_image_height(reader->png_ptr, reader->info_ptr);
+   image->color_type = png_get_color_type(reader->png_ptr, reader->info_ptr);
+   image->bit_depth  = png_get_bit_depth(reader->png_ptr, reader->info_ptr);
 
-   number_of_passes = png_set_interlace_handling(png_ptr);
-   png_read_update_info(png_ptr, info_ptr);
+   reader->interlace_type = png_get_interlace_type(reader->png_ptr, reader->info_ptr);
+}
 
-   /* read file */
-   if (setjmp(png_jmpbuf(png_ptr)))
-      abort_("[read_png_file] Error during read_image");
+//! Close reader and free libpng structures. The input is left open.
+static void
+png_reader_close
+   (  png_reader_t* const reader
+   )
+{
+   png_destroy_read_struct(&reader->png_ptr, &reader->info_ptr, NULL);
+}
 
-   png_bytep* row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * image->height);
-   int y;
-   for (y = 0; y < image->height; ++y)
-      row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
+//! Read PLTE and tRNS into a 256 entry color32_t palette. Unused entries are opaque black.
+static color32_t*
+png_reader_read_palette
+   (  png_reader_t* const reader
+   )
+{
+   color32_t* palette = (color32_t*) calloc(256, sizeof(color32_t));
+   png_colorp plte = NULL;
+   png_bytep  trns = NULL;
+   int num_plte = 0, num_trns = 0, i;
 
-   png_read_image(png_ptr, row_pointers);
+   png_get_PLTE(reader->png_ptr, reader->info_ptr, &plte, &num_plte);
+   if(png_get_valid(reader->png_ptr, reader->info_ptr, PNG_INFO_tRNS))
+      png_get_tRNS(reader->png_ptr, reader->info_ptr, &trns, &num_trns, NULL);
 
-   image->data = malloc(image->width * image->height * sizeof(color32_t));
-   color32_t* data = (color32_t*) image->data;
-   
-   int x;
-   for(y = 0; y < image->height; ++y)
+   for(i = 0; i < 256; ++i)
    {
-      png_byte* row       = row_pointers[y];
-      for(x = 0; x < image->width; ++x)
+      palette[i].a = 255;
+      if(i < num_plte)
       {
-         png_byte* ptr = &(row[x * 4]);
-         (*data).r = ptr[0];
-         (*data).g = ptr[1];
-         (*data).b = ptr[2];
-         (*data).a = ptr[3];
-      
-         ++data;
+         palette[i].r = plte[i].red;
+         palette[i].g = plte[i].green;
+         palette[i].b = plte[i].blue;
+      }
+      if(i < num_trns)
+      {
+         palette[i].a = trns[i];
       }
    }
-   
-   /* Free row_pointers again */
-   for (y = 0; y < image->height; ++y)
-      free(row_pointers[y]);
-   free(row_pointers);
 
-   fclose(fp);
-
-   return SUCCESS;
+   return palette;
 }
 
-void 
-image_t_scale
-   (  const image_t* const image
-   ,  image_t* const       scaled
-   ,  int                  scaled_width
-   ,  int                  scaled_height
-   ,  scale_t              scale
+/**
+ * Set up libpng transformations, such that every color type is decoded directly to the most compact pixel format:
+ * palette images are kept as 8 bit indices (with image->palette set), 
+ * low bit-depth gray is expanded to 8 bits and tRNS is turned into an alpha channel.
+ * 8 bit images keep their channels (gray, gray+alpha, rgb or rgba).
+ * 16 bit images are kept at full precision as host byte order RGBA64, so averaging is done before the final down-conversion.
+ * Sets image->format.
+ **/
+static void
+png_reader_set_native_transforms
+   (  png_reader_t* const reader
+   ,  image_t* const      image
    )
 {
-   scaled_height = (scaled_height % 2 == 0) ? scaled_height : scaled_height + 1; /* make sure height is an even number */
+   png_structp png_ptr = reader->png_ptr;
+   png_byte color_type = png_get_color_type(png_ptr, reader->info_ptr);
+   png_byte bit_depth  = png_get_bit_depth (png_ptr, reader->info_ptr);
 
-   scaled->width  = scaled_width;
-   scaled->height = scaled_height;
-   scaled->color_type = image->color_type;
-   scaled->bit_depth  = image->bit_depth;
-   scaled->data   = malloc(scaled->width * scaled->height * sizeof(color32_t));
+   if(color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+      // Keep indices, unpacking 1, 2 and 4 bit indices to one byte each
+      png_set_packing(png_ptr);
+      png_read_update_info(png_ptr, reader->info_ptr);
+      image->format  = PIXEL_INDEX8;
+      image->palette = png_reader_read_palette(reader);
+      return;
+   }
 
-   int i;
-   int scaled_size = scaled->width * scaled->height;  
-   color32_t* scaled_data = (color32_t*) scaled->data;
-   color32_t  black = {0, 0, 0, 0};
-   for(i = 0; i < scaled_size; ++i)
+   if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+      png_set_expand_gray_1_2_4_to_8(png_ptr);
+   if(png_get_valid(png_ptr, reader->info_ptr, PNG_INFO_tRNS))
+      png_set_tRNS_to_alpha(png_ptr);
+
+   if(bit_depth == 16)
    {
-      scaled_data[i] = black;
+      if(color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+         png_set_gray_to_rgb(png_ptr);
+      if(!(color_type & PNG_COLOR_MASK_ALPHA))
+         png_set_add_alpha(png_ptr, 0xFFFF, PNG_FILLER_AFTER);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      png_set_swap(png_ptr);
+#endif
    }
 
-   int x_block_size_min = floor((double) image->width  / (double) scaled->width);
-   int x_block_rest     = image->width % scaled->width;
-   int y_block_size_min = floor((double) image->height / (double) scaled->height);
-   int y_block_rest     = image->height % scaled->height;
+   png_read_update_info(png_ptr, reader->info_ptr);
 
-   //printf("%i   %i   %i   %i\n", image->width,  scaled->width , y_block_size_min, y_block_rest);
-   //printf("%i   %i   %i   %i\n", image->height, scaled->height, x_block_size_min, x_block_rest);
-   //exit(2);
+   switch(png_get_channels(png_ptr, reader->info_ptr))
+   {
+      case 1: image->format = PIXEL_GRAY8;        break;
+      case 2: image->format = PIXEL_GRAY_ALPHA16; break;
+      case 3: image->format = PIXEL_RGB24;        break;
+      case 4: image->format = (bit_depth == 16) ? PIXEL_RGBA64 : PIXEL_RGBA32; break;
+      default: abort_("[read_png_file] Unsupported number of channels");
+   }
 
-   color32_t* data       = (color32_t*) image->data;
-   color32_t* scale_data = (color32_t*) scaled->data;
-   int sum[scaled->width][5];
+   assert(png_get_rowbytes(png_ptr, reader->info_ptr) == (size_t) image->width * pixel_format_size(image->format));
+}
 
-   color32_t* scale_data_row;
-   color32_t* data_row;
+//! Decode the full image of an opened reader directly into image storage.
+static void
+png_reader_read_image
+   (  png_reader_t* const reader
+   ,  image_t* const      image
+   )
+{
+   int number_of_passes __termpng_attribute_unused__;
+   number_of_passes = png_set_interlace_handling(reader->png_ptr);
+   png_reader_set_native_transforms(reader, image);
 
-   switch(scale)
-   {
-      case SCALE_FIRST:
-      case SCALE_LAST:
-      case SCALE_CENTER:
-      {
-         int y_scaled, x_scaled;
-         for(y_scaled = 0; y_scaled < scaled->height; ++y_scaled)
-         {
-            int y_block_size = y_block_size_min + (y_scaled < y_block_rest ? 1 : 0);
-            
-            int y_block;
-            if(scale == SCALE_FIRST)
-               y_block = 0;
-            else if(scale == SCALE_LAST)
-               y_block = y_block_size - 1;
-            else if(scale == SCALE_CENTER)
-               y_block = ceil((double) y_block_size / 2.0);
-
-            scale_data_row = scale_data + y_scaled * scaled->width;
-            const int shift = ( y_scaled * y_block_size_min + y_block + min(y_scaled, y_block_rest)) * image->width;
-            data_row = data + shift;
-            for(x_scaled = 0; x_scaled < scaled->width; ++x_scaled)
-            {
-               scale_data_row->r = data_row->r;
-               scale_data_row->g = data_row->g;
-               scale_data_row->b = data_row->b;
-               scale_data_row->a = data_row->a;
-               data_row += y_block_size;
-               ++scale_data_row;
-            }
-         }
-         break;
-      }
-      case SCALE_SSAA:
-      {
-         int y_block, x_block;
-         int y_scaled, x_scaled;
-         for(y_scaled = 0; y_scaled < scaled->height; ++y_scaled)
-         {  
-            for(x_scaled = 0; x_scaled < scaled->width; ++x_scaled)
-            {
-               sum[x_scaled][0] = 0;  // r
-               sum[x_scaled][1] = 0;  // g
-               sum[x_scaled][2] = 0;  // b
-               sum[x_scaled][3] = 0;  // a
-               sum[x_scaled][4] = 0;  // #
-            }
+   if (setjmp(png_jmpbuf(reader->png_ptr)))
+      abort_("[read_png_file] Error during read_image");
 
-            int y_block_size = y_block_size_min + (y_scaled < y_block_rest ? 1 : 0);
-            for(y_block = 0; y_block < y_block_size; ++y_block)
-            {
-               const int shift = ( y_scaled * y_block_size_min + y_block + min(y_scaled, y_block_rest)) * image->width;
-               data_row = data + shift;
-               for(x_scaled = 0; x_scaled < scaled->width; ++x_scaled)
-               {
-                  int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
-                  for(x_block = 0; x_block < x_block_size; ++x_block)
-                  {
-                     sum[x_scaled][0] += data_row->r;
-                     sum[x_scaled][1] += data_row->g;
-                     sum[x_scaled][2] += data_row->b;
-                     sum[x_scaled][3] += data_row->a;
-                     sum[x_scaled][4] += 1;
-                     ++data_row;
-                  }
-               }
-            }
-            
-            scale_data_row = scale_data + y_scaled * scaled->width;
-            for(x_scaled = 0; x_scaled < scaled->width; ++x_scaled)
-            {
-               double pixel_scale = 1.0 / sum[x_scaled][4];
-               scale_data_row[x_scaled].r = ceil((double) sum[x_scaled][0] * pixel_scale);
-               scale_data_row[x_scaled].g = ceil((double) sum[x_scaled][1] * pixel_scale);
-               scale_data_row[x_scaled].b = ceil((double) sum[x_scaled][2] * pixel_scale);
-               scale_data_row[x_scaled].a = ceil((double) sum[x_scaled][3] * pixel_scale);
-            }
-         }
-         break;
-      }
+   const size_t row_size = (size_t) image->width * pixel_format_size(image->format);
+   image->data = malloc(row_size * image->height);
 
-      default:
-      {
-         abort_("[scale_image] Unknown SCALE type.");
-         break;
-      }
-   }
+   png_bytep* row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * image->height);
+   int y;
+   for (y = 0; y < image->height; ++y)
+      row_pointers[y] = (png_bytep) image->data + y * row_size;
+
+   png_read_image(reader->png_ptr, row_pointers);
+   png_read_end(reader->png_ptr, NULL);
+   
+   free(row_pointers);
 }
 
-void 
-image_t_scale_percent
-   (  const image_t* const image
-   ,  image_t* const       scaled
-   ,  double               percent
-   ,  scale_t              scale
+status_t 
+image_t_read_png
+   (  input_t* const input
+   ,  image_t* image
    )
 {
-   int width  = round(image->width  * percent);
-   int height = round(image->height * percent);
-   image_t_scale(image, scaled, width, height, scale);
+   png_reader_t reader;
+   png_reader_open(&reader, input, image);
+   png_reader_read_image(&reader, image);
+   png_reader_close(&reader);
+
+   return SUCCESS;
 }
 
-void 
-image_t_crop
-   (  const image_t* const image
-   ,  image_t*       const cropped
-   ,  int x_crop_begin
-   ,  int y_crop_begin
-   ,  int x_crop_end
-   ,  int y_crop_end
+/**
+ * SSAA helpers. 
+ * The source is split into blocks of x_block_size_min (+ 1 for the first x_block_rest blocks) pixels along x,
+ * and each output pixel is the average of its block. sum[x][0..3] holds the channel sums and sum[x][4] the number of pixels accumulated.
+ * Sums are 64 bit, so 16 bit channels cannot overflow for any block size.
+ * The *_generic functions are always inlined with constant channels/depth, giving one specialised loop per pixel format.
+ * Averages of palette colors are generally not in the palette, so index8 images are averaged into rgba32.
+ * Averages are rounded up, ceil(sum / n), in exact integer arithmetic.
+ * Colors of pixels with alpha are summed premultiplied, color * alpha, and stored as ceil(sum / alpha sum),
+ * so fully transparent pixels do not darken the edges of the image. Opaque pixels give the same result as a plain average.
+ **/
+typedef ssaa_sum64_t ssaa_sum_t;
+
+//! Number of channels that are colors rather than alpha.
+static inline __attribute__((always_inline)) int
+color_channels
+   (  const int channels
    )
 {
-   y_crop_end = min(image->height, y_crop_end);
-   x_crop_end = min(image->width , x_crop_end);
+   return (channels == 2 || channels == 4) ? channels - 1 : channels;
+}
 
-   cropped->width  = x_crop_end - x_crop_begin;
-   cropped->height = y_crop_end - y_crop_begin;
-   cropped->color_type = image->color_type;
-   cropped->bit_depth  = image->bit_depth;
-   cropped->data   = malloc(cropped->width * cropped->height * sizeof(color32_t));
+//! Pixel format of the SSAA output for a given input format.
+static pixel_format_t
+ssaa_format
+   (  pixel_format_t format
+   )
+{
+   return format == PIXEL_INDEX8 ? PIXEL_RGBA32 : format;
+}
 
-   color32_t* data_row;
-   color32_t* cropped_data = (color32_t*) cropped->data;
-   
-   int y, x;
-   for(y = y_crop_begin; y < y_crop_end; ++y)
+//! Whether SSAA of format has an alpha channel (index8 through its rgba palette), so colors are premultiplied.
+static int
+ssaa_has_alpha
+   (  pixel_format_t format
+   )
+{
+   return pixel_format_info[ssaa_format(format)].channels % 2 == 0;
+}
+
+static void
+ssaa_clear_row
+   (  ssaa_sum_t* sum
+   ,  int         scaled_width
+   )
+{
+   memset(sum, 0, scaled_width * sizeof(ssaa_sum_t));
+}
+
+static inline __attribute__((always_inline)) void
+ssaa_accumulate_row_generic
+   (  const unsigned char* data_row
+   ,  ssaa_sum_t*          sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  const int            channels
+   ,  const int            depth
+   )
+{
+   int x_scaled, x_block, c;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
    {
-      data_row = (color32_t*) image->data + y * image->width + x_crop_begin;
-      // NB: Can do something faster here with a memcpy, just copy a whole row of bits, no need for a forloop
-      for(x = x_crop_begin; x < x_crop_end; ++x) 
+      int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+      for(x_block = 0; x_block < x_block_size; ++x_block)
       {
-         cropped_data->r = data_row->r;
-         cropped_data->g = data_row->g;
-         cropped_data->b = data_row->b;
-         cropped_data->a = data_row->a;
-         ++cropped_data;
-         ++data_row;
+         const int64_t alpha = (color_channels(channels) < channels) ? pixel_channel(data_row, channels - 1, depth) : 1;
+         for(c = 0; c < channels; ++c)
+         {
+            sum[x_scaled][c] += (c < color_channels(channels)) ? pixel_channel(data_row, c, depth) * alpha : pixel_channel(data_row, c, depth);
+         }
+         data_row += channels * depth;
       }
+      sum[x_scaled][4] += x_block_size;
    }
 }
 
-void 
-image_t_apply_background
-   (  image_t* const  image
-   ,  int r
-   ,  int g
-   ,  int b
+static void
+ssaa_accumulate_row_index
+   (  const unsigned char* data_row
+   ,  ssaa_sum_t*          sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  const color32_t*     palette
    )
 {
-   int i;
-   int size        = image->width * image->height;
-   color32_t* data = image->data;
-   for(i = 0; i < size; ++i)
+   int x_scaled, x_block;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
    {
-      double alpha = (double) data->a / (double)255;
-      
-      data->r = data->r * alpha + r * (1.0 - alpha);
-      data->g = data->g * alpha + g * (1.0 - alpha);
-      data->b = data->b * alpha + b * (1.0 - alpha);
+      int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+      for(x_block = 0; x_block < x_block_size; ++x_block)
+      {
+         const color32_t color = palette[*data_row++];
+         sum[x_scaled][0] += color.r * color.a;
+         sum[x_scaled][1] += color.g * color.a;
+         sum[x_scaled][2] += color.b * color.a;
+         sum[x_scaled][3] += color.a;
+      }
+      sum[x_scaled][4] += x_block_size;
+   }
+}
 
-      ++data;
+static void
+ssaa_accumulate_row
+   (  const void*      data_row
+   ,  ssaa_sum_t*      sum
+   ,  int              scaled_width
+   ,  int              x_block_size_min
+   ,  int              x_block_rest
+   ,  pixel_format_t   format
+   ,  const color32_t* palette
+   )
+{
+   switch(format)
+   {
+      case PIXEL_GRAY8:
+         ssaa_accumulate_row_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 1, 1);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         ssaa_accumulate_row_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 2, 1);
+         break;
+      case PIXEL_RGB24:
+         ssaa_accumulate_row_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 3, 1);
+         break;
+      case PIXEL_RGBA32:
+         ssaa_accumulate_row_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, 1);
+         break;
+      case PIXEL_RGBA64:
+         ssaa_accumulate_row_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, 2);
+         break;
+      case PIXEL_INDEX8:
+         ssaa_accumulate_row_index(data_row, sum, scaled_width, x_block_size_min, x_block_rest, palette);
+         break;
+   }
+}
+
+/**
+ * If background is given (in the range of the channel depth), colors with alpha are blended onto it,
+ * ceil((sum + background * (max * n - alpha sum)) / (max * n)), which is the premultiplied average over the background.
+ **/
+static inline __attribute__((always_inline)) void
+ssaa_store_row_generic
+   (  unsigned char* scale_data_row
+   ,  ssaa_sum_t*    sum
+   ,  int            scaled_width
+   ,  const int*     background
+   ,  const int      channels
+   ,  const int      depth
+   )
+{
+   const int64_t channel_max = (depth == 2) ? 65535 : 255;
+   int x_scaled, c;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      // Empty blocks (when upscaling) are left black
+      const int64_t n     = sum[x_scaled][4];
+      const int64_t alpha = sum[x_scaled][channels - 1];
+      for(c = 0; c < channels; ++c)
+      {
+         int64_t value;
+         if(c == color_channels(channels))
+            value = n ? (alpha + n - 1) / n : 0;
+         else if(color_channels(channels) == channels)
+            value = n ? (sum[x_scaled][c] + n - 1) / n : 0;
+         else if(background)
+            value = n ? (sum[x_scaled][c] + background[c] * (channel_max * n - alpha) + channel_max * n - 1) / (channel_max * n) : 0;
+         else
+            value = alpha ? (sum[x_scaled][c] + alpha - 1) / alpha : 0;
+         pixel_set_channel(scale_data_row, c, value, depth);
+      }
+      scale_data_row += channels * depth;
+   }
+}
+
+static void
+ssaa_store_row
+   (  void*          scale_data_row
+   ,  ssaa_sum_t*    sum
+   ,  int            scaled_width
+   ,  pixel_format_t format
+   ,  const int*     background
+   )
+{
+   switch(format)
+   {
+      case PIXEL_GRAY8:
+         ssaa_store_row_generic(scale_data_row, sum, scaled_width, NULL, 1, 1);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         ssaa_store_row_generic(scale_data_row, sum, scaled_width, background, 2, 1);
+         break;
+      case PIXEL_RGB24:
+         ssaa_store_row_generic(scale_data_row, sum, scaled_width, NULL, 3, 1);
+         break;
+      case PIXEL_RGBA32:
+         ssaa_store_row_generic(scale_data_row, sum, scaled_width, background, 4, 1);
+         break;
+      case PIXEL_RGBA64:
+         ssaa_store_row_generic(scale_data_row, sum, scaled_width, background, 4, 2);
+         break;
+      case PIXEL_INDEX8:
+         abort_("[scale_image] Cannot store SSAA result as index8.");
+         break;
+   }
+}
+
+/**
+ * Linear-light SSAA (SCALE_SSAA_LINEAR).
+ * Color channels are converted from sRGB to 16 bit linear light through srgb_to_linear before summing,
+ * and the rounded average is converted back through the 16 bit linear_to_srgb table, so no pow() is evaluated per pixel.
+ * Alpha is already linear and is only widened to 16 bit, and colors are premultiplied by it as in ssaa_accumulate_row.
+ * Both tables are built once, on first use.
+ **/
+static uint16_t srgb_to_linear[257]; // 8 bit sRGB to 16 bit linear, with a final entry for interpolating 16 bit input
+static uint16_t linear_to_srgb[65536];
+static pthread_once_t linear_tables_once = PTHREAD_ONCE_INIT;
+
+static void
+linear_tables_init
+   (
+   )
+{
+   int i;
+   for(i = 0; i < 256; ++i)
+   {
+      const double s = i / 255.0;
+      srgb_to_linear[i] = (uint16_t) lround((s <= 0.04045 ? s / 12.92 : pow((s + 0.055) / 1.055, 2.4)) * 65535.0);
+   }
+   srgb_to_linear[256] = 65535;
+   for(i = 0; i < 65536; ++i)
+   {
+      const double l = i / 65535.0;
+      linear_to_srgb[i] = (uint16_t) lround((l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055) * 65535.0);
+   }
+}
+
+//! 16 bit linear value of a channel. 16 bit sRGB is interpolated between the 8 bit table entries.
+static inline __attribute__((always_inline)) int
+linear_channel
+   (  const unsigned char* pixel
+   ,  int                  c
+   ,  const int            channels
+   ,  const int            depth
+   )
+{
+   const int value = pixel_channel(pixel, c, depth);
+   if(c >= color_channels(channels))
+      return depth == 2 ? value : value * 257;
+   if(depth == 1)
+      return srgb_to_linear[value];
+   // 16 bit value v sits at v / 257 between 8 bit entries
+   const int lo = srgb_to_linear[value / 257];
+   const int hi = srgb_to_linear[value / 257 + 1];
+   return lo + (hi - lo) * (value % 257) / 257;
+}
+
+static inline __attribute__((always_inline)) void
+ssaa_accumulate_row_linear_generic
+   (  const unsigned char* data_row
+   ,  ssaa_sum_t*          sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  const int            channels
+   ,  const int            depth
+   ,  const color32_t*     palette
+   )
+{
+   int x_scaled, x_block, c;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      // Sum the block in registers, as data_row may alias sum
+      int     x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+      int64_t block_sum[4] = { 0, 0, 0, 0 };
+      for(x_block = 0; x_block < x_block_size; ++x_block)
+      {
+         const unsigned char* pixel = palette ? (const unsigned char*) &palette[*data_row] : data_row;
+         const int64_t        alpha = (color_channels(channels) < channels) ? linear_channel(pixel, channels - 1, channels, depth) : 1;
+         for(c = 0; c < channels; ++c)
+         {
+            block_sum[c] += (c < color_channels(channels)) ? linear_channel(pixel, c, channels, depth) * alpha : linear_channel(pixel, c, channels, depth);
+         }
+         data_row += palette ? 1 : channels * depth;
+      }
+      for(c = 0; c < channels; ++c)
+      {
+         sum[x_scaled][c] += block_sum[c];
+      }
+      sum[x_scaled][4] += x_block_size;
+   }
+}
+
+static void
+ssaa_accumulate_row_linear
+   (  const void*      data_row
+   ,  ssaa_sum_t*      sum
+   ,  int              scaled_width
+   ,  int              x_block_size_min
+   ,  int              x_block_rest
+   ,  pixel_format_t   format
+   ,  const color32_t* palette
+   )
+{
+   switch(format)
+   {
+      case PIXEL_GRAY8:
+         ssaa_accumulate_row_linear_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 1, 1, NULL);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         ssaa_accumulate_row_linear_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 2, 1, NULL);
+         break;
+      case PIXEL_RGB24:
+         ssaa_accumulate_row_linear_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 3, 1, NULL);
+         break;
+      case PIXEL_RGBA32:
+         ssaa_accumulate_row_linear_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, 1, NULL);
+         break;
+      case PIXEL_RGBA64:
+         ssaa_accumulate_row_linear_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, 2, NULL);
+         break;
+      case PIXEL_INDEX8:
+         ssaa_accumulate_row_linear_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, 1, palette);
+         break;
+   }
+}
+
+//! Averages are rounded to nearest in linear light, and then converted back to sRGB.
+static inline __attribute__((always_inline)) void
+ssaa_store_row_linear_generic
+   (  unsigned char* scale_data_row
+   ,  ssaa_sum_t*    sum
+   ,  int            scaled_width
+   ,  const int      channels
+   ,  const int      depth
+   )
+{
+   int x_scaled, c;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      // Colors with alpha are premultiplied by the 16 bit alpha
+      const int64_t n       = sum[x_scaled][4];
+      const int64_t divisor = (color_channels(channels) < channels) ? sum[x_scaled][channels - 1] : n;
+      for(c = 0; c < channels; ++c)
+      {
+         int value;
+         if(c < color_channels(channels))
+            value = linear_to_srgb[divisor ? (sum[x_scaled][c] + divisor / 2) / divisor : 0];
+         else
+            value = n ? (sum[x_scaled][c] + n / 2) / n : 0;
+         pixel_set_channel(scale_data_row, c, depth == 2 ? value : (value * 255 + 32767) / 65535, depth);
+      }
+      scale_data_row += channels * depth;
+   }
+}
+
+static void
+ssaa_store_row_linear
+   (  void*          scale_data_row
+   ,  ssaa_sum_t*    sum
+   ,  int            scaled_width
+   ,  pixel_format_t format
+   )
+{
+   switch(format)
+   {
+      case PIXEL_GRAY8:
+         ssaa_store_row_linear_generic(scale_data_row, sum, scaled_width, 1, 1);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         ssaa_store_row_linear_generic(scale_data_row, sum, scaled_width, 2, 1);
+         break;
+      case PIXEL_RGB24:
+         ssaa_store_row_linear_generic(scale_data_row, sum, scaled_width, 3, 1);
+         break;
+      case PIXEL_RGBA32:
+         ssaa_store_row_linear_generic(scale_data_row, sum, scaled_width, 4, 1);
+         break;
+      case PIXEL_RGBA64:
+         ssaa_store_row_linear_generic(scale_data_row, sum, scaled_width, 4, 2);
+         break;
+      case PIXEL_INDEX8:
+         abort_("[scale_image] Cannot store SSAA result as index8.");
+         break;
+   }
+}
+
+/**
+ * SSAA row accumulator.
+ * For 8 bit formats, the SIMD kernel for the CPU (see ssaa.h) is used when blocks are small enough for 32 bit sums,
+ * otherwise the scalar 64 bit path. Both give bit-identical results. 
+ * Linear-light averaging accumulates with the kernel into the 64 bit sums of the scalar path, 
+ * when block rows are narrow enough, and always stores in scalar code.
+ **/
+typedef struct
+{
+   int                  scaled_width;
+   int                  x_block_size_min;
+   int                  x_block_rest;
+   int                  y_block_size;     // Rows accumulated since last store
+   pixel_format_t       format;           // Source format
+   const color32_t*     palette;
+   int                  linear;           // Average in linear light
+   int                  blend;            // Blend onto background when storing
+   int                  background[3];    // Background color in the range of the source depth
+   const ssaa_kernel_t* kernel;           // SIMD kernel, or NULL for the scalar path
+   ssaa_sum_t*          sum;              // Sums for the scalar path
+   ssaa_sum32_t*        sum32;            // Sums for the SIMD kernel
+}  ssaa_t;
+
+static void
+ssaa_t_init
+   (  ssaa_t* const    ssaa
+   ,  int              scaled_width
+   ,  int              x_block_size_min
+   ,  int              x_block_rest
+   ,  int              y_block_size_min
+   ,  pixel_format_t   format
+   ,  const color32_t* palette
+   ,  int              linear
+   )
+{
+   ssaa->scaled_width     = scaled_width;
+   ssaa->x_block_size_min = x_block_size_min;
+   ssaa->x_block_rest     = x_block_rest;
+   ssaa->y_block_size     = 0;
+   ssaa->format           = format;
+   ssaa->palette          = palette;
+   ssaa->linear           = linear;
+   ssaa->blend            = 0;
+   ssaa->kernel           = NULL;
+   ssaa->sum              = NULL;
+   ssaa->sum32            = NULL;
+   
+   if(linear)
+   {
+      pthread_once(&linear_tables_once, linear_tables_init);
+      if(  (pixel_format_info[format].depth == 1)
+        && (x_block_size_min >= 1)
+        && (x_block_size_min + 1 <= (ssaa_has_alpha(format) ? SSAA_KERNEL_LINEAR_MAX_WIDTH_ALPHA : SSAA_KERNEL_LINEAR_MAX_WIDTH))
+        )
+      {
+         ssaa->kernel = ssaa_kernel_get();
+      }
+   }
+   else if(  (pixel_format_info[format].depth == 1)
+     && (x_block_size_min >= 1)
+     && (y_block_size_min >= 1)
+     && ((int64_t) (x_block_size_min + 1) * (y_block_size_min + 1) <= (ssaa_has_alpha(format) ? SSAA_KERNEL_MAX_AREA_ALPHA : SSAA_KERNEL_MAX_AREA))
+     )
+   {
+      ssaa->kernel = ssaa_kernel_get();
+   }
+
+   if(ssaa->kernel && !linear)
+   {
+      ssaa->sum32 = (ssaa_sum32_t*) calloc(scaled_width, sizeof(ssaa_sum32_t));
+   }
+   else
+   {
+      ssaa->sum = (ssaa_sum_t*) calloc(scaled_width, sizeof(ssaa_sum_t));
+   }
+}
+
+/**
+ * Blend stored pixels onto background color r, g, b (8 bit), as image_t_apply_background would after scaling.
+ * Only for formats where the blend keeps the format (so gray+alpha needs a gray background), and not in linear light.
+ **/
+static void
+ssaa_t_set_background
+   (  ssaa_t* const ssaa
+   ,  int           r
+   ,  int           g
+   ,  int           b
+   )
+{
+   const int scale = (pixel_format_info[ssaa->format].depth == 2) ? 257 : 1;
+   assert(!ssaa->linear);
+   assert(ssaa->format != PIXEL_GRAY_ALPHA16 || (r == g && g == b));
+   ssaa->blend         = 1;
+   ssaa->background[0] = r * scale;
+   ssaa->background[1] = g * scale;
+   ssaa->background[2] = b * scale;
+}
+
+static void
+ssaa_t_destroy
+   (  ssaa_t* const ssaa
+   )
+{
+   free(ssaa->sum);
+   free(ssaa->sum32);
+}
+
+//! Heap memory of the sums.
+static size_t
+ssaa_t_memory
+   (  const ssaa_t* const ssaa
+   )
+{
+   return (size_t) ssaa->scaled_width * (ssaa->sum32 ? sizeof(ssaa_sum32_t) : sizeof(ssaa_sum_t));
+}
+
+//! Add a source row to the current output row.
+static void
+ssaa_t_accumulate_row
+   (  ssaa_t* const ssaa
+   ,  const void*   data_row
+   )
+{
+   const int channels = (ssaa->format == PIXEL_INDEX8) ? 4 : pixel_format_info[ssaa->format].channels;
+   if(ssaa->kernel && ssaa->linear)
+   {
+      ssaa->kernel->accumulate_row_linear(data_row, ssaa->sum, ssaa->scaled_width, ssaa->x_block_size_min, ssaa->x_block_rest, channels, ssaa->format == PIXEL_INDEX8 ? ssaa->palette : NULL, srgb_to_linear);
+   }
+   else if(ssaa->kernel)
+   {
+      ssaa->kernel->accumulate_row(data_row, ssaa->sum32, ssaa->scaled_width, ssaa->x_block_size_min, ssaa->x_block_rest, channels, ssaa->format == PIXEL_INDEX8 ? ssaa->palette : NULL);
+   }
+   else if(ssaa->linear)
+   {
+      ssaa_accumulate_row_linear(data_row, ssaa->sum, ssaa->scaled_width, ssaa->x_block_size_min, ssaa->x_block_rest, ssaa->format, ssaa->palette);
+   }
+   else
+   {
+      ssaa_accumulate_row(data_row, ssaa->sum, ssaa->scaled_width, ssaa->x_block_size_min, ssaa->x_block_rest, ssaa->format, ssaa->palette);
+   }
+   ++ssaa->y_block_size;
+}
+
+//! Store the current output row in ssaa_format(format), and start the next one.
+static void
+ssaa_t_store_row
+   (  ssaa_t* const ssaa
+   ,  void*         scale_data_row
+   )
+{
+   if(ssaa->kernel && !ssaa->linear)
+   {
+      const int channels = pixel_format_info[ssaa_format(ssaa->format)].channels;
+      ssaa->kernel->store_row(scale_data_row, ssaa->sum32, ssaa->scaled_width, ssaa->x_block_size_min, ssaa->x_block_rest, ssaa->y_block_size, channels, ssaa->blend ? ssaa->background : NULL);
+      memset(ssaa->sum32, 0, ssaa->scaled_width * sizeof(ssaa_sum32_t));
+   }
+   else
+   {
+      if(ssaa->linear)
+         ssaa_store_row_linear(scale_data_row, ssaa->sum, ssaa->scaled_width, ssaa_format(ssaa->format));
+      else
+         ssaa_store_row(scale_data_row, ssaa->sum, ssaa->scaled_width, ssaa_format(ssaa->format), ssaa->blend ? ssaa->background : NULL);
+      ssaa_clear_row(ssaa->sum, ssaa->scaled_width);
+   }
+   ssaa->y_block_size = 0;
+}
+
+/**
+ * Pooling scale (SCALE_MAX, SCALE_MIN, SCALE_MEDIAN and SCALE_MODE) over the same blocks as SSAA.
+ * Source rows are pushed into per output pixel state, and results are stored once a block row is complete, as for ssaa_t.
+ * Max and min keep the extreme of each channel.
+ * Median keeps a histogram of each channel, POOL_COARSE_BINS groups of POOL_FINE_BINS bins, and a mask of the non-empty groups,
+ * so finding the median and clearing the histogram visit only the non-empty groups whatever the block area. Blocks of at most POOL_SORT_MAX_AREA pixels just keep their values and rank them.
+ * 16 bit channels are binned by their high byte, so the state per output pixel stays the same whatever the block area.
+ * Their median has 8 bit precision: it is the high byte of the exact median, scaled by 257 to the 16 bit range,
+ * so it is exact for 16 bit images of 8 bit data and otherwise off by at most 255.
+ * Mode counts whole pixels in a hash table shared by the output row, keyed by output pixel and color, and tracks the
+ * most frequent color of each output pixel as counts grow (ties go to the color that got there first).
+ * Index8 is pooled on its palette colors into rgba32, as for SSAA.
+ **/
+#define POOL_COARSE_BINS   16
+#define POOL_FINE_BINS     16
+#define POOL_SORT_MAX_AREA 16
+
+typedef struct
+{
+   uint32_t used;   // Bit mask of non-empty coarse bins
+   uint32_t fine[POOL_COARSE_BINS * POOL_FINE_BINS];
+}  pool_histogram_t;
+
+typedef struct
+{
+   uint64_t color;
+   int      x_scaled;
+   uint32_t count;   // 0 for an empty entry
+}  pool_mode_entry_t;
+
+typedef struct
+{
+   int                  scaled_width;
+   int                  x_block_size_min;
+   int                  x_block_rest;
+   int                  y_block_size;     // Rows accumulated since last store
+   pixel_format_t       format;           // Source format
+   const color32_t*     palette;
+   scale_t              scale;
+   int32_t*             extreme;          // Max or min of each channel of each output pixel
+   pool_histogram_t*    histogram;        // Median histogram of each channel of each output pixel
+   uint8_t*             values;           // Median values of each channel of each output pixel, for small blocks
+   pool_mode_entry_t*   table;            // Mode hash table, table_size entries (a power of 2)
+   int                  table_bits;
+   size_t               table_used;
+   uint64_t*            mode_color;       // Most frequent color of each output pixel so far
+   uint32_t*            mode_count;
+}  pool_t;
+
+//! Number of channels of the pooled pixels.
+static int
+pool_channels
+   (  const pool_t* const pool
+   )
+{
+   return pixel_format_info[ssaa_format(pool->format)].channels;
+}
+
+static void
+pool_t_clear_extreme
+   (  pool_t* const pool
+   )
+{
+   const size_t size = (size_t) pool->scaled_width * pool_channels(pool);
+   size_t i;
+   for(i = 0; i < size; ++i)
+   {
+      pool->extreme[i] = (pool->scale == SCALE_MAX) ? -1 : INT32_MAX;
+   }
+}
+
+static void
+pool_t_init
+   (  pool_t* const    pool
+   ,  int              scaled_width
+   ,  int              x_block_size_min
+   ,  int              x_block_rest
+   ,  int              y_block_size_max
+   ,  pixel_format_t   format
+   ,  const color32_t* palette
+   ,  scale_t          scale
+   )
+{
+   pool->scaled_width     = scaled_width;
+   pool->x_block_size_min = x_block_size_min;
+   pool->x_block_rest     = x_block_rest;
+   pool->y_block_size     = 0;
+   pool->format           = format;
+   pool->palette          = palette;
+   pool->scale            = scale;
+   pool->extreme          = NULL;
+   pool->histogram        = NULL;
+   pool->values           = NULL;
+   pool->table            = NULL;
+   pool->table_bits       = 0;
+   pool->table_used       = 0;
+   pool->mode_color       = NULL;
+   pool->mode_count       = NULL;
+
+   switch(scale)
+   {
+      case SCALE_MAX:
+      case SCALE_MIN:
+         pool->extreme = (int32_t*) malloc((size_t) scaled_width * pool_channels(pool) * sizeof(int32_t));
+         pool_t_clear_extreme(pool);
+         break;
+      case SCALE_MEDIAN:
+         if((int64_t) (x_block_size_min + (x_block_rest ? 1 : 0)) * y_block_size_max <= POOL_SORT_MAX_AREA)
+            pool->values = (uint8_t*) calloc((size_t) scaled_width * pool_channels(pool), POOL_SORT_MAX_AREA); // Whole vectors are loaded
+         else
+            pool->histogram = (pool_histogram_t*) calloc((size_t) scaled_width * pool_channels(pool), sizeof(pool_histogram_t));
+         break;
+      case SCALE_MODE:
+         pool->table_bits = 4;
+         while((1 << pool->table_bits) < 2 * scaled_width)
+            ++pool->table_bits;
+         pool->table      = (pool_mode_entry_t*) calloc((size_t) 1 << pool->table_bits, sizeof(pool_mode_entry_t));
+         pool->mode_color = (uint64_t*) calloc(scaled_width, sizeof(uint64_t));
+         pool->mode_count = (uint32_t*) calloc(scaled_width, sizeof(uint32_t));
+         break;
+      default:
+         abort_("[scale_image] Not a pooling SCALE type.");
+         break;
+   }
+}
+
+static void
+pool_t_destroy
+   (  pool_t* const pool
+   )
+{
+   free(pool->extreme);
+   free(pool->histogram);
+   free(pool->values);
+   free(pool->table);
+   free(pool->mode_color);
+   free(pool->mode_count);
+}
+
+//! Heap memory of the pooled values. The mode hash table may grow later, with the number of colors in a row of blocks.
+static size_t
+pool_t_memory
+   (  const pool_t* const pool
+   )
+{
+   const size_t size = (size_t) pool->scaled_width * pool_channels(pool);
+   return (pool->extreme    ? size * sizeof(int32_t)                                   : 0)
+        + (pool->values     ? size * POOL_SORT_MAX_AREA                                : 0)
+        + (pool->histogram  ? size * sizeof(pool_histogram_t)                          : 0)
+        + (pool->table      ? ((size_t) 1 << pool->table_bits) * sizeof(pool_mode_entry_t) : 0)
+        + (pool->mode_color ? (size_t) pool->scaled_width * sizeof(uint64_t)           : 0)
+        + (pool->mode_count ? (size_t) pool->scaled_width * sizeof(uint32_t)           : 0);
+}
+
+//! Slot of color for output pixel x_scaled, either holding it or empty.
+static inline size_t
+pool_t_mode_slot
+   (  const pool_t* const pool
+   ,  uint64_t            color
+   ,  int                 x_scaled
+   )
+{
+   const size_t mask = ((size_t) 1 << pool->table_bits) - 1;
+   size_t slot = (size_t) ((color * 0x9E3779B97F4A7C15ull + (uint64_t) x_scaled * 0xC2B2AE3D27D4EB4Full) >> (64 - pool->table_bits));
+   while(pool->table[slot].count && (pool->table[slot].color != color || pool->table[slot].x_scaled != x_scaled))
+      slot = (slot + 1) & mask;
+   return slot;
+}
+
+//! Double the mode hash table.
+static void
+pool_t_mode_grow
+   (  pool_t* const pool
+   )
+{
+   pool_mode_entry_t* old_table = pool->table;
+   const size_t       old_size  = (size_t) 1 << pool->table_bits;
+   ++pool->table_bits;
+   pool->table = (pool_mode_entry_t*) calloc((size_t) 1 << pool->table_bits, sizeof(pool_mode_entry_t));
+   size_t i;
+   for(i = 0; i < old_size; ++i)
+   {
+      if(old_table[i].count)
+         pool->table[pool_t_mode_slot(pool, old_table[i].color, old_table[i].x_scaled)] = old_table[i];
+   }
+   free(old_table);
+}
+
+//! Count color run times for output pixel x_scaled.
+static inline void
+pool_t_mode_add
+   (  pool_t* const pool
+   ,  uint64_t      color
+   ,  int           x_scaled
+   ,  uint32_t      run
+   )
+{
+   size_t slot = pool_t_mode_slot(pool, color, x_scaled);
+   if(!pool->table[slot].count)
+   {
+      if(2 * (pool->table_used + 1) > ((size_t) 1 << pool->table_bits))
+      {
+         pool_t_mode_grow(pool);
+         slot = pool_t_mode_slot(pool, color, x_scaled);
+      }
+      pool->table[slot].color    = color;
+      pool->table[slot].x_scaled = x_scaled;
+      ++pool->table_used;
+   }
+   pool->table[slot].count += run;
+   if(pool->table[slot].count > pool->mode_count[x_scaled])
+   {
+      pool->mode_count[x_scaled] = pool->table[slot].count;
+      pool->mode_color[x_scaled] = color;
+   }
+}
+
+static inline __attribute__((always_inline)) void
+pool_accumulate_row_generic
+   (  pool_t* const        pool
+   ,  const unsigned char* data_row
+   ,  const int            channels
+   ,  const int            depth
+   ,  const color32_t*     palette
+   )
+{
+   const int pixel_step = palette ? 1 : channels * depth;
+   int x_scaled, x_block, c;
+   for(x_scaled = 0; x_scaled < pool->scaled_width; ++x_scaled)
+   {
+      const int x_block_size = pool->x_block_size_min + (x_scaled < pool->x_block_rest ? 1 : 0);
+      switch(pool->scale)
+      {
+         case SCALE_MAX:
+         case SCALE_MIN:
+         {
+            int32_t* const extreme = pool->extreme + (size_t) x_scaled * channels;
+            for(x_block = 0; x_block < x_block_size; ++x_block, data_row += pixel_step)
+            {
+               const unsigned char* pixel = palette ? (const unsigned char*) &palette[*data_row] : data_row;
+               for(c = 0; c < channels; ++c)
+               {
+                  extreme[c] = (pool->scale == SCALE_MAX) ? max(extreme[c], (int32_t) pixel_channel(pixel, c, depth)) 
+                                                           : min(extreme[c], (int32_t) pixel_channel(pixel, c, depth));
+               }
+            }
+            break;
+         }
+         case SCALE_MEDIAN:
+         {
+            if(pool->values)
+            {
+               // Small blocks keep their values, at index (row, column) in the block
+               uint8_t* const values = pool->values + (size_t) x_scaled * channels * POOL_SORT_MAX_AREA + pool->y_block_size * x_block_size;
+               for(x_block = 0; x_block < x_block_size; ++x_block, data_row += pixel_step)
+               {
+                  const unsigned char* pixel = palette ? (const unsigned char*) &palette[*data_row] : data_row;
+                  for(c = 0; c < channels; ++c)
+                  {
+                     values[c * POOL_SORT_MAX_AREA + x_block] = (depth == 2) ? pixel_channel(pixel, c, depth) >> 8 : pixel_channel(pixel, c, depth);
+                  }
+               }
+               break;
+            }
+            pool_histogram_t* const histogram = pool->histogram + (size_t) x_scaled * channels;
+            for(x_block = 0; x_block < x_block_size; ++x_block, data_row += pixel_step)
+            {
+               const unsigned char* pixel = palette ? (const unsigned char*) &palette[*data_row] : data_row;
+               for(c = 0; c < channels; ++c)
+               {
+                  const int value = (depth == 2) ? pixel_channel(pixel, c, depth) >> 8 : pixel_channel(pixel, c, depth);
+                  histogram[c].used |= 1u << (value / POOL_FINE_BINS);
+                  ++histogram[c].fine[value];
+               }
+            }
+            break;
+         }
+         case SCALE_MODE:
+         {
+            // Count runs of equal colors with one table update
+            uint64_t run_color = 0;
+            uint32_t run       = 0;
+            for(x_block = 0; x_block < x_block_size; ++x_block, data_row += pixel_step)
+            {
+               uint64_t color = 0;
+               memcpy(&color, palette ? (const unsigned char*) &palette[*data_row] : data_row, channels * depth);
+               if(run && color != run_color)
+               {
+                  pool_t_mode_add(pool, run_color, x_scaled, run);
+                  run = 0;
+               }
+               run_color = color;
+               ++run;
+            }
+            if(run)
+               pool_t_mode_add(pool, run_color, x_scaled, run);
+            break;
+         }
+         default:
+            break;
+      }
+   }
+}
+
+//! Add a source row to the current output row.
+static void
+pool_t_accumulate_row
+   (  pool_t* const pool
+   ,  const void*   data_row
+   )
+{
+   switch(pool->format)
+   {
+      case PIXEL_GRAY8:
+         pool_accumulate_row_generic(pool, data_row, 1, 1, NULL);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         pool_accumulate_row_generic(pool, data_row, 2, 1, NULL);
+         break;
+      case PIXEL_RGB24:
+         pool_accumulate_row_generic(pool, data_row, 3, 1, NULL);
+         break;
+      case PIXEL_RGBA32:
+         pool_accumulate_row_generic(pool, data_row, 4, 1, NULL);
+         break;
+      case PIXEL_RGBA64:
+         pool_accumulate_row_generic(pool, data_row, 4, 2, NULL);
+         break;
+      case PIXEL_INDEX8:
+         pool_accumulate_row_generic(pool, data_row, 4, 1, pool->palette);
+         break;
+   }
+   ++pool->y_block_size;
+}
+
+//! Lower median of the n values in histogram, clearing it. Only the non-empty coarse bins are visited.
+static int
+pool_histogram_median
+   (  pool_histogram_t* const histogram
+   ,  uint32_t                n
+   )
+{
+   const uint32_t target = (n + 1) / 2;
+   uint32_t count = 0;
+   int fine = 0, median = -1;
+   while(histogram->used)
+   {
+      const int coarse = __builtin_ctz(histogram->used);
+      histogram->used &= histogram->used - 1;
+      uint32_t* bins = &histogram->fine[coarse * POOL_FINE_BINS];
+      for(fine = 0; median < 0 && fine < POOL_FINE_BINS; ++fine)
+      {
+         count += bins[fine];
+         if(count >= target)
+            median = coarse * POOL_FINE_BINS + fine;
+      }
+      memset(bins, 0, POOL_FINE_BINS * sizeof(uint32_t));
+   }
+   return max(median, 0);
+}
+
+/**
+ * Lower median of n <= POOL_SORT_MAX_AREA values: the value with at most rank = (n - 1) / 2 values below it
+ * and at most n - 1 - rank values above it. The counts for all 16 lanes are made at once with byte compares
+ * (on values offset by 128, as SSE compares are signed), broadcasting each value with a byte shuffle.
+ **/
+static int
+pool_values_median
+   (  const uint8_t* values
+   ,  uint32_t       n
+   )
+{
+   const int     rank    = (n - 1) / 2;
+   const __m128i v       = _mm_xor_si128(_mm_loadu_si128((const __m128i*) values), _mm_set1_epi8((char) 0x80));
+   __m128i       index   = _mm_setzero_si128();
+   __m128i       less    = _mm_setzero_si128();
+   __m128i       greater = _mm_setzero_si128();
+   uint32_t j;
+   for(j = 0; j < n; ++j)
+   {
+      const __m128i b = _mm_shuffle_epi8(v, index);
+      less    = _mm_sub_epi8(less   , _mm_cmpgt_epi8(v, b));
+      greater = _mm_sub_epi8(greater, _mm_cmpgt_epi8(b, v));
+      index   = _mm_add_epi8(index, _mm_set1_epi8(1));
+   }
+   const __m128i too_high = _mm_cmpgt_epi8(less   , _mm_set1_epi8((char) rank));
+   const __m128i too_low  = _mm_cmpgt_epi8(greater, _mm_set1_epi8((char) (n - 1 - rank)));
+   const int     mask     = ~_mm_movemask_epi8(_mm_or_si128(too_high, too_low)) & ((1 << n) - 1);
+   return mask ? values[__builtin_ctz(mask)] : 0;
+}
+
+static inline __attribute__((always_inline)) void
+pool_store_row_generic
+   (  pool_t* const  pool
+   ,  unsigned char* scale_data_row
+   ,  const int      channels
+   ,  const int      depth
+   )
+{
+   int x_scaled, c;
+   for(x_scaled = 0; x_scaled < pool->scaled_width; ++x_scaled)
+   {
+      const uint32_t n = (uint32_t) (pool->x_block_size_min + (x_scaled < pool->x_block_rest ? 1 : 0)) * pool->y_block_size;
+      switch(pool->scale)
+      {
+         case SCALE_MAX:
+         case SCALE_MIN:
+            for(c = 0; c < channels; ++c)
+               pixel_set_channel(scale_data_row, c, pool->extreme[(size_t) x_scaled * channels + c], depth);
+            break;
+         case SCALE_MEDIAN:
+            for(c = 0; c < channels; ++c)
+            {
+               const int median = pool->values 
+                                ? pool_values_median(pool->values + ((size_t) x_scaled * channels + c) * POOL_SORT_MAX_AREA, n)
+                                : pool_histogram_median(&pool->histogram[(size_t) x_scaled * channels + c], n);
+               pixel_set_channel(scale_data_row, c, (depth == 2) ? median * 257 : median, depth);
+            }
+            break;
+         case SCALE_MODE:
+            memcpy(scale_data_row, &pool->mode_color[x_scaled], channels * depth);
+            break;
+         default:
+            break;
+      }
+      scale_data_row += channels * depth;
+   }
+}
+
+//! Store the current output row in ssaa_format(format), and start the next one.
+static void
+pool_t_store_row
+   (  pool_t* const pool
+   ,  void*         scale_data_row
+   )
+{
+   switch(ssaa_format(pool->format))
+   {
+      case PIXEL_GRAY8:
+         pool_store_row_generic(pool, scale_data_row, 1, 1);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         pool_store_row_generic(pool, scale_data_row, 2, 1);
+         break;
+      case PIXEL_RGB24:
+         pool_store_row_generic(pool, scale_data_row, 3, 1);
+         break;
+      case PIXEL_RGBA32:
+         pool_store_row_generic(pool, scale_data_row, 4, 1);
+         break;
+      case PIXEL_RGBA64:
+         pool_store_row_generic(pool, scale_data_row, 4, 2);
+         break;
+      case PIXEL_INDEX8:
+         abort_("[scale_image] Cannot store pooling result as index8.");
+         break;
+   }
+
+   if(pool->extreme)
+   {
+      pool_t_clear_extreme(pool);
+   }
+   if(pool->table)
+   {
+      memset(pool->table, 0, ((size_t) 1 << pool->table_bits) * sizeof(pool_mode_entry_t));
+      memset(pool->mode_count, 0, pool->scaled_width * sizeof(uint32_t));
+      pool->table_used = 0;
+   }
+   pool->y_block_size = 0;
+}
+
+//! Whether scale is one of the pooling types.
+static int
+scale_is_pool
+   (  scale_t scale
+   )
+{
+   return scale == SCALE_MAX || scale == SCALE_MIN || scale == SCALE_MEDIAN || scale == SCALE_MODE;
+}
+
+/**
+ * Scaling weights along one axis: output pixel i is a weighted sum of the count[i] source pixels starting at begin[i],
+ * with weights weight[offset[i]], ...
+ **/
+typedef struct
+{
+   int*      begin;   // First source pixel of each output pixel
+   int*      count;   // Number of source pixels of each output pixel
+   int*      offset;  // Index of the weight of the first source pixel in weight
+   int32_t*  weight;
+}  scale_weights_t;
+
+static void
+scale_weights_t_alloc
+   (  scale_weights_t* const weights
+   ,  int                    dst_size
+   ,  size_t                 weight_size
+   )
+{
+   weights->begin  = (int*) malloc(dst_size * sizeof(int));
+   weights->count  = (int*) malloc(dst_size * sizeof(int));
+   weights->offset = (int*) malloc(dst_size * sizeof(int));
+   weights->weight = (int32_t*) malloc(weight_size * sizeof(int32_t));
+}
+
+static void
+scale_weights_t_destroy
+   (  scale_weights_t* const weights
+   )
+{
+   free(weights->begin);
+   free(weights->count);
+   free(weights->offset);
+   free(weights->weight);
+}
+
+//! Heap memory of the weights of dst_size output pixels, which are laid out in order.
+static size_t
+scale_weights_t_memory
+   (  const scale_weights_t* const weights
+   ,  int                          dst_size
+   )
+{
+   if(dst_size <= 0)
+      return 0;
+   const size_t weight_size = (size_t) weights->offset[dst_size - 1] + weights->count[dst_size - 1];
+   return (size_t) dst_size * 3 * sizeof(int) + weight_size * sizeof(int32_t);
+}
+
+/**
+ * Area-average weights.
+ * Measured in units of 1/(src_size * dst_size) of the axis, source pixel j covers [j * dst_size, (j + 1) * dst_size) 
+ * and output pixel i covers [i * src_size, (i + 1) * src_size). The weight of j in i is the length of the overlap, 
+ * so all weights are exact integers, and the weights of every output pixel sum to src_size.
+ **/
+static void
+scale_weights_t_init_area
+   (  scale_weights_t* const weights
+   ,  int                    src_size
+   ,  int                    dst_size
+   )
+{
+   scale_weights_t_alloc(weights, dst_size, (size_t) src_size + dst_size);
+
+   int i, j, k = 0;
+   for(i = 0; i < dst_size; ++i)
+   {
+      const int64_t lo    = (int64_t) i * src_size;
+      const int64_t hi    = lo + src_size;
+      const int     begin = lo / dst_size;
+      const int     end   = (hi + dst_size - 1) / dst_size;
+      weights->begin [i] = begin;
+      weights->count [i] = end - begin;
+      weights->offset[i] = k;
+      for(j = begin; j < end; ++j)
+      {
+         weights->weight[k++] = min(hi, (int64_t) (j + 1) * dst_size) - max(lo, (int64_t) j * dst_size);
+      }
+   }
+}
+
+/**
+ * Separable area-average scaler, fed one source row at a time (so it can also be used while streaming rows from libpng).
+ * Each source row is first scaled horizontally with the x weights, and then added with its y weight to the 
+ * output rows it overlaps, which are kept in a small ring of accumulator rows.
+ * An output row is rounded to nearest and stored as soon as its last source row has been added.
+ * All arithmetic is exact 64 bit integer, and output is in ssaa_format(format).
+ **/
+typedef struct
+{
+   int              src_height;
+   int              dst_width;
+   int              dst_height;
+   pixel_format_t   format;       // Source format
+   const color32_t* palette;
+   scale_weights_t  x_weights;
+   scale_weights_t  y_weights;
+   uint64_t         total;        // Sum of all weights of an output pixel
+   uint64_t*        row;          // Current source row scaled horizontally, 4 channels per pixel
+   uint64_t*        acc;          // Ring of ring_size output rows being accumulated
+   int              ring_size;
+   int              y_src;        // Next source row
+   int              y_first;      // First output row not yet stored
+   int              y_end;        // End of output rows to produce
+   unsigned char*   dst;          // Output image data
+   size_t           dst_row_size;
+}  area_t;
+
+static void
+area_t_init
+   (  area_t* const    area
+   ,  int              src_width
+   ,  int              src_height
+   ,  int              dst_width
+   ,  int              dst_height
+   ,  pixel_format_t   format
+   ,  const color32_t* palette
+   ,  void*            dst
+   )
+{
+   area->src_height   = src_height;
+   area->dst_width    = dst_width;
+   area->dst_height   = dst_height;
+   area->format       = format;
+   area->palette      = palette;
+   area->total        = (uint64_t) src_width * src_height;
+   area->ring_size    = dst_height / src_height + 2; // Most output rows a source row can overlap, plus one
+   area->y_src        = 0;
+   area->y_first      = 0;
+   area->y_end        = dst_height;
+   area->dst          = (unsigned char*) dst;
+   area->dst_row_size = (size_t) dst_width * pixel_format_size(ssaa_format(format));
+   area->row          = (uint64_t*) malloc((size_t) dst_width * 4 * sizeof(uint64_t));
+   area->acc          = (uint64_t*) calloc((size_t) area->ring_size * dst_width * 4, sizeof(uint64_t));
+
+   scale_weights_t_init_area(&area->x_weights, src_width , dst_width );
+   scale_weights_t_init_area(&area->y_weights, src_height, dst_height);
+}
+
+static void
+area_t_destroy
+   (  area_t* const area
+   )
+{
+   scale_weights_t_destroy(&area->x_weights);
+   scale_weights_t_destroy(&area->y_weights);
+   free(area->row);
+   free(area->acc);
+}
+
+//! Heap memory of the weights and the ring of output rows.
+static size_t
+area_t_memory
+   (  const area_t* const area
+   )
+{
+   return scale_weights_t_memory(&area->x_weights, area->dst_width)
+        + scale_weights_t_memory(&area->y_weights, area->dst_height)
+        + (size_t) (area->ring_size + 1) * area->dst_width * 4 * sizeof(uint64_t);
+}
+
+static inline __attribute__((always_inline)) void
+area_horizontal_generic
+   (  const unsigned char*         data_row
+   ,  uint64_t*                    row
+   ,  const scale_weights_t* const weights
+   ,  int                          dst_width
+   ,  const int                    channels
+   ,  const int                    depth
+   ,  const color32_t*             palette
+   )
+{
+   int x, k, c;
+   for(x = 0; x < dst_width; ++x)
+   {
+      uint64_t       sum[4] = { 0, 0, 0, 0 };
+      const int32_t* weight = weights->weight + weights->offset[x];
+      for(k = 0; k < weights->count[x]; ++k)
+      {
+         const int            j     = weights->begin[x] + k;
+         const unsigned char* pixel = palette ? (const unsigned char*) &palette[data_row[j]] : data_row + (size_t) j * channels * depth;
+         for(c = 0; c < channels; ++c)
+         {
+            sum[c] += (uint64_t) weight[k] * pixel_channel(pixel, c, depth);
+         }
+      }
+      for(c = 0; c < 4; ++c)
+      {
+         row[4 * x + c] = sum[c];
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void
+area_store_row_generic
+   (  unsigned char*  dst_row
+   ,  const uint64_t* acc_row
+   ,  int             dst_width
+   ,  uint64_t        total
+   ,  const int       channels
+   ,  const int       depth
+   )
+{
+   int x, c;
+   for(x = 0; x < dst_width; ++x)
+   {
+      for(c = 0; c < channels; ++c)
+      {
+         pixel_set_channel(dst_row, c, (acc_row[4 * x + c] + total / 2) / total, depth);
+      }
+      dst_row += channels * depth;
+   }
+}
+
+//! Round and store output row y, and clear its accumulator.
+static void
+area_t_store_row
+   (  area_t* const area
+   ,  int           y
+   )
+{
+   uint64_t*      acc_row = area->acc + (size_t) (y % area->ring_size) * area->dst_width * 4;
+   unsigned char* dst_row = area->dst + (size_t) y * area->dst_row_size;
+   switch(ssaa_format(area->format))
+   {
+      case PIXEL_GRAY8:
+         area_store_row_generic(dst_row, acc_row, area->dst_width, area->total, 1, 1);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         area_store_row_generic(dst_row, acc_row, area->dst_width, area->total, 2, 1);
+         break;
+      case PIXEL_RGB24:
+         area_store_row_generic(dst_row, acc_row, area->dst_width, area->total, 3, 1);
+         break;
+      case PIXEL_RGBA32:
+         area_store_row_generic(dst_row, acc_row, area->dst_width, area->total, 4, 1);
+         break;
+      case PIXEL_RGBA64:
+         area_store_row_generic(dst_row, acc_row, area->dst_width, area->total, 4, 2);
+         break;
+      case PIXEL_INDEX8:
+         abort_("[scale_image] Cannot store area average as index8.");
+         break;
+   }
+   memset(acc_row, 0, (size_t) area->dst_width * 4 * sizeof(uint64_t));
+}
+
+//! Add the next source row.
+static void
+area_t_push_row
+   (  area_t* const area
+   ,  const void*   data_row
+   )
+{
+   const int j = area->y_src++;
+
+   // Horizontal pass
+   switch(area->format)
+   {
+      case PIXEL_GRAY8:
+         area_horizontal_generic(data_row, area->row, &area->x_weights, area->dst_width, 1, 1, NULL);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         area_horizontal_generic(data_row, area->row, &area->x_weights, area->dst_width, 2, 1, NULL);
+         break;
+      case PIXEL_RGB24:
+         area_horizontal_generic(data_row, area->row, &area->x_weights, area->dst_width, 3, 1, NULL);
+         break;
+      case PIXEL_RGBA32:
+         area_horizontal_generic(data_row, area->row, &area->x_weights, area->dst_width, 4, 1, NULL);
+         break;
+      case PIXEL_RGBA64:
+         area_horizontal_generic(data_row, area->row, &area->x_weights, area->dst_width, 4, 2, NULL);
+         break;
+      case PIXEL_INDEX8:
+         area_horizontal_generic(data_row, area->row, &area->x_weights, area->dst_width, 4, 1, area->palette);
+         break;
+   }
+   
+   // Vertical pass, adding the row to every output row it overlaps
+   const scale_weights_t* y_weights = &area->y_weights;
+   const size_t           size      = (size_t) area->dst_width * 4;
+   int y;
+   for(y = area->y_first; y < area->y_end && y_weights->begin[y] <= j; ++y)
+   {
+      const uint64_t weight  = y_weights->weight[y_weights->offset[y] + j - y_weights->begin[y]];
+      uint64_t*      acc_row = area->acc + (size_t) (y % area->ring_size) * size;
+      size_t i;
+      for(i = 0; i < size; ++i)
+      {
+         acc_row[i] += weight * area->row[i];
+      }
+   }
+
+   // Store the output rows that are now complete
+   while(  area->y_first < area->y_end 
+        && (y_weights->begin[area->y_first] + y_weights->count[area->y_first] <= j + 1)
+        )
+   {
+      area_t_store_row(area, area->y_first++);
+   }
+}
+
+/**
+ * Only produce output rows [y_begin, y_end), e.g. for one band of a multithreaded scale.
+ * Source rows [*src_begin, *src_end) must then be pushed.
+ **/
+static void
+area_t_set_band
+   (  area_t* const area
+   ,  int           y_begin
+   ,  int           y_end
+   ,  int*          src_begin
+   ,  int*          src_end
+   )
+{
+   const scale_weights_t* y_weights = &area->y_weights;
+   *src_begin    = y_weights->begin[y_begin];
+   *src_end      = y_weights->begin[y_end - 1] + y_weights->count[y_end - 1];
+   area->y_src   = *src_begin;
+   area->y_first = y_begin;
+   area->y_end   = y_end;
+}
+
+/**
+ * 2x2 box halving.
+ * Each output pixel is the average of a 2x2 block of source pixels, rounded to nearest as (a + b + c + d + 2) >> 2.
+ * Odd widths and heights keep their last column or row, by using it for both halves of the block.
+ * Output is in ssaa_format(format), and is (width + 1) / 2 pixels wide.
+ **/
+static inline __attribute__((always_inline)) void
+halve_row_generic
+   (  const unsigned char* row0
+   ,  const unsigned char* row1
+   ,  unsigned char*       dst_row
+   ,  int                  x_begin
+   ,  int                  width
+   ,  const int            channels
+   ,  const int            depth
+   ,  const color32_t*     palette
+   )
+{
+   const int src_pixel_size = palette ? 1 : channels * depth;
+   const int halved_width   = (width + 1) / 2;
+   int x, c;
+   dst_row += (size_t) x_begin * channels * depth;
+   for(x = x_begin; x < halved_width; ++x)
+   {
+      const int j0 = 2 * x;
+      const int j1 = min(2 * x + 1, width - 1);
+      const unsigned char* p00 = palette ? (const unsigned char*) &palette[row0[j0]] : row0 + (size_t) j0 * src_pixel_size;
+      const unsigned char* p01 = palette ? (const unsigned char*) &palette[row0[j1]] : row0 + (size_t) j1 * src_pixel_size;
+      const unsigned char* p10 = palette ? (const unsigned char*) &palette[row1[j0]] : row1 + (size_t) j0 * src_pixel_size;
+      const unsigned char* p11 = palette ? (const unsigned char*) &palette[row1[j1]] : row1 + (size_t) j1 * src_pixel_size;
+      for(c = 0; c < channels; ++c)
+      {
+         const int sum = pixel_channel(p00, c, depth) + pixel_channel(p01, c, depth) + pixel_channel(p10, c, depth) + pixel_channel(p11, c, depth);
+         pixel_set_channel(dst_row, c, (sum + 2) >> 2, depth);
+      }
+      dst_row += channels * depth;
+   }
+}
+
+#ifdef __SSE4_1__
+//! Halve RGBA32 rows four output pixels at a time. Returns the number of output pixels done.
+static inline int
+halve_row_rgba32_sse41
+   (  const unsigned char* row0
+   ,  const unsigned char* row1
+   ,  unsigned char*       dst_row
+   ,  int                  width
+   )
+{
+   // Interleave the channels of each pixel pair, so maddubs sums the pair into 16 bit lanes
+   const __m128i pairs = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+   const __m128i ones  = _mm_set1_epi8(1);
+   const __m128i two   = _mm_set1_epi16(2);
+   int x;
+   for(x = 0; x + 4 <= width / 2; x += 4)
+   {
+      const __m128i a0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (row0 + 8 * x     )), pairs);
+      const __m128i a1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (row0 + 8 * x + 16)), pairs);
+      const __m128i b0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (row1 + 8 * x     )), pairs);
+      const __m128i b1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (row1 + 8 * x + 16)), pairs);
+      
+      const __m128i s0 = _mm_add_epi16(_mm_maddubs_epi16(a0, ones), _mm_maddubs_epi16(b0, ones));
+      const __m128i s1 = _mm_add_epi16(_mm_maddubs_epi16(a1, ones), _mm_maddubs_epi16(b1, ones));
+
+      const __m128i d0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+      const __m128i d1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+      _mm_storeu_si128((__m128i*) (dst_row + 4 * x), _mm_packus_epi16(d0, d1));
+   }
+   return x;
+}
+#endif /* __SSE4_1__ */
+
+//! AVX2 version of halve_row_rgba32_sse41, eight output pixels at a time. Only call if the cpu supports AVX2.
+static __attribute__((target("avx2"))) int
+halve_row_rgba32_avx2
+   (  const unsigned char* row0
+   ,  const unsigned char* row1
+   ,  unsigned char*       dst_row
+   ,  int                  width
+   )
+{
+   const __m256i pairs = _mm256_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15, 0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+   const __m256i ones  = _mm256_set1_epi8(1);
+   const __m256i two   = _mm256_set1_epi16(2);
+   int x;
+   for(x = 0; x + 8 <= width / 2; x += 8)
+   {
+      const __m256i a0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (row0 + 8 * x     )), pairs);
+      const __m256i a1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (row0 + 8 * x + 32)), pairs);
+      const __m256i b0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (row1 + 8 * x     )), pairs);
+      const __m256i b1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (row1 + 8 * x + 32)), pairs);
+      
+      const __m256i s0 = _mm256_add_epi16(_mm256_maddubs_epi16(a0, ones), _mm256_maddubs_epi16(b0, ones));
+      const __m256i s1 = _mm256_add_epi16(_mm256_maddubs_epi16(a1, ones), _mm256_maddubs_epi16(b1, ones));
+
+      const __m256i d0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+      const __m256i d1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+
+      // Packing works per 128 bit lane, so put the output pixel pairs back in order
+      _mm256_storeu_si256((__m256i*) (dst_row + 4 * x), _mm256_permute4x64_epi64(_mm256_packus_epi16(d0, d1), 0xD8));
+   }
+   return x;
+}
+
+//! Halve source rows row0 and row1 (which may be the same row) of width pixels into dst_row.
+static void
+halve_row
+   (  const unsigned char* row0
+   ,  const unsigned char* row1
+   ,  unsigned char*       dst_row
+   ,  int                  width
+   ,  pixel_format_t       format
+   ,  const color32_t*     palette
+   )
+{
+   switch(format)
+   {
+      case PIXEL_GRAY8:
+         halve_row_generic(row0, row1, dst_row, 0, width, 1, 1, NULL);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         halve_row_generic(row0, row1, dst_row, 0, width, 2, 1, NULL);
+         break;
+      case PIXEL_RGB24:
+         halve_row_generic(row0, row1, dst_row, 0, width, 3, 1, NULL);
+         break;
+      case PIXEL_RGBA32:
+      {
+         int x_begin = 0;
+         if(__builtin_cpu_supports("avx2"))
+            x_begin = halve_row_rgba32_avx2(row0, row1, dst_row, width);
+#ifdef __SSE4_1__
+         else
+            x_begin = halve_row_rgba32_sse41(row0, row1, dst_row, width);
+#endif /* __SSE4_1__ */
+         halve_row_generic(row0, row1, dst_row, x_begin, width, 4, 1, NULL);
+         break;
+      }
+      case PIXEL_RGBA64:
+         halve_row_generic(row0, row1, dst_row, 0, width, 4, 2, NULL);
+         break;
+      case PIXEL_INDEX8:
+         halve_row_generic(row0, row1, dst_row, 0, width, 4, 1, palette);
+         break;
+   }
+}
+
+/**
+ * Streaming cascade of 2x2 halvings.
+ * Source rows are pushed one at a time, and every row pushed returns at most one row of the last level.
+ * Each level only keeps the even row waiting for its partner.
+ **/
+#define HALVE_MAX_LEVELS 16
+
+typedef struct
+{
+   int              levels;
+   pixel_format_t   format;                          // Source format, levels are in ssaa_format(format)
+   const color32_t* palette;
+   int              width [HALVE_MAX_LEVELS + 1];    // Size of each level, level 0 is the source
+   int              height[HALVE_MAX_LEVELS + 1];
+   int              y     [HALVE_MAX_LEVELS];        // Next row pushed to each level
+   unsigned char*   pending[HALVE_MAX_LEVELS];       // Copy of the even row of each level, waiting for the odd row
+   const void*      even   [HALVE_MAX_LEVELS];       // Even row, either pending or a borrowed source row
+   unsigned char*   halved [HALVE_MAX_LEVELS];       // Row produced by each level
+   int              borrow;                          // Source rows stay valid, so they need not be copied
+}  halve_t;
+
+static void
+halve_t_init
+   (  halve_t* const   halve
+   ,  int              width
+   ,  int              height
+   ,  int              levels
+   ,  pixel_format_t   format
+   ,  const color32_t* palette
+   )
+{
+   assert(levels <= HALVE_MAX_LEVELS);
+   halve->levels    = levels;
+   halve->format    = format;
+   halve->palette   = palette;
+   halve->width [0] = width;
+   halve->height[0] = height;
+   halve->borrow    = 0;
+   int level;
+   for(level = 0; level < levels; ++level)
+   {
+      const size_t pixel_size = pixel_format_size(level ? ssaa_format(format) : format);
+      halve->width  [level + 1] = (halve->width [level] + 1) / 2;
+      halve->height [level + 1] = (halve->height[level] + 1) / 2;
+      halve->y      [level]     = 0;
+      halve->pending[level]     = (unsigned char*) malloc((size_t) halve->width[level] * pixel_size);
+      halve->halved [level]     = (unsigned char*) malloc((size_t) halve->width[level + 1] * pixel_format_size(ssaa_format(format)));
+   }
+}
+
+static void
+halve_t_destroy
+   (  halve_t* const halve
+   )
+{
+   int level;
+   for(level = 0; level < halve->levels; ++level)
+   {
+      free(halve->pending[level]);
+      free(halve->halved [level]);
+   }
+}
+
+//! Heap memory of the rows of each level.
+static size_t
+halve_t_memory
+   (  const halve_t* const halve
+   )
+{
+   size_t size = 0;
+   int level;
+   for(level = 0; level < halve->levels; ++level)
+   {
+      size += (size_t) halve->width[level]     * pixel_format_size(level ? ssaa_format(halve->format) : halve->format);
+      size += (size_t) halve->width[level + 1] * pixel_format_size(ssaa_format(halve->format));
+   }
+   return size;
+}
+
+//! Start at row y of the last level, e.g. for one band of a multithreaded scale. Returns the first source row to push.
+static int
+halve_t_set_first_row
+   (  halve_t* const halve
+   ,  int            y
+   )
+{
+   int level;
+   for(level = 0; level < halve->levels; ++level)
+   {
+      halve->y[level] = y << (halve->levels - level);
+   }
+   return y << halve->levels;
+}
+
+//! Push the next source row. Returns the next row of the last level if it is complete, and NULL otherwise.
+static const void*
+halve_t_push_row
+   (  halve_t* const halve
+   ,  const void*    row
+   )
+{
+   int level;
+   for(level = 0; level < halve->levels; ++level)
+   {
+      const int            y      = halve->y[level]++;
+      const pixel_format_t format = level ? ssaa_format(halve->format) : halve->format;
+      if(y % 2 == 0 && y + 1 < halve->height[level])
+      {
+         if(level == 0 && halve->borrow)
+         {
+            halve->even[level] = row;
+         }
+         else
+         {
+            memcpy(halve->pending[level], row, (size_t) halve->width[level] * pixel_format_size(format));
+            halve->even[level] = halve->pending[level];
+         }
+         return NULL;
+      }
+      halve_row(y % 2 == 0 ? row : halve->even[level], row, halve->halved[level], halve->width[level], format, level ? NULL : halve->palette);
+      row = halve->halved[level];
+   }
+   return row;
+}
+
+/**
+ * Separable filter resampling (bilinear, bicubic and lanczos3).
+ * Filter taps are computed once per output pixel and axis, and normalized to RESAMPLE_WEIGHT_BITS fixed-point weights summing to exactly 1.
+ * Like area_t, each source row is scaled horizontally and then added to the output rows it contributes to.
+ * Horizontal results are kept with RESAMPLE_ROW_BITS - 8 * (depth - 1) fractional bits, so all sums fit in 32 bits, 
+ * and the inner loops are simple int32 multiply-adds that the compiler vectorizes.
+ * Negative lobes can overshoot, so results are clamped.
+ **/
+#define RESAMPLE_WEIGHT_BITS 12
+#define RESAMPLE_ROW_BITS    8
+
+//! Downscaling by more than this is first done with 2x2 halvings and an integer factor SSAA reduction, see resample_reduce_size.
+#define RESAMPLE_REDUCING_GAP 3.0
+
+typedef struct
+{
+   double support; // Radius of filter at scale 1
+   double (*func)(double);
+}  resample_filter_t;
+
+static double
+resample_filter_bilinear
+   (  double x
+   )
+{
+   x = fabs(x);
+   return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+//! Catmull-Rom (Keys cubic with a = -0.5).
+static double
+resample_filter_bicubic
+   (  double x
+   )
+{
+   const double a = -0.5;
+   x = fabs(x);
+   if(x < 1.0)
+      return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+   if(x < 2.0)
+      return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+   return 0.0;
+}
+
+static double
+resample_sinc
+   (  double x
+   )
+{
+   if(x == 0.0)
+      return 1.0;
+   x *= M_PI;
+   return sin(x) / x;
+}
+
+static double
+resample_filter_lanczos3
+   (  double x
+   )
+{
+   return fabs(x) < 3.0 ? resample_sinc(x) * resample_sinc(x / 3.0) : 0.0;
+}
+
+static const resample_filter_t*
+resample_filter
+   (  scale_t scale
+   )
+{
+   static const resample_filter_t bilinear = { 1.0, resample_filter_bilinear };
+   static const resample_filter_t bicubic  = { 2.0, resample_filter_bicubic  };
+   static const resample_filter_t lanczos3 = { 3.0, resample_filter_lanczos3 };
+   switch(scale)
+   {
+      case SCALE_BILINEAR: return &bilinear;
+      case SCALE_BICUBIC : return &bicubic;
+      case SCALE_LANCZOS3: return &lanczos3;
+      default            : return NULL;
+   }
+}
+
+//! Filter weights. Output pixel i is centered on source coordinate (i + 0.5) * src_size / dst_size, and when downscaling the filter is widened by the same factor.
+static void
+scale_weights_t_init_filter
+   (  scale_weights_t* const         weights
+   ,  int                            src_size
+   ,  int                            dst_size
+   ,  const resample_filter_t* const filter
+   )
+{
+   const double scale        = (double) src_size / dst_size;
+   const double filter_scale = max(scale, 1.0);
+   const double support      = filter->support * filter_scale;
+   const int    max_count    = (int) ceil(support) * 2 + 1;
+
+   scale_weights_t_alloc(weights, dst_size, (size_t) dst_size * max_count);
+   
+   double* w = (double*) malloc(max_count * sizeof(double));
+   int i, j, k = 0;
+   for(i = 0; i < dst_size; ++i)
+   {
+      const double center = (i + 0.5) * scale;
+      const int    begin  = max((int) (center - support + 0.5), 0);
+      const int    end    = min((int) (center + support + 0.5), src_size);
+      
+      // Evaluate and normalize filter
+      double total = 0.0;
+      for(j = begin; j < end; ++j)
+      {
+         w[j - begin] = filter->func((j - center + 0.5) / filter_scale);
+         total += w[j - begin];
+      }
+
+      // Round to fixed-point, and put the rounding error on the largest weight, so weights sum to exactly 1
+      int32_t sum     = 0;
+      int     largest = 0;
+      for(j = 0; j < end - begin; ++j)
+      {
+         weights->weight[k + j] = (int32_t) lround(w[j] / total * (1 << RESAMPLE_WEIGHT_BITS));
+         sum += weights->weight[k + j];
+         if(weights->weight[k + j] > weights->weight[k + largest])
+            largest = j;
+      }
+      weights->weight[k + largest] += (1 << RESAMPLE_WEIGHT_BITS) - sum;
+
+      weights->begin [i] = begin;
+      weights->count [i] = end - begin;
+      weights->offset[i] = k;
+      k += end - begin;
+   }
+   free(w);
+}
+
+//! Number of 2x2 halvings that leave both axes downscaling by at least RESAMPLE_REDUCING_GAP.
+static int
+resample_halvings
+   (  int  width
+   ,  int  height
+   ,  int  scaled_width
+   ,  int  scaled_height
+   )
+{
+   int halvings = 0;
+   while(  halvings < HALVE_MAX_LEVELS
+        && (width  + 1) / 2 >= scaled_width  * RESAMPLE_REDUCING_GAP 
+        && (height + 1) / 2 >= scaled_height * RESAMPLE_REDUCING_GAP
+        )
+   {
+      width  = (width  + 1) / 2;
+      height = (height + 1) / 2;
+      ++halvings;
+   }
+   return halvings;
+}
+
+/**
+ * Size of the integer factor SSAA reduction done before filtering (after any halvings), when downscaling by more than RESAMPLE_REDUCING_GAP.
+ * The remaining filter step then downscales by between RESAMPLE_REDUCING_GAP and twice that, so it needs few taps,
+ * while the result is nearly indistinguishable from filtering the full image. Returns 0 if no reduction is needed.
+ **/
+static int
+resample_reduce_size
+   (  int  width
+   ,  int  height
+   ,  int  scaled_width
+   ,  int  scaled_height
+   ,  int* reduced_width
+   ,  int* reduced_height
+   )
+{
+   const int x_factor = max((int) (width  / (scaled_width  * RESAMPLE_REDUCING_GAP)), 1);
+   const int y_factor = max((int) (height / (scaled_height * RESAMPLE_REDUCING_GAP)), 1);
+   *reduced_width  = width  / x_factor;
+   *reduced_height = height / y_factor;
+   return (x_factor > 1 || y_factor > 1);
+}
+
+typedef struct
+{
+   int              dst_width;
+   int              dst_height;
+   pixel_format_t   format;       // Format of filtered rows
+   halve_t          halve;        // 2x2 halvings done first
+   ssaa_t           ssaa;         // Optional integer factor pre-reduction after halving
+   int              reduce;
+   int              y_block_size_min;
+   int              y_block_rest;
+   int              y_block;      // Source rows accumulated into the current reduced row
+   int              y_reduced;    // Current reduced row
+   unsigned char*   reduced_row;
+   const color32_t* palette;
+   scale_weights_t  x_weights;
+   scale_weights_t  y_weights;
+   int32_t*         row;          // Current source row scaled horizontally, 4 channels per pixel
+   int32_t*         acc;          // Ring of ring_size output rows being accumulated
+   int              ring_size;
+   int              y_src;        // Next source row
+   int              y_first;      // First output row not yet stored
+   int              y_end;        // End of output rows to produce
+   unsigned char*   dst;          // Output image data
+   size_t           dst_row_size;
+}  resample_t;
+
+static void
+resample_t_init
+   (  resample_t* const        resample
+   ,  int                      src_width
+   ,  int                      src_height
+   ,  int                      dst_width
+   ,  int                      dst_height
+   ,  pixel_format_t           format
+   ,  const color32_t*         palette
+   ,  void*                    dst
+   ,  const resample_filter_t* filter
+   )
+{
+   halve_t_init(&resample->halve, src_width, src_height, resample_halvings(src_width, src_height, dst_width, dst_height), format, palette);
+   if(resample->halve.levels > 0)
+   {
+      src_width  = resample->halve.width [resample->halve.levels];
+      src_height = resample->halve.height[resample->halve.levels];
+      format     = ssaa_format(format);
+      palette    = NULL;
+   }
+
+   int reduced_width, reduced_height;
+   resample->reduce = resample_reduce_size(src_width, src_height, dst_width, dst_height, &reduced_width, &reduced_height);
+   if(resample->reduce)
+   {
+      ssaa_t_init(&resample->ssaa, reduced_width, src_width / reduced_width, src_width % reduced_width, src_height / reduced_height, format, palette, 0);
+      resample->y_block_size_min = src_height / reduced_height;
+      resample->y_block_rest     = src_height % reduced_height;
+      resample->y_block          = 0;
+      resample->y_reduced        = 0;
+      resample->reduced_row      = (unsigned char*) malloc((size_t) reduced_width * pixel_format_size(ssaa_format(format)));
+      src_width  = reduced_width;
+      src_height = reduced_height;
+      format     = ssaa_format(format);
+      palette    = NULL;
+   }
+
+   resample->dst_width    = dst_width;
+   resample->dst_height   = dst_height;
+   resample->format       = format;
+   resample->palette      = palette;
+   resample->y_src        = 0;
+   resample->y_first      = 0;
+   resample->y_end        = dst_height;
+   resample->dst          = (unsigned char*) dst;
+   resample->dst_row_size = (size_t) dst_width * pixel_format_size(ssaa_format(format));
+   
+   scale_weights_t_init_filter(&resample->x_weights, src_width , dst_width , filter);
+   scale_weights_t_init_filter(&resample->y_weights, src_height, dst_height, filter);
+
+   // The ring must hold every output row a single source row contributes to
+   const scale_weights_t* y_weights = &resample->y_weights;
+   int j, lo = 0, hi = 0;
+   resample->ring_size = 1;
+   for(j = 0; j < src_height; ++j)
+   {
+      while(lo < dst_height && y_weights->begin[lo] + y_weights->count[lo] <= j)
+         ++lo;
+      while(hi < dst_height && y_weights->begin[hi] <= j)
+         ++hi;
+      resample->ring_size = max(resample->ring_size, hi - lo);
+   }
+
+   resample->row = (int32_t*) malloc((size_t) dst_width * 4 * sizeof(int32_t));
+   resample->acc = (int32_t*) calloc((size_t) resample->ring_size * dst_width * 4, sizeof(int32_t));
+}
+
+static void
+resample_t_destroy
+   (  resample_t* const resample
+   )
+{
+   scale_weights_t_destroy(&resample->x_weights);
+   scale_weights_t_destroy(&resample->y_weights);
+   free(resample->row);
+   free(resample->acc);
+   halve_t_destroy(&resample->halve);
+   if(resample->reduce)
+   {
+      ssaa_t_destroy(&resample->ssaa);
+      free(resample->reduced_row);
+   }
+}
+
+//! Heap memory of the halvings, the pre-reduction, the weights and the ring of output rows.
+static size_t
+resample_t_memory
+   (  const resample_t* const resample
+   )
+{
+   size_t size = halve_t_memory(&resample->halve)
+               + scale_weights_t_memory(&resample->x_weights, resample->dst_width)
+               + scale_weights_t_memory(&resample->y_weights, resample->dst_height)
+               + (size_t) (resample->ring_size + 1) * resample->dst_width * 4 * sizeof(int32_t);
+   if(resample->reduce)
+      size += ssaa_t_memory(&resample->ssaa) + (size_t) resample->ssaa.scaled_width * pixel_format_size(resample->format);
+   return size;
+}
+
+static inline __attribute__((always_inline)) void
+resample_horizontal_generic
+   (  const unsigned char*         data_row
+   ,  int32_t*                     row
+   ,  const scale_weights_t* const weights
+   ,  int                          dst_width
+   ,  const int                    channels
+   ,  const int                    depth
+   ,  const color32_t*             palette
+   )
+{
+   const int shift = RESAMPLE_WEIGHT_BITS - RESAMPLE_ROW_BITS + 8 * (depth - 1);
+   int x, k, c;
+   for(x = 0; x < dst_width; ++x)
+   {
+      int32_t        sum[4] = { 0, 0, 0, 0 };
+      const int32_t* weight = weights->weight + weights->offset[x];
+      for(k = 0; k < weights->count[x]; ++k)
+      {
+         const int            j     = weights->begin[x] + k;
+         const unsigned char* pixel = palette ? (const unsigned char*) &palette[data_row[j]] : data_row + (size_t) j * channels * depth;
+         for(c = 0; c < channels; ++c)
+         {
+            sum[c] += weight[k] * pixel_channel(pixel, c, depth);
+         }
+      }
+      for(c = 0; c < 4; ++c)
+      {
+         row[4 * x + c] = (sum[c] + (1 << (shift - 1))) >> shift;
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void
+resample_store_row_generic
+   (  unsigned char*  dst_row
+   ,  const int32_t*  acc_row
+   ,  int             dst_width
+   ,  const int       channels
+   ,  const int       depth
+   )
+{
+   const int shift     = RESAMPLE_WEIGHT_BITS + RESAMPLE_ROW_BITS - 8 * (depth - 1);
+   const int max_value = depth == 2 ? 65535 : 255;
+   int x, c;
+   for(x = 0; x < dst_width; ++x)
+   {
+      for(c = 0; c < channels; ++c)
+      {
+         const int value = (acc_row[4 * x + c] + (1 << (shift - 1))) >> shift;
+         pixel_set_channel(dst_row, c, min(max(value, 0), max_value), depth);
+      }
+      dst_row += channels * depth;
+   }
+}
+
+//! Round, clamp and store output row y, and clear its accumulator.
+static void
+resample_t_store_row
+   (  resample_t* const resample
+   ,  int               y
+   )
+{
+   int32_t*       acc_row = resample->acc + (size_t) (y % resample->ring_size) * resample->dst_width * 4;
+   unsigned char* dst_row = resample->dst + (size_t) y * resample->dst_row_size;
+   switch(ssaa_format(resample->format))
+   {
+      case PIXEL_GRAY8:
+         resample_store_row_generic(dst_row, acc_row, resample->dst_width, 1, 1);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         resample_store_row_generic(dst_row, acc_row, resample->dst_width, 2, 1);
+         break;
+      case PIXEL_RGB24:
+         resample_store_row_generic(dst_row, acc_row, resample->dst_width, 3, 1);
+         break;
+      case PIXEL_RGBA32:
+         resample_store_row_generic(dst_row, acc_row, resample->dst_width, 4, 1);
+         break;
+      case PIXEL_RGBA64:
+         resample_store_row_generic(dst_row, acc_row, resample->dst_width, 4, 2);
+         break;
+      case PIXEL_INDEX8:
+         abort_("[scale_image] Cannot store resampled image as index8.");
+         break;
+   }
+   memset(acc_row, 0, (size_t) resample->dst_width * 4 * sizeof(int32_t));
+}
+
+//! Filter the next (possibly reduced) source row.
+static void
+resample_t_filter_row
+   (  resample_t* const resample
+   ,  const void*       data_row
+   )
+{
+   const int j = resample->y_src++;
+
+   // Horizontal pass
+   switch(resample->format)
+   {
+      case PIXEL_GRAY8:
+         resample_horizontal_generic(data_row, resample->row, &resample->x_weights, resample->dst_width, 1, 1, NULL);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         resample_horizontal_generic(data_row, resample->row, &resample->x_weights, resample->dst_width, 2, 1, NULL);
+         break;
+      case PIXEL_RGB24:
+         resample_horizontal_generic(data_row, resample->row, &resample->x_weights, resample->dst_width, 3, 1, NULL);
+         break;
+      case PIXEL_RGBA32:
+         resample_horizontal_generic(data_row, resample->row, &resample->x_weights, resample->dst_width, 4, 1, NULL);
+         break;
+      case PIXEL_RGBA64:
+         resample_horizontal_generic(data_row, resample->row, &resample->x_weights, resample->dst_width, 4, 2, NULL);
+         break;
+      case PIXEL_INDEX8:
+         resample_horizontal_generic(data_row, resample->row, &resample->x_weights, resample->dst_width, 4, 1, resample->palette);
+         break;
+   }
+   
+   // Vertical pass, adding the row to every output row it contributes to
+   const scale_weights_t* y_weights = &resample->y_weights;
+   const size_t           size      = (size_t) resample->dst_width * 4;
+   int y;
+   for(y = resample->y_first; y < resample->y_end && y_weights->begin[y] <= j; ++y)
+   {
+      if(j >= y_weights->begin[y] + y_weights->count[y])
+         continue;
+      const int32_t  weight  = y_weights->weight[y_weights->offset[y] + j - y_weights->begin[y]];
+      int32_t*       acc_row = resample->acc + (size_t) (y % resample->ring_size) * size;
+      const int32_t* row     = resample->row;
+      size_t i;
+      for(i = 0; i < size; ++i)
+      {
+         acc_row[i] += weight * row[i];
+      }
+   }
+
+   // Store the output rows that are now complete
+   while(  resample->y_first < resample->y_end 
+        && (y_weights->begin[resample->y_first] + y_weights->count[resample->y_first] <= j + 1)
+        )
+   {
+      resample_t_store_row(resample, resample->y_first++);
+   }
+}
+
+//! Add the next source row.
+static void
+resample_t_push_row
+   (  resample_t* const resample
+   ,  const void*       data_row
+   )
+{
+   data_row = halve_t_push_row(&resample->halve, data_row);
+   if(!data_row)
+      return;
+   
+   if(!resample->reduce)
+   {
+      resample_t_filter_row(resample, data_row);
+      return;
+   }
+
+   ssaa_t_accumulate_row(&resample->ssaa, data_row);
+   if(++resample->y_block == resample->y_block_size_min + (resample->y_reduced < resample->y_block_rest ? 1 : 0))
+   {
+      ssaa_t_store_row(&resample->ssaa, resample->reduced_row);
+      resample_t_filter_row(resample, resample->reduced_row);
+      resample->y_block = 0;
+      ++resample->y_reduced;
+   }
+}
+
+/**
+ * Only produce output rows [y_begin, y_end), e.g. for one band of a multithreaded scale.
+ * Source rows [*src_begin, *src_end) must then be pushed.
+ **/
+static void
+resample_t_set_band
+   (  resample_t* const resample
+   ,  int               y_begin
+   ,  int               y_end
+   ,  int*              src_begin
+   ,  int*              src_end
+   )
+{
+   const scale_weights_t* y_weights = &resample->y_weights;
+   *src_begin        = y_weights->begin[y_begin];
+   *src_end          = y_weights->begin[y_end - 1] + y_weights->count[y_end - 1];
+   resample->y_src   = *src_begin;
+   resample->y_first = y_begin;
+   resample->y_end   = y_end;
+   if(resample->reduce)
+   {
+      // Band is in reduced rows, so map it back to source rows
+      resample->y_block   = 0;
+      resample->y_reduced = *src_begin;
+      *src_begin = *src_begin * resample->y_block_size_min + min(*src_begin, resample->y_block_rest);
+      *src_end   = *src_end   * resample->y_block_size_min + min(*src_end  , resample->y_block_rest);
+   }
+   
+   // And from halved rows to source rows
+   *src_end   = min(*src_end << resample->halve.levels, resample->halve.height[0]);
+   *src_begin = halve_t_set_first_row(&resample->halve, *src_begin);
+}
+
+//! Get the scaled size. Height is always rounded up to an even number, as we draw two pixels per char.
+static void
+image_t_scale_size
+   (  const image_t* const image
+   ,  int*                 scaled_width
+   ,  int*                 scaled_height
+   ,  double               percent
+   )
+{
+   if(percent)
+   {
+      *scaled_width  = round(image->width  * percent);
+      *scaled_height = round(image->height * percent);
+   }
+   *scaled_height = (*scaled_height % 2 == 0) ? *scaled_height : *scaled_height + 1; /* make sure height is an even number */
+}
+
+/**
+ * Read a PNG, calling progress after each Adam7 pass of an interlaced file.
+ * Passes are decoded in libpng's "rectangle" mode, so after every pass the image is complete,
+ * with the pixels not yet received filled in by replicating the pixels of earlier passes.
+ * For non-interlaced files progress is called once, when the whole image has been read.
+ **/
+status_t 
+image_t_read_png_progressive
+   (  input_t* const     input
+   ,  image_t* const     image
+   ,  image_t_progress_t progress
+   ,  void*              user
+   )
+{
+   png_reader_t reader;
+   png_reader_open(&reader, input, image);
+
+   int number_of_passes = png_set_interlace_handling(reader.png_ptr);
+   png_reader_set_native_transforms(&reader, image);
+
+   if (setjmp(png_jmpbuf(reader.png_ptr)))
+      abort_("[read_png_file] Error during read_rows");
+
+   const size_t row_size = (size_t) image->width * pixel_format_size(image->format);
+   image->data = calloc(image->height, row_size);
+
+   png_bytep* row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * image->height);
+   int y, pass;
+   for (y = 0; y < image->height; ++y)
+      row_pointers[y] = (png_bytep) image->data + y * row_size;
+
+   for(pass = 0; pass < number_of_passes; ++pass)
+   {
+      png_read_rows(reader.png_ptr, NULL, row_pointers, image->height);
+      progress(image, pass, number_of_passes, user);
+   }
+
+   png_read_end(reader.png_ptr, NULL);
+   
+   free(row_pointers);
+   png_reader_close(&reader);
+
+   return SUCCESS;
+}
+
+/**
+ * Whether scaling format to scaled_width x scaled_height can blend onto background r, g, b while storing.
+ * This is SSAA downscaling (not in linear light), where the premultiplied sums give the blend directly,
+ * and the blend must keep the format, so gray+alpha needs a gray background.
+ **/
+static int
+image_t_scale_blends
+   (  pixel_format_t format
+   ,  int            width
+   ,  int            height
+   ,  int            scaled_width
+   ,  int            scaled_height
+   ,  scale_t        scale
+   ,  int            r
+   ,  int            g
+   ,  int            b
+   )
+{
+   return scale == SCALE_SSAA
+      && scaled_width  <= width
+      && scaled_height <= height
+      && (format != PIXEL_GRAY_ALPHA16 || (r == g && g == b));
+}
+
+/**
+ * Read a PNG and SSAA, pool, area or filter scale it while streaming the rows through libpng.
+ * Only a single decoded source row and a few rows of accumulators are kept in memory.
+ * Interlaced files, other scale types and SSAA upscaling fall back to reading the full image and calling image_t_scale with threads.
+ * In the streaming path SSAA and pooling scale groups of output rows on up to threads threads, see image_scaler_t_set_threads,
+ * while other scale types run on the calling thread.
+ * If percent is non-zero it is used instead of scaled_width and scaled_height.
+ * If background is given, the result is blended onto it as by image_t_scale_background.
+ **/
+static status_t 
+image_t_read_png_scale_blend
+   (  input_t* const    input
+   ,  image_t* const    scaled
+   ,  int               scaled_width
+   ,  int               scaled_height
+   ,  double            percent
+   ,  scale_t           scale
+   ,  int               threads
+   ,  const int*        background
+   )
+{
+   image_t      image;
+   png_reader_t reader;
+   png_reader_open(&reader, input, &image);
+
+   image_t_scale_size(&image, &scaled_width, &scaled_height, percent);
+
+   const int ssaa_downscale = ((scale == SCALE_SSAA || scale == SCALE_SSAA_LINEAR || scale_is_pool(scale)) && scaled_width <= image.width && scaled_height <= image.height);
+   if (  !(ssaa_downscale || scale == SCALE_AREA || resample_filter(scale))
+      || reader.interlace_type != PNG_INTERLACE_NONE
+      )
+   {
+      png_reader_read_image(&reader, &image);
+      png_reader_close(&reader);
+      if(background)
+         image_t_scale_background(&image, scaled, scaled_width, scaled_height, 0.0, scale, threads, background[0], background[1], background[2]);
+      else
+         image_t_scale(&image, scaled, scaled_width, scaled_height, scale, threads);
+      image_t_destroy(&image);
+      return SUCCESS;
+   }
+
+   png_reader_set_native_transforms(&reader, &image);
+
+   color32_t color = { 0, 0, 0, 255 };
+   if(background)
+   {
+      color.r = background[0];
+      color.g = background[1];
+      color.b = background[2];
+   }
+   image_scaler_t* scaler   = image_scaler_t_create(&image, scaled, scaled_width, scaled_height, 0.0, scale, background ? &color : NULL);
+   image_scaler_t_set_threads(scaler, threads);
+   png_bytep       data_row = (png_bytep) malloc((size_t) image.width * pixel_format_size(image.format));
+
+   if (setjmp(png_jmpbuf(reader.png_ptr)))
+      abort_("[read_png_file] Error during read_row");
+
+   int y;
+   for(y = 0; y < image.height; ++y)
+   {
+      png_read_row(reader.png_ptr, data_row, NULL);
+      image_scaler_t_push_row(scaler, data_row);
+   }
+
+   png_read_end(reader.png_ptr, NULL);
+
+   image_scaler_t_destroy(scaler);
+   free(data_row);
+   image_t_destroy(&image);
+   png_reader_close(&reader);
+
+   return SUCCESS;
+}
+
+status_t 
+image_t_read_png_scale
+   (  input_t* const    input
+   ,  image_t* const    scaled
+   ,  int               scaled_width
+   ,  int               scaled_height
+   ,  double            percent
+   ,  scale_t           scale
+   ,  int               threads
+   )
+{
+   return image_t_read_png_scale_blend(input, scaled, scaled_width, scaled_height, percent, scale, threads, NULL);
+}
+
+//! Read a PNG, scale it and blend it onto background color r, g, b, see image_t_read_png_scale and image_t_scale_background.
+status_t 
+image_t_read_png_scale_background
+   (  input_t* const    input
+   ,  image_t* const    scaled
+   ,  int               scaled_width
+   ,  int               scaled_height
+   ,  double            percent
+   ,  scale_t           scale
+   ,  int               threads
+   ,  int               r
+   ,  int               g
+   ,  int               b
+   )
+{
+   const int background[3] = { r, g, b };
+   return image_t_read_png_scale_blend(input, scaled, scaled_width, scaled_height, percent, scale, threads, background);
+}
+
+/**
+ * Read a PNG cropped to [x_crop_begin, x_crop_end) x [y_crop_begin, y_crop_end) while streaming rows through libpng.
+ * Only rows and columns inside the crop window are stored, and for non-interlaced files we stop decoding after y_crop_end.
+ * Interlaced files need all passes, so they fall back to reading the full image and calling image_t_crop.
+ **/
+status_t 
+image_t_read_png_crop
+   (  input_t* const    input
+   ,  image_t* const    cropped
+   ,  int               x_crop_begin
+   ,  int               y_crop_begin
+   ,  int               x_crop_end
+   ,  int               y_crop_end
+   )
+{
+   image_t      image;
+   png_reader_t reader;
+   png_reader_open(&reader, input, &image);
+
+   if(reader.interlace_type != PNG_INTERLACE_NONE)
+   {
+      png_reader_read_image(&reader, &image);
+      png_reader_close(&reader);
+      image_t_crop(&image, cropped, x_crop_begin, y_crop_begin, x_crop_end, y_crop_end);
+      image_t_destroy(&image);
+      return SUCCESS;
+   }
+
+   png_reader_set_native_transforms(&reader, &image);
+
+   const int pixel_size = pixel_format_size(image.format);
+
+   y_crop_end   = min(image.height, y_crop_end);
+   x_crop_end   = min(image.width , x_crop_end);
+   y_crop_begin = min(y_crop_begin, y_crop_end);
+   x_crop_begin = min(x_crop_begin, x_crop_end);
+
+   image_t_init(cropped);
+   cropped->width      = x_crop_end - x_crop_begin;
+   cropped->height     = y_crop_end - y_crop_begin;
+   cropped->color_type = image.color_type;
+   cropped->bit_depth  = image.bit_depth;
+   cropped->format     = image.format;
+   cropped->data       = malloc((size_t) cropped->width * cropped->height * pixel_size);
+   cropped->palette    = image.palette;
+
+   // If we keep full rows, libpng can decode directly into the cropped image
+   const size_t cropped_row_size = (size_t) cropped->width * pixel_size;
+   const int    full_rows        = (cropped->width == image.width && cropped->height > 0);
+   png_bytep    data_row         = full_rows ? NULL : (png_bytep) malloc((size_t) image.width * pixel_size);
+
+   if (setjmp(png_jmpbuf(reader.png_ptr)))
+      abort_("[read_png_file] Error during read_row");
+
+   png_bytep cropped_data = (png_bytep) cropped->data;
+   int y;
+   for(y = 0; y < y_crop_end; ++y)
+   {
+      if(y < y_crop_begin)
+      {
+         // Row is above the window, decode it into the cropped storage (or work row) and drop it
+         png_read_row(reader.png_ptr, full_rows ? cropped_data : data_row, NULL);
+      }
+      else if(full_rows)
+      {
+         png_read_row(reader.png_ptr, cropped_data, NULL);
+         cropped_data += cropped_row_size;
+      }
+      else
+      {
+         png_read_row(reader.png_ptr, data_row, NULL);
+         memcpy(cropped_data, data_row + (size_t) x_crop_begin * pixel_size, cropped_row_size);
+         cropped_data += cropped_row_size;
+      }
+   }
+
+   // Rows after y_crop_end are never inflated
+   if(data_row)
+      free(data_row);
+   png_reader_close(&reader);
+
+   return SUCCESS;
+}
+
+//! Hand rows [y, y + height) of image, stored at data, to tile as a borrowed tile with its own copy of the palette.
+static void
+image_t_tile_call
+   (  const image_t* const image
+   ,  void*                data
+   ,  int                  y
+   ,  int                  height
+   ,  image_t_tile_t       tile
+   ,  void*                user
+   )
+{
+   image_t band   = *image;
+   band.height    = height;
+   band.data      = data;
+   band.storage   = STORAGE_BORROWED;
+   image_t_copy_palette(image, &band);
+   tile(&band, y, image->height, user);
+}
+
+//! pread(2) all of size bytes at offset, aborting on failure.
+static void
+image_t_read_png_spill_read
+   (  int    fd
+   ,  void*  dst
+   ,  size_t size
+   ,  off_t  offset
+   )
+{
+   unsigned char* out = (unsigned char*) dst;
+   while(size)
+   {
+      ssize_t nread = pread(fd, out, size, offset);
+      if(nread <= 0)
+         abort_("[read_png_tiles] Could not read back temporary file");
+      out    += nread;
+      offset += nread;
+      size   -= nread;
+   }
+}
+
+/**
+ * Read a PNG as horizontal tiles of at most max_tile_size bytes (but at least one row each), calling tile for each of them top to bottom.
+ * Non-interlaced files are decoded one tile at a time. 
+ * Interlaced files that do not fit in one tile have their Adam7 passes decoded to a temporary file, from which the rows of each tile are put together.
+ * Consumed pages of a mapped input are released as we go, so memory use is bounded by the tile size whatever the image size.
+ **/
+status_t 
+image_t_read_png_tiles
+   (  input_t* const input
+   ,  size_t         max_tile_size
+   ,  image_t_tile_t tile
+   ,  void*          user
+   )
+{
+   image_t      image;
+   png_reader_t reader;
+   png_reader_open(&reader, input, &image);
+
+   // Pixels take at most 8 bytes, so we know before decoding whether an interlaced image fits in one tile
+   if(  reader.interlace_type != PNG_INTERLACE_NONE
+     && (size_t) image.width * image.height * pixel_format_size(PIXEL_RGBA64) <= max_tile_size
+     )
+   {
+      png_reader_read_image(&reader, &image);
+      png_reader_close(&reader);
+      input_t_release(input);
+      image_t_tile_call(&image, image.data, 0, image.height, tile, user);
+      image_t_destroy(&image);
+      return SUCCESS;
+   }
+
+   png_reader_set_native_transforms(&reader, &image);
+
+   const int    pixel_size = pixel_format_size(image.format);
+   const size_t row_size   = (size_t) image.width * pixel_size;
+   const int    tile_rows  = max(1, (int) min((size_t) image.height, max_tile_size / row_size));
+   
+   unsigned char* data     = (unsigned char*) malloc((size_t) tile_rows * row_size);
+   unsigned char* pass_row = NULL;
+   FILE*          spill    = NULL;
+   off_t          pass_offset[7];
+   int            y, y_tile, pass;
+
+   if (setjmp(png_jmpbuf(reader.png_ptr)))
+      abort_("[read_png_tiles] Error during read_row");
+
+   if(reader.interlace_type != PNG_INTERLACE_NONE)
+   {
+      // Without interlace handling libpng returns the rows of each pass (which has pixels) in turn, each PNG_PASS_COLS wide
+      spill = tmpfile();
+      if(!spill)
+         abort_("[read_png_tiles] Could not create temporary file");
+      
+      pass_row = (unsigned char*) malloc(row_size);
+      off_t offset = 0;
+      for(pass = 0; pass < 7; ++pass)
+      {
+         const int    pass_width = PNG_PASS_COLS(image.width, pass);
+         const int    pass_rows  = pass_width ? (int) PNG_PASS_ROWS(image.height, pass) : 0;
+         const size_t pass_size  = (size_t) pass_width * pixel_size;
+         pass_offset[pass] = offset;
+         for(y = 0; y < pass_rows; ++y)
+         {
+            png_read_row(reader.png_ptr, pass_row, NULL);
+            if(fwrite(pass_row, 1, pass_size, spill) != pass_size)
+               abort_("[read_png_tiles] Could not write temporary file");
+            offset += pass_size;
+         }
+         input_t_release(input);
+      }
+      if(fflush(spill) != 0)
+         abort_("[read_png_tiles] Could not write temporary file");
+   }
+
+   for(y_tile = 0; y_tile < image.height; y_tile += tile_rows)
+   {
+      const int rows = min(tile_rows, image.height - y_tile);
+      for(y = y_tile; y < y_tile + rows; ++y)
+      {
+         unsigned char* data_row = data + (size_t) (y - y_tile) * row_size;
+         if(!spill)
+         {
+            png_read_row(reader.png_ptr, data_row, NULL);
+            continue;
+         }
+
+         // Scatter the pixels of every pass that has this row
+         for(pass = 0; pass < 7; ++pass)
+         {
+            const int pass_width = PNG_PASS_COLS(image.width, pass);
+            if(!pass_width || !PNG_ROW_IN_INTERLACE_PASS(y, pass))
+               continue;
+            
+            const size_t pass_size = (size_t) pass_width * pixel_size;
+            const int    pass_y    = (y - PNG_PASS_START_ROW(pass)) >> PNG_PASS_ROW_SHIFT(pass);
+            image_t_read_png_spill_read(fileno(spill), pass_row, pass_size, pass_offset[pass] + (off_t) pass_y * pass_size);
+            
+            int x;
+            for(x = 0; x < pass_width; ++x)
+               memcpy(data_row + (size_t) PNG_COL_FROM_PASS_COL(x, pass) * pixel_size, pass_row + (size_t) x * pixel_size, pixel_size);
+         }
+      }
+      input_t_release(input);
+      image_t_tile_call(&image, data, y_tile, rows, tile, user);
+   }
+
+   png_read_end(reader.png_ptr, NULL);
+
+   if(spill)
+   {
+      fclose(spill);
+      free(pass_row);
+   }
+   free(data);
+   image_t_destroy(&image);
+   png_reader_close(&reader);
+
+   return SUCCESS;
+}
+
+/**
+ * Hand an image in memory to tile in tiles of at most max_tile_size bytes, like image_t_read_png_tiles.
+ * Pages of a mapped image are released once their rows have been handled, so a mapped file is never resident in full.
+ **/
+void
+image_t_tiles
+   (  image_t* const image
+   ,  size_t         max_tile_size
+   ,  image_t_tile_t tile
+   ,  void*          user
+   )
+{
+   const size_t row_size  = (size_t) image->width * pixel_format_size(image->format);
+   const int    tile_rows = max(1, (int) min((size_t) image->height, max_tile_size / max(row_size, (size_t) 1)));
+   const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+   int y;
+   for(y = 0; y < image->height; y += tile_rows)
+   {
+      const int      rows = min(tile_rows, image->height - y);
+      unsigned char* data = (unsigned char*) image->data + (size_t) y * row_size;
+      image_t_tile_call(image, data, y, rows, tile, user);
+
+      if(image->storage == STORAGE_MAPPED)
+      {
+         const size_t done = (size_t) (data + rows * row_size - (unsigned char*) image->map);
+         if(done >= page_size)
+            madvise(image->map, done - done % page_size, MADV_DONTNEED);
+      }
+   }
+}
+
+/**
+ * Source index sampled for each of dst_size outputs by the point samplers.
+ * Output i covers the block [i * min + min(i, rest), ...) of min + (i < rest) source pixels (as in SSAA),
+ * and takes the first, last or center pixel of it. When upscaling, outputs take the nearest source pixel.
+ **/
+static int*
+nearest_index_table
+   (  int     src_size
+   ,  int     dst_size
+   ,  scale_t scale
+   )
+{
+   const int block_size_min = src_size / dst_size;
+   const int block_rest     = src_size % dst_size;
+   int* index = (int*) malloc(dst_size * sizeof(int));
+   int i;
+   for(i = 0; i < dst_size; ++i)
+   {
+      if(dst_size > src_size)
+      {
+         // Upscaling, take the source pixel under the output pixel center
+         index[i] = (int) (((int64_t) 2 * i + 1) * src_size / (2 * (int64_t) dst_size));
+         continue;
+      }
+
+      const int block_begin = i * block_size_min + min(i, block_rest);
+      const int block_size  = max(block_size_min + (i < block_rest ? 1 : 0), 1);
+      int offset = 0;
+      if(scale == SCALE_LAST)
+         offset = block_size - 1;
+      else if(scale == SCALE_CENTER)
+         offset = block_size / 2;
+      index[i] = min(block_begin + offset, src_size - 1);
+   }
+   return index;
+}
+
+static inline __attribute__((always_inline)) void
+nearest_row_generic
+   (  const unsigned char* data_row
+   ,  unsigned char*       dst_row
+   ,  const int*           x_index
+   ,  int                  x_begin
+   ,  int                  width
+   ,  const int            pixel_size
+   )
+{
+   int x;
+   for(x = x_begin; x < width; ++x)
+   {
+      memcpy(dst_row + (size_t) x * pixel_size, data_row + (size_t) x_index[x] * pixel_size, pixel_size);
+   }
+}
+
+//! Gather 32 bit pixels eight at a time. Only call if the cpu supports AVX2. Returns the number of pixels done.
+static __attribute__((target("avx2"))) int
+nearest_row_32_avx2
+   (  const unsigned char* data_row
+   ,  unsigned char*       dst_row
+   ,  const int*           x_index
+   ,  int                  width
+   )
+{
+   int x;
+   for(x = 0; x + 8 <= width; x += 8)
+   {
+      const __m256i index = _mm256_loadu_si256((const __m256i*) (x_index + x));
+      _mm256_storeu_si256((__m256i*) (dst_row + 4 * x), _mm256_i32gather_epi32((const int*) data_row, index, 4));
+   }
+   return x;
+}
+
+//! Sample one output row of width pixels from data_row.
+static void
+nearest_row
+   (  const unsigned char* data_row
+   ,  unsigned char*       dst_row
+   ,  const int*           x_index
+   ,  int                  width
+   ,  int                  pixel_size
+   )
+{
+   switch(pixel_size)
+   {
+      case 1:
+         nearest_row_generic(data_row, dst_row, x_index, 0, width, 1);
+         break;
+      case 2:
+         nearest_row_generic(data_row, dst_row, x_index, 0, width, 2);
+         break;
+      case 3:
+         nearest_row_generic(data_row, dst_row, x_index, 0, width, 3);
+         break;
+      case 4:
+      {
+         const int x_begin = __builtin_cpu_supports("avx2") ? nearest_row_32_avx2(data_row, dst_row, x_index, width) : 0;
+         nearest_row_generic(data_row, dst_row, x_index, x_begin, width, 4);
+         break;
+      }
+      case 8:
+         nearest_row_generic(data_row, dst_row, x_index, 0, width, 8);
+         break;
+   }
+}
+
+static inline __attribute__((always_inline)) void
+replicate_row_generic
+   (  const unsigned char* data_row
+   ,  unsigned char*       dst_row
+   ,  int                  width
+   ,  int                  factor
+   ,  const int            pixel_size
+   )
+{
+   int x, k;
+   for(x = 0; x < width; ++x)
+   {
+      const unsigned char* pixel = data_row + (size_t) x * pixel_size;
+      for(k = 0; k < factor; ++k)
+      {
+         memcpy(dst_row, pixel, pixel_size);
+         dst_row += pixel_size;
+      }
+   }
+}
+
+//! Replicate 32 bit pixels with 16 byte stores. Pixels are looked up in palette if given.
+static void
+replicate_row_32
+   (  const unsigned char* data_row
+   ,  unsigned char*       dst_row
+   ,  int                  width
+   ,  int                  factor
+   ,  const color32_t*     palette
+   )
+{
+   int x, k;
+   for(x = 0; x < width; ++x)
+   {
+      uint32_t pixel;
+      if(palette)
+         memcpy(&pixel, &palette[data_row[x]], 4);
+      else
+         memcpy(&pixel, data_row + (size_t) 4 * x, 4);
+      const __m128i run = _mm_set1_epi32((int) pixel);
+      for(k = 0; k + 4 <= factor; k += 4)
+      {
+         _mm_storeu_si128((__m128i*) dst_row, run);
+         dst_row += 16;
+      }
+      for(; k < factor; ++k)
+      {
+         memcpy(dst_row, &pixel, 4);
+         dst_row += 4;
+      }
+   }
+}
+
+/**
+ * Output rows [y_begin, y_end) of an integer factor upscale, where every source pixel becomes a block of pixels.
+ * Each source row is expanded once, and then copied for the rest of its block.
+ **/
+static void
+image_t_replicate_band
+   (  const image_t* const image
+   ,  image_t* const       scaled
+   ,  int                  y_begin
+   ,  int                  y_end
+   )
+{
+   const int        x_factor       = scaled->width  / image->width;
+   const int        y_factor       = scaled->height / image->height;
+   const int        pixel_size     = pixel_format_size(image->format);
+   const size_t     dst_row_size   = (size_t) scaled->width * pixel_format_size(scaled->format);
+   const color32_t* palette        = (scaled->format != image->format) ? image->palette : NULL; // Index8 expanded to rgba32
+   int y;
+   for(y = y_begin; y < y_end; ++y)
+   {
+      unsigned char* dst_row = (unsigned char*) scaled->data + (size_t) y * dst_row_size;
+      if(y > y_begin && y % y_factor != 0)
+      {
+         memcpy(dst_row, dst_row - dst_row_size, dst_row_size);
+         continue;
+      }
+      
+      const unsigned char* data_row = (const unsigned char*) image->data + (size_t) (y / y_factor) * image->width * pixel_size;
+      if(palette)
+      {
+         replicate_row_32(data_row, dst_row, image->width, x_factor, palette);
+         continue;
+      }
+      switch(pixel_size)
+      {
+         case 1:
+            if(x_factor == 1)
+               memcpy(dst_row, data_row, image->width);
+            else
+               replicate_row_generic(data_row, dst_row, image->width, x_factor, 1);
+            break;
+         case 2:
+            replicate_row_generic(data_row, dst_row, image->width, x_factor, 2);
+            break;
+         case 3:
+            replicate_row_generic(data_row, dst_row, image->width, x_factor, 3);
+            break;
+         case 4:
+            replicate_row_32(data_row, dst_row, image->width, x_factor, NULL);
+            break;
+         case 8:
+            replicate_row_generic(data_row, dst_row, image->width, x_factor, 8);
+            break;
+      }
+   }
+}
+
+/**
+ * Output rows [y_begin, y_end) of image_t_scale. Each band uses its own accumulators, so bands can run in parallel.
+ * If background is given, SSAA blends onto it while storing (see image_t_scale_blends).
+ **/
+static void
+image_t_scale_band
+   (  const image_t* const image
+   ,  image_t* const       scaled
+   ,  scale_t              scale
+   ,  const int*           background
+   ,  int                  y_begin
+   ,  int                  y_end
+   )
+{
+   if(scaled->width > image->width || scaled->height > image->height)
+   {
+      // Upscaling by integer factors is plain replication for the box and point samplers
+      if(  !resample_filter(scale)
+        && scaled->width  % image->width  == 0
+        && scaled->height % image->height == 0
+        )
+      {
+         image_t_replicate_band(image, scaled, y_begin, y_end);
+         return;
+      }
+
+      // SSAA and pooling need at least one source pixel per output pixel, so interpolate instead
+      if(scale == SCALE_SSAA || scale == SCALE_SSAA_LINEAR || scale_is_pool(scale))
+         scale = SCALE_BILINEAR;
+   }
+
+   int x_block_size_min = floor((double) image->width  / (double) scaled->width);
+   int x_block_rest     = image->width % scaled->width;
+   int y_block_size_min = floor((double) image->height / (double) scaled->height);
+   int y_block_rest     = image->height % scaled->height;
+
+   const int      pixel_size = pixel_format_size(image->format);
+   unsigned char* data       = (unsigned char*) image->data;
+   unsigned char* scale_data = (unsigned char*) scaled->data;
+
+   unsigned char* scale_data_row;
+   unsigned char* data_row;
+
+   switch(scale)
+   {
+      case SCALE_FIRST:
+      case SCALE_LAST:
+      case SCALE_CENTER:
+      {
+         int* x_index = nearest_index_table(image->width , scaled->width , scale);
+         int* y_index = nearest_index_table(image->height, scaled->height, scale);
+         int y_scaled;
+         for(y_scaled = y_begin; y_scaled < y_end; ++y_scaled)
+         {
+            scale_data_row = scale_data + (size_t) y_scaled * scaled->width * pixel_size;
+            if(y_scaled > y_begin && y_index[y_scaled] == y_index[y_scaled - 1])
+            {
+               // Same source row as the last output row
+               memcpy(scale_data_row, scale_data_row - (size_t) scaled->width * pixel_size, (size_t) scaled->width * pixel_size);
+               continue;
+            }
+            data_row = data + (size_t) y_index[y_scaled] * image->width * pixel_size;
+            nearest_row(data_row, scale_data_row, x_index, scaled->width, pixel_size);
+         }
+         free(x_index);
+         free(y_index);
+         break;
+      }
+      case SCALE_SSAA:
+      case SCALE_SSAA_LINEAR:
+      {
+         ssaa_t ssaa;
+         ssaa_t_init(&ssaa, scaled->width, x_block_size_min, x_block_rest, y_block_size_min, image->format, image->palette, scale == SCALE_SSAA_LINEAR);
+         if(background)
+            ssaa_t_set_background(&ssaa, background[0], background[1], background[2]);
+         int y_block;
+         int y_scaled;
+         for(y_scaled = y_begin; y_scaled < y_end; ++y_scaled)
+         {  
+            int y_block_size = y_block_size_min + (y_scaled < y_block_rest ? 1 : 0);
+            for(y_block = 0; y_block < y_block_size; ++y_block)
+            {
+               const size_t shift = (size_t) ( y_scaled * y_block_size_min + y_block + min(y_scaled, y_block_rest)) * image->width * pixel_size;
+               ssaa_t_accumulate_row(&ssaa, data + shift);
+            }
+            
+            ssaa_t_store_row(&ssaa, scale_data + (size_t) y_scaled * scaled->width * pixel_format_size(scaled->format));
+         }
+         ssaa_t_destroy(&ssaa);
+         break;
+      }
+      case SCALE_MAX:
+      case SCALE_MIN:
+      case SCALE_MEDIAN:
+      case SCALE_MODE:
+      {
+         pool_t pool;
+         pool_t_init(&pool, scaled->width, x_block_size_min, x_block_rest, y_block_size_min + (y_block_rest ? 1 : 0), image->format, image->palette, scale);
+         int y_block;
+         int y_scaled;
+         for(y_scaled = y_begin; y_scaled < y_end; ++y_scaled)
+         {  
+            int y_block_size = y_block_size_min + (y_scaled < y_block_rest ? 1 : 0);
+            for(y_block = 0; y_block < y_block_size; ++y_block)
+            {
+               const size_t shift = (size_t) ( y_scaled * y_block_size_min + y_block + min(y_scaled, y_block_rest)) * image->width * pixel_size;
+               pool_t_accumulate_row(&pool, data + shift);
+            }
+            
+            pool_t_store_row(&pool, scale_data + (size_t) y_scaled * scaled->width * pixel_format_size(scaled->format));
+         }
+         pool_t_destroy(&pool);
+         break;
+      }
+      case SCALE_AREA:
+      {
+         area_t area;
+         area_t_init(&area, image->width, image->height, scaled->width, scaled->height, image->format, image->palette, scaled->data);
+         int y, y_src_begin, y_src_end;
+         area_t_set_band(&area, y_begin, y_end, &y_src_begin, &y_src_end);
+         for(y = y_src_begin; y < y_src_end; ++y)
+         {
+            area_t_push_row(&area, data + (size_t) y * image->width * pixel_size);
+         }
+         area_t_destroy(&area);
+         break;
+      }
+      case SCALE_BILINEAR:
+      case SCALE_BICUBIC:
+      case SCALE_LANCZOS3:
+      {
+         resample_t resample;
+         resample_t_init(&resample, image->width, image->height, scaled->width, scaled->height, image->format, image->palette, scaled->data, resample_filter(scale));
+         resample.halve.borrow = 1; // Rows of image stay valid
+         int y, y_src_begin, y_src_end;
+         resample_t_set_band(&resample, y_begin, y_end, &y_src_begin, &y_src_end);
+         for(y = y_src_begin; y < y_src_end; ++y)
+         {
+            resample_t_push_row(&resample, data + (size_t) y * image->width * pixel_size);
+         }
+         resample_t_destroy(&resample);
+         break;
+      }
+
+      default:
+      {
+         abort_("[scale_image] Unknown SCALE type.");
+         break;
+      }
+   }
+}
+
+//! Fewest source pixels worth handing to a separate thread.
+#define IMAGE_THREAD_MIN_PIXELS (1 << 18)
+
+//! Work on rows [y_begin, y_end) of some output.
+typedef void (*image_band_func_t)(void* user, int y_begin, int y_end);
+
+/**
+ * Bands of one image_run_bands call. Bands are taken in order by the calling thread and the pool workers,
+ * and the call returns once pending drops to 0.
+ **/
+typedef struct image_band_batch_struct
+{
+   image_band_func_t               func;
+   void*                           user;
+   int                             rows;
+   int                             bands;
+   int                             next;    // Next band to take
+   int                             pending; // Bands not finished yet
+   pthread_cond_t                  done;    // Signalled when pending drops to 0
+   struct image_band_batch_struct* link;    // Next batch in the queue
+}  image_band_batch_t;
+
+/**
+ * Persistent worker pool for image_run_bands, so scaling and drawing each frame does not start threads.
+ * Workers are started on first use, more are added when a call asks for more threads, and they are joined at exit.
+ * Calls from several threads (such as the stream decoder and the drawing thread) queue their batches and share the workers.
+ **/
+typedef struct
+{
+   pthread_mutex_t     mutex;
+   pthread_cond_t      work;    // A batch was queued, or the pool is stopping
+   pthread_t*          workers;
+   int                 threads;
+   int                 stop;
+   image_band_batch_t* queue;   // Batches with bands left to take, oldest first
+}  image_band_pool_t;
+
+static image_band_pool_t image_band_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, NULL };
+
+//! Take the next band of batch and run it. Called with the pool mutex held, which is released while the band runs.
+static void
+image_band_pool_run
+   (  image_band_pool_t*  pool
+   ,  image_band_batch_t* batch
+   )
+{
+   const int band = batch->next++;
+   if(batch->next == batch->bands)
+   {
+      // All bands are taken, unqueue the batch
+      image_band_batch_t** link = &pool->queue;
+      while(*link != batch)
+         link = &(*link)->link;
+      *link = batch->link;
+   }
+
+   pthread_mutex_unlock(&pool->mutex);
+   batch->func(batch->user, (int) ((int64_t) batch->rows * band / batch->bands), (int) ((int64_t) batch->rows * (band + 1) / batch->bands));
+   pthread_mutex_lock(&pool->mutex);
+
+   if(--batch->pending == 0)
+      pthread_cond_signal(&batch->done);
+}
+
+static void*
+image_band_pool_worker
+   (  void* pool_ptr
+   )
+{
+   image_band_pool_t* pool = (image_band_pool_t*) pool_ptr;
+   pthread_mutex_lock(&pool->mutex);
+   while(1)
+   {
+      while(!pool->queue && !pool->stop)
+         pthread_cond_wait(&pool->work, &pool->mutex);
+      if(!pool->queue)
+         break;
+      image_band_pool_run(pool, pool->queue);
+   }
+   pthread_mutex_unlock(&pool->mutex);
+   return NULL;
+}
+
+//! Stop and join the workers, at exit.
+static void
+image_band_pool_stop
+   (  void
+   )
+{
+   image_band_pool_t* pool = &image_band_pool;
+   pthread_mutex_lock(&pool->mutex);
+   pool->stop = 1;
+   pthread_cond_broadcast(&pool->work);
+   pthread_mutex_unlock(&pool->mutex);
+
+   int i;
+   for(i = 0; i < pool->threads; ++i)
+   {
+      if(!pthread_equal(pool->workers[i], pthread_self()))
+         pthread_join(pool->workers[i], NULL);
+   }
+   free(pool->workers);
+   pool->workers = NULL;
+   pool->threads = 0;
+}
+
+//! Make sure the pool has at least threads workers, starting it on first use.
+static void
+image_band_pool_reserve
+   (  image_band_pool_t* pool
+   ,  int                threads
+   )
+{
+   pthread_mutex_lock(&pool->mutex);
+   if(pool->threads < threads && !pool->stop)
+   {
+      if(!pool->workers)
+         atexit(image_band_pool_stop);
+      pool->workers = (pthread_t*) realloc(pool->workers, threads * sizeof(pthread_t));
+      if(!pool->workers)
+         abort_("[image] Could not allocate threads.");
+      for(; pool->threads < threads; ++pool->threads)
+      {
+         if(pthread_create(&pool->workers[pool->threads], NULL, image_band_pool_worker, pool) != 0)
+            abort_("[image] Could not create thread.");
+      }
+   }
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Split rows into bands run by up to threads threads (0 means one per core): the calling thread and threads - 1 pool workers.
+ * Work reading fewer than IMAGE_THREAD_MIN_PIXELS source pixels per thread is not split further.
+ **/
+static void
+image_run_bands
+   (  image_band_func_t func
+   ,  void*             user
+   ,  int               rows
+   ,  size_t            pixels
+   ,  int               threads
+   )
+{
+   if(threads <= 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   threads = min(threads, rows);
+   threads = min(threads, (int) min(pixels / IMAGE_THREAD_MIN_PIXELS, (size_t) INT_MAX));
+   
+   if(threads <= 1)
+   {
+      func(user, 0, rows);
+      return;
+   }
+
+   image_band_pool_t* pool = &image_band_pool;
+   image_band_pool_reserve(pool, threads - 1);
+
+   image_band_batch_t batch;
+   batch.func    = func;
+   batch.user    = user;
+   batch.rows    = rows;
+   batch.bands   = threads;
+   batch.next    = 0;
+   batch.pending = threads;
+   batch.link    = NULL;
+   pthread_cond_init(&batch.done, NULL);
+
+   pthread_mutex_lock(&pool->mutex);
+   image_band_batch_t** link = &pool->queue;
+   while(*link)
+      link = &(*link)->link;
+   *link = &batch;
+   pthread_cond_broadcast(&pool->work);
+
+   // Take bands alongside the workers, then wait for the ones they took
+   while(batch.next < batch.bands)
+      image_band_pool_run(pool, &batch);
+   while(batch.pending)
+      pthread_cond_wait(&batch.done, &pool->mutex);
+   pthread_mutex_unlock(&pool->mutex);
+
+   pthread_cond_destroy(&batch.done);
+}
+
+typedef struct
+{
+   const image_t* image;
+   image_t*       scaled;
+   scale_t        scale;
+   const int*     background; // Background r, g, b to blend onto, or NULL
+}  image_scale_job_t;
+
+static void
+image_t_scale_band_func
+   (  void* job_ptr
+   ,  int   y_begin
+   ,  int   y_end
+   )
+{
+   image_scale_job_t* job = (image_scale_job_t*) job_ptr;
+   image_t_scale_band(job->image, job->scaled, job->scale, job->background, y_begin, y_end);
+}
+
+//! Scale, blending onto background if it is not NULL. The caller checks image_t_scale_blends.
+static void
+image_t_scale_blend
+   (  const image_t* const image
+   ,  image_t* const       scaled
+   ,  int                  scaled_width
+   ,  int                  scaled_height
+   ,  scale_t              scale
+   ,  int                  threads
+   ,  const int*           background
+   )
+{
+   image_t_scale_size(image, &scaled_width, &scaled_height, 0.0);
+
+   image_t_init(scaled);
+   scaled->width  = scaled_width;
+   scaled->height = scaled_height;
+   scaled->color_type = image->color_type;
+   scaled->bit_depth  = image->bit_depth;
+   scaled->format     = (scale == SCALE_SSAA || scale == SCALE_SSAA_LINEAR || scale == SCALE_AREA || resample_filter(scale) || scale_is_pool(scale)) ? ssaa_format(image->format) : image->format;
+   scaled->data   = calloc((size_t) scaled->width * scaled->height, pixel_format_size(scaled->format));
+   if(scaled->format == PIXEL_INDEX8)
+      image_t_copy_palette(image, scaled);
+
+   image_scale_job_t job = { image, scaled, scale, background };
+   image_run_bands(image_t_scale_band_func, &job, scaled->height, max((size_t) image->width * image->height, (size_t) scaled->width * scaled->height), threads);
+}
+
+/**
+ * Scale image to scaled_width x scaled_height.
+ * Output rows are split into bands scaled by up to threads threads (0 means one per core).
+ * Small images are scaled on the calling thread only.
+ * Large filter reductions first go through 2x2 halvings (see resample_t). SSAA and pooling do not,
+ * as they already take one pass of adds over the source, and halving would round the averages twice,
+ * and average straight rather than premultiplied (or linear light) colors.
+ **/
+void 
+image_t_scale
+   (  const image_t* const image
+   ,  image_t* const       scaled
+   ,  int                  scaled_width
+   ,  int                  scaled_height
+   ,  scale_t              scale
+   ,  int                  threads
+   )
+{
+   image_t_scale_blend(image, scaled, scaled_width, scaled_height, scale, threads, NULL);
+}
+
+/**
+ * Scale image and blend it onto background color r, g, b, as image_t_scale followed by image_t_apply_background.
+ * SSAA downscaling blends in the same pass, rounding up like the averages, and other cases blend the scaled image.
+ * If percent is non-zero it is used instead of scaled_width and scaled_height.
+ **/
+void 
+image_t_scale_background
+   (  const image_t* const image
+   ,  image_t* const       scaled
+   ,  int                  scaled_width
+   ,  int                  scaled_height
+   ,  double               percent
+   ,  scale_t              scale
+   ,  int                  threads
+   ,  int                  r
+   ,  int                  g
+   ,  int                  b
+   )
+{
+   image_t_scale_size(image, &scaled_width, &scaled_height, percent);
+
+   if(image_t_scale_blends(image->format, image->width, image->height, scaled_width, scaled_height, scale, r, g, b))
+   {
+      const int background[3] = { r, g, b };
+      image_t_scale_blend(image, scaled, scaled_width, scaled_height, scale, threads, background);
+   }
+   else
+   {
+      image_t_scale(image, scaled, scaled_width, scaled_height, scale, threads);
+      image_t_apply_background(scaled, r, g, b);
+   }
+}
+
+/**
+ * Streaming scaler. Source rows are pushed top to bottom and output rows are stored as soon as they are complete,
+ * so only the accumulators of the scaler for the scale type (and one output image) are kept in memory.
+ * Scale types, upscaling and background blending follow image_t_scale_band and image_t_scale_background.
+ **/
+struct image_scaler_struct
+{
+   image_t*   scaled;
+   scale_t    scale;            // Scale type used for the rows, after the upscaling fallbacks
+   image_t    header;           // Source size, format and palette (no data)
+   int        y;                // Source rows pushed
+   int        y_scaled;         // Output rows stored (SSAA, pooling and point samplers)
+   int        y_block;          // Source rows accumulated into the current output row
+   int        y_block_size_min;
+   int        y_block_rest;
+   int        replicate;        // Integer upscale by replication
+   int*       x_index;          // Point samplers
+   int*       y_index;
+   ssaa_t     ssaa;
+   pool_t     pool;
+   area_t     area;
+   resample_t resample;
+   int        background[3];
+   int        blend;            // Background is blended while scaling
+   int        blend_after;      // Background is applied to the finished image, as it could not be blended while scaling
+   int            threads;      // Threads scaling groups of output rows, see image_scaler_t_set_threads
+   unsigned char* group;        // Source rows of the current group of output rows, or NULL if rows are scaled as they come
+   int            group_rows;   // Output rows per group
+};
+
+/**
+ * Start streaming rows of an image with the size, format and palette of header (whose data is not used) into scaled.
+ * If percent is non-zero it is used instead of scaled_width and scaled_height.
+ * If background is not NULL the result is blended onto it, as by image_t_scale_background.
+ **/
+image_scaler_t*
+image_scaler_t_create
+   (  const image_t* const   header
+   ,  image_t* const         scaled
+   ,  int                    scaled_width
+   ,  int                    scaled_height
+   ,  double                 percent
+   ,  scale_t                scale
+   ,  const color32_t* const background
+   )
+{
+   image_scaler_t* scaler = (image_scaler_t*) calloc(1, sizeof(image_scaler_t));
+   image_t_scale_size(header, &scaled_width, &scaled_height, percent);
+
+   // Keep our own palette, as the rows may come from images that do not outlive the scaler
+   scaler->header      = *header;
+   scaler->header.data = NULL;
+   scaler->scaled      = scaled;
+   image_t_copy_palette(header, &scaler->header);
+   const color32_t* palette = scaler->header.palette;
+
+   image_t_init(scaled);
+   scaled->width      = scaled_width;
+   scaled->height     = scaled_height;
+   scaled->color_type = header->color_type;
+   scaled->bit_depth  = header->bit_depth;
+   scaled->format     = (scale == SCALE_SSAA || scale == SCALE_SSAA_LINEAR || scale == SCALE_AREA || resample_filter(scale) || scale_is_pool(scale)) ? ssaa_format(header->format) : header->format;
+   scaled->data       = calloc((size_t) scaled->width * scaled->height, pixel_format_size(scaled->format));
+   if(scaled->format == PIXEL_INDEX8)
+      image_t_copy_palette(header, scaled);
+
+   int blend = 0;
+   if(background)
+   {
+      scaler->background[0] = background->r;
+      scaler->background[1] = background->g;
+      scaler->background[2] = background->b;
+      blend = image_t_scale_blends(header->format, header->width, header->height, scaled->width, scaled->height, scale, background->r, background->g, background->b);
+      scaler->blend       = blend;
+      scaler->blend_after = !blend;
+   }
+
+   if(scaled->width > header->width || scaled->height > header->height)
+   {
+      scaler->replicate = !resample_filter(scale) && scaled->width % header->width == 0 && scaled->height % header->height == 0;
+      if(!scaler->replicate && (scale == SCALE_SSAA || scale == SCALE_SSAA_LINEAR || scale_is_pool(scale)))
+         scale = SCALE_BILINEAR;
+   }
+   scaler->scale = scale;
+   if(scaler->replicate)
+      return scaler;
+
+   const int x_block_size_min = header->width  / scaled->width;
+   const int x_block_rest     = header->width  % scaled->width;
+   scaler->y_block_size_min   = header->height / scaled->height;
+   scaler->y_block_rest       = header->height % scaled->height;
+
+   switch(scale)
+   {
+      case SCALE_FIRST:
+      case SCALE_LAST:
+      case SCALE_CENTER:
+         scaler->x_index = nearest_index_table(header->width , scaled->width , scale);
+         scaler->y_index = nearest_index_table(header->height, scaled->height, scale);
+         break;
+      case SCALE_SSAA:
+      case SCALE_SSAA_LINEAR:
+         ssaa_t_init(&scaler->ssaa, scaled->width, x_block_size_min, x_block_rest, scaler->y_block_size_min, header->format, palette, scale == SCALE_SSAA_LINEAR);
+         if(blend)
+            ssaa_t_set_background(&scaler->ssaa, scaler->background[0], scaler->background[1], scaler->background[2]);
+         break;
+      case SCALE_MAX:
+      case SCALE_MIN:
+      case SCALE_MEDIAN:
+      case SCALE_MODE:
+         pool_t_init(&scaler->pool, scaled->width, x_block_size_min, x_block_rest, scaler->y_block_size_min + (scaler->y_block_rest ? 1 : 0), header->format, palette, scale);
+         break;
+      case SCALE_AREA:
+         area_t_init(&scaler->area, header->width, header->height, scaled->width, scaled->height, header->format, palette, scaled->data);
+         break;
+      case SCALE_BILINEAR:
+      case SCALE_BICUBIC:
+      case SCALE_LANCZOS3:
+         resample_t_init(&scaler->resample, header->width, header->height, scaled->width, scaled->height, header->format, palette, scaled->data, resample_filter(scale));
+         break;
+      default:
+         abort_("[scale_image] Unknown SCALE type.");
+         break;
+   }
+
+   return scaler;
+}
+
+//! First source row of block of output rows y_scaled, larger blocks coming first.
+static inline int
+image_scaler_t_block_begin
+   (  const image_scaler_t* const scaler
+   ,  int                         y_scaled
+   )
+{
+   return y_scaled * scaler->y_block_size_min + min(y_scaled, scaler->y_block_rest);
+}
+
+/**
+ * Scale SSAA and pooling downscales on up to threads threads (0 means one per core).
+ * Source rows are then collected for a group of output rows, which is scaled in bands by image_t_scale_band once complete,
+ * while no more rows are coming in. A group holds about two times IMAGE_THREAD_MIN_PIXELS source pixels per thread.
+ * As larger blocks come first, the blocks of a group, seen as an image of its own, are the same as in the full image.
+ * Other scale types, and images too small to split, keep scaling each row as it comes.
+ **/
+void
+image_scaler_t_set_threads
+   (  image_scaler_t* const scaler
+   ,  int                   threads
+   )
+{
+   const image_t* header = &scaler->header;
+   const image_t* scaled = scaler->scaled;
+   assert(scaler->y == 0 && !scaler->group);
+
+   if(threads <= 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if(  threads <= 1
+     || scaler->replicate 
+     || !(scaler->scale == SCALE_SSAA || scaler->scale == SCALE_SSAA_LINEAR || scale_is_pool(scaler->scale))
+     || (size_t) header->width * header->height < 2 * IMAGE_THREAD_MIN_PIXELS
+     )
+      return;
+
+   const int    y_block_size_max = scaler->y_block_size_min + (scaler->y_block_rest ? 1 : 0);
+   const size_t group_pixels     = (size_t) 2 * threads * IMAGE_THREAD_MIN_PIXELS;
+   scaler->threads    = threads;
+   scaler->group_rows = (int) min((size_t) scaled->height, max((size_t) threads, group_pixels / ((size_t) header->width * y_block_size_max)));
+   scaler->group      = (unsigned char*) malloc((size_t) scaler->group_rows * y_block_size_max * header->width * pixel_format_size(header->format));
+   if(!scaler->group)
+      abort_("[scale_image] Could not allocate rows for threaded scaling.");
+}
+
+//! Collect a source row for the current group of output rows, and scale the group in bands once it is complete.
+static void
+image_scaler_t_push_group_row
+   (  image_scaler_t* const scaler
+   ,  const void*           data_row
+   ,  int                   y
+   )
+{
+   const image_t* header      = &scaler->header;
+   const size_t   source_size = (size_t) header->width * pixel_format_size(header->format);
+   const int      group_begin = image_scaler_t_block_begin(scaler, scaler->y_scaled);
+   memcpy(scaler->group + (size_t) (y - group_begin) * source_size, data_row, source_size);
+
+   const int y_scaled_end = min(scaler->y_scaled + scaler->group_rows, scaler->scaled->height);
+   const int group_end    = image_scaler_t_block_begin(scaler, y_scaled_end);
+   if(y + 1 < group_end)
+      return;
+
+   image_t source = *header;
+   image_t band   = *scaler->scaled;
+   source.height  = group_end - group_begin;
+   source.data    = scaler->group;
+   band.height    = y_scaled_end - scaler->y_scaled;
+   band.data      = (unsigned char*) band.data + (size_t) scaler->y_scaled * band.width * pixel_format_size(band.format);
+
+   image_scale_job_t job = { &source, &band, scaler->scale, scaler->blend ? scaler->background : NULL };
+   image_run_bands(image_t_scale_band_func, &job, band.height, (size_t) source.width * source.height, scaler->threads);
+   scaler->y_scaled = y_scaled_end;
+}
+
+//! Push the next source row.
+void
+image_scaler_t_push_row
+   (  image_scaler_t* const scaler
+   ,  const void*           data_row
+   )
+{
+   const image_t* header   = &scaler->header;
+   image_t*       scaled   = scaler->scaled;
+   const size_t   row_size = (size_t) scaled->width * pixel_format_size(scaled->format);
+   unsigned char* data     = (unsigned char*) scaled->data;
+   const int      y        = scaler->y++;
+   assert(y < header->height);
+
+   if(scaler->replicate)
+   {
+      // Replicate this row into its block of output rows
+      image_t source = *header;
+      image_t block  = *scaled;
+      source.height = 1;
+      source.data   = (void*) data_row;
+      block.height  = scaled->height / header->height;
+      block.data    = data + (size_t) y * block.height * row_size;
+      image_t_replicate_band(&source, &block, 0, block.height);
+      return;
+   }
+
+   if(scaler->group)
+   {
+      image_scaler_t_push_group_row(scaler, data_row, y);
+      return;
+   }
+
+   switch(scaler->scale)
+   {
+      case SCALE_FIRST:
+      case SCALE_LAST:
+      case SCALE_CENTER:
+      {
+         for(; scaler->y_scaled < scaled->height && scaler->y_index[scaler->y_scaled] == y; ++scaler->y_scaled)
+         {
+            unsigned char* scale_data_row = data + (size_t) scaler->y_scaled * row_size;
+            if(scaler->y_scaled > 0 && scaler->y_index[scaler->y_scaled - 1] == y)
+               memcpy(scale_data_row, scale_data_row - row_size, row_size);
+            else
+               nearest_row((const unsigned char*) data_row, scale_data_row, scaler->x_index, scaled->width, pixel_format_size(header->format));
+         }
+         break;
+      }
+      case SCALE_SSAA:
+      case SCALE_SSAA_LINEAR:
+      case SCALE_MAX:
+      case SCALE_MIN:
+      case SCALE_MEDIAN:
+      case SCALE_MODE:
+      {
+         const int pool = scale_is_pool(scaler->scale);
+         if(pool)
+            pool_t_accumulate_row(&scaler->pool, data_row);
+         else
+            ssaa_t_accumulate_row(&scaler->ssaa, data_row);
+
+         const int y_block_size = scaler->y_block_size_min + (scaler->y_scaled < scaler->y_block_rest ? 1 : 0);
+         if(++scaler->y_block == y_block_size)
+         {
+            unsigned char* scale_data_row = data + (size_t) scaler->y_scaled * row_size;
+            if(pool)
+               pool_t_store_row(&scaler->pool, scale_data_row);
+            else
+               ssaa_t_store_row(&scaler->ssaa, scale_data_row);
+            scaler->y_block = 0;
+            ++scaler->y_scaled;
+         }
+         break;
+      }
+      case SCALE_AREA:
+         area_t_push_row(&scaler->area, data_row);
+         break;
+      case SCALE_BILINEAR:
+      case SCALE_BICUBIC:
+      case SCALE_LANCZOS3:
+         resample_t_push_row(&scaler->resample, data_row);
+         break;
+      default:
+         break;
+   }
+}
+
+/**
+ * Heap memory held by the scaler while rows are pushed: accumulators, weights, index tables and the rows of a threaded group.
+ * The scaled image is not counted.
+ **/
+size_t
+image_scaler_t_memory
+   (  const image_scaler_t* const scaler
+   )
+{
+   const image_t* header = &scaler->header;
+   const image_t* scaled = scaler->scaled;
+   size_t size = sizeof(image_scaler_t) + (header->palette ? 256 * sizeof(color32_t) : 0);
+   if(scaler->group)
+      size += (size_t) scaler->group_rows * (scaler->y_block_size_min + (scaler->y_block_rest ? 1 : 0)) * header->width * pixel_format_size(header->format);
+   if(scaler->replicate)
+      return size;
+
+   switch(scaler->scale)
+   {
+      case SCALE_FIRST:
+      case SCALE_LAST:
+      case SCALE_CENTER:
+         return size + ((size_t) scaled->width + scaled->height) * sizeof(int);
+      case SCALE_SSAA:
+      case SCALE_SSAA_LINEAR:
+         return size + ssaa_t_memory(&scaler->ssaa);
+      case SCALE_MAX:
+      case SCALE_MIN:
+      case SCALE_MEDIAN:
+      case SCALE_MODE:
+         return size + pool_t_memory(&scaler->pool);
+      case SCALE_AREA:
+         return size + area_t_memory(&scaler->area);
+      case SCALE_BILINEAR:
+      case SCALE_BICUBIC:
+      case SCALE_LANCZOS3:
+         return size + resample_t_memory(&scaler->resample);
+      default:
+         return size;
+   }
+}
+
+//! Finish the scaled image after all source rows have been pushed, and free the scaler.
+void
+image_scaler_t_destroy
+   (  image_scaler_t* const scaler
+   )
+{
+   assert(scaler->y == scaler->header.height);
+
+   free(scaler->group);
+   if(!scaler->replicate)
+   {
+      switch(scaler->scale)
+      {
+         case SCALE_FIRST:
+         case SCALE_LAST:
+         case SCALE_CENTER:
+            free(scaler->x_index);
+            free(scaler->y_index);
+            break;
+         case SCALE_SSAA:
+         case SCALE_SSAA_LINEAR:
+            ssaa_t_destroy(&scaler->ssaa);
+            break;
+         case SCALE_MAX:
+         case SCALE_MIN:
+         case SCALE_MEDIAN:
+         case SCALE_MODE:
+            pool_t_destroy(&scaler->pool);
+            break;
+         case SCALE_AREA:
+            area_t_destroy(&scaler->area);
+            break;
+         case SCALE_BILINEAR:
+         case SCALE_BICUBIC:
+         case SCALE_LANCZOS3:
+            resample_t_destroy(&scaler->resample);
+            break;
+         default:
+            break;
+      }
+   }
+
+   if(scaler->blend_after)
+      image_t_apply_background(scaler->scaled, scaler->background[0], scaler->background[1], scaler->background[2]);
+
+   if(scaler->header.palette)
+      free(scaler->header.palette);
+   free(scaler);
+}
+
+static void
+image_t_halve_band_func
+   (  void* job_ptr
+   ,  int   y_begin
+   ,  int   y_end
+   )
+{
+   image_scale_job_t* job       = (image_scale_job_t*) job_ptr;
+   const image_t*     image     = job->image;
+   const size_t       row_size  = (size_t) image->width * pixel_format_size(image->format);
+   const size_t       half_size = (size_t) job->scaled->width * pixel_format_size(job->scaled->format);
+   int y;
+   for(y = y_begin; y < y_end; ++y)
+   {
+      const unsigned char* row0 = (const unsigned char*) image->data + (size_t) 2 * y * row_size;
+      const unsigned char* row1 = (2 * y + 1 < image->height) ? row0 + row_size : row0;
+      halve_row(row0, row1, (unsigned char*) job->scaled->data + (size_t) y * half_size, image->width, image->format, image->palette);
+   }
+}
+
+/**
+ * Halve image with a 2x2 box filter, to (width + 1) / 2 x (height + 1) / 2 in ssaa_format.
+ * Rows are split over up to threads threads like image_t_scale.
+ **/
+void
+image_t_halve
+   (  const image_t* const image
+   ,  image_t* const       halved
+   ,  int                  threads
+   )
+{
+   image_t_init(halved);
+   halved->width      = (image->width  + 1) / 2;
+   halved->height     = (image->height + 1) / 2;
+   halved->color_type = image->color_type;
+   halved->bit_depth  = image->bit_depth;
+   halved->format     = ssaa_format(image->format);
+   halved->data       = malloc((size_t) halved->width * halved->height * pixel_format_size(halved->format));
+   
+   image_scale_job_t job = { image, halved, SCALE_SSAA, NULL };
+   image_run_bands(image_t_halve_band_func, &job, halved->height, (size_t) image->width * image->height, threads);
+}
+
+/**
+ * Mip pyramid of an image. Level 0 is the image itself (not owned), and level n + 1 is level n halved.
+ * Levels are built on demand and kept, so several sizes of one image can be rendered from the same levels.
+ **/
+void
+mip_pyramid_t_init
+   (  mip_pyramid_t* const pyramid
+   ,  const image_t* const image
+   ,  int                  threads
+   )
+{
+   pyramid->image   = image;
+   pyramid->levels  = 0;
+   pyramid->threads = threads;
+}
+
+void
+mip_pyramid_t_destroy
+   (  mip_pyramid_t* const pyramid
+   )
+{
+   int level;
+   for(level = 0; level < pyramid->levels; ++level)
+   {
+      image_t_destroy(&pyramid->level[level]);
+   }
+   pyramid->levels = 0;
+}
+
+//! Get level (0 is the image itself), halving as needed.
+const image_t*
+mip_pyramid_t_level
+   (  mip_pyramid_t* const pyramid
+   ,  int                  level
+   )
+{
+   assert(level <= MIP_PYRAMID_MAX_LEVELS);
+   while(pyramid->levels < level)
+   {
+      image_t_halve(mip_pyramid_t_level(pyramid, pyramid->levels), &pyramid->level[pyramid->levels], pyramid->threads);
+      ++pyramid->levels;
+   }
+   return level ? &pyramid->level[level - 1] : pyramid->image;
+}
+
+/**
+ * Scale from the pyramid. For the filter types this starts from the same level image_t_scale would halve to,
+ * so the result is identical to scaling the full image, and the types that do not halve always use level 0.
+ **/
+void
+mip_pyramid_t_scale
+   (  mip_pyramid_t* const pyramid
+   ,  image_t* const       scaled
+   ,  int                  scaled_width
+   ,  int                  scaled_height
+   ,  scale_t              scale
+   )
+{
+   image_t_scale_size(pyramid->image, &scaled_width, &scaled_height, 0.0);
+   
+   const int level = resample_filter(scale) 
+                   ? min(resample_halvings(pyramid->image->width, pyramid->image->height, scaled_width, scaled_height), MIP_PYRAMID_MAX_LEVELS)
+                   : 0;
+   image_t_scale(mip_pyramid_t_level(pyramid, level), scaled, scaled_width, scaled_height, scale, pyramid->threads);
+}
+
+void 
+image_t_scale_percent
+   (  const image_t* const image
+   ,  image_t* const       scaled
+   ,  double               percent
+   ,  scale_t              scale
+   ,  int                  threads
+   )
+{
+   int width, height;
+   image_t_scale_size(image, &width, &height, percent);
+   image_t_scale(image, scaled, width, height, scale, threads);
+}
+
+void 
+image_t_crop
+   (  const image_t* const image
+   ,  image_t*       const cropped
+   ,  int x_crop_begin
+   ,  int y_crop_begin
+   ,  int x_crop_end
+   ,  int y_crop_end
+   )
+{
+   y_crop_end = min(image->height, y_crop_end);
+   x_crop_end = min(image->width , x_crop_end);
+
+   image_t_init(cropped);
+   cropped->width  = x_crop_end - x_crop_begin;
+   cropped->height = y_crop_end - y_crop_begin;
+   cropped->color_type = image->color_type;
+   cropped->bit_depth  = image->bit_depth;
+   cropped->format     = image->format;
+   image_t_copy_palette(image, cropped);
+
+   const int    pixel_size       = pixel_format_size(image->format);
+   const size_t cropped_row_size = (size_t) cropped->width * pixel_size;
+   cropped->data   = malloc(cropped_row_size * cropped->height);
+
+   unsigned char* data_row;
+   unsigned char* cropped_data = (unsigned char*) cropped->data;
+   
+   int y;
+   for(y = y_crop_begin; y < y_crop_end; ++y)
+   {
+      // Rows are contiguous in every pixel format, so just copy the part of the row we keep
+      data_row = (unsigned char*) image->data + ((size_t) y * image->width + x_crop_begin) * pixel_size;
+      memcpy(cropped_data, data_row, cropped_row_size);
+      cropped_data += cropped_row_size;
+   }
+}
+
+/**
+ * Blend pixels with alpha onto a background color, in place.
+ * Specialised (always inlined) for each pixel format with an alpha channel; alpha is the last channel.
+ **/
+static inline __attribute__((always_inline)) void
+apply_background_generic
+   (  unsigned char* data
+   ,  int            size
+   ,  const int      background[3]
+   ,  const int      channels
+   ,  const int      depth
+   )
+{
+   const double range = (depth == 2) ? 65535.0 : 255.0;
+   int i, c;
+   for(i = 0; i < size; ++i)
+   {
+      double alpha = (double) pixel_channel(data, channels - 1, depth) / range;
+
+      for(c = 0; c < channels - 1; ++c)
+      {
+         pixel_set_channel(data, c, pixel_channel(data, c, depth) * alpha + background[c] * (1.0 - alpha), depth);
+      }
+
+      data += channels * depth;
+   }
+}
+
+//! Blend gray+alpha onto a non-gray background, producing an rgb24 image.
+static void
+apply_background_gray_alpha_to_rgb
+   (  image_t* const image
+   ,  int r
+   ,  int g
+   ,  int b
+   )
+{
+   int i;
+   int size = image->width * image->height;
+   const unsigned char* data = (const unsigned char*) image->data;
+   unsigned char* rgb        = (unsigned char*) malloc((size_t) size * pixel_format_size(PIXEL_RGB24));
+   unsigned char* rgb_ptr    = rgb;
+   for(i = 0; i < size; ++i)
+   {
+      double alpha = (double) data[1] / (double)255;
+      
+      *rgb_ptr++ = data[0] * alpha + r * (1.0 - alpha);
+      *rgb_ptr++ = data[0] * alpha + g * (1.0 - alpha);
+      *rgb_ptr++ = data[0] * alpha + b * (1.0 - alpha);
+
+      data += 2;
+   }
+
+   image_t_replace_data(image, rgb, PIXEL_RGB24);
+}
+
+void 
+image_t_apply_background
+   (  image_t* const  image
+   ,  int r
+   ,  int g
+   ,  int b
+   )
+{
+   int size = image->width * image->height;
+
+   switch(image->format)
+   {
+      case PIXEL_GRAY8:
+      case PIXEL_RGB24:
+      {
+         /* No alpha, nothing to do */
+         break;
+      }
+      case PIXEL_GRAY_ALPHA16:
+      {
+         if(r == g && g == b)
+         {
+            const int background[3] = { r, g, b };
+            image_t_make_writable(image);
+            apply_background_generic(image->data, size, background, 2, 1);
+         }
+         else
+         {
+            apply_background_gray_alpha_to_rgb(image, r, g, b);
+         }
+         break;
+      }
+      case PIXEL_RGBA32:
+      {
+         const int background[3] = { r, g, b };
+         image_t_make_writable(image);
+         apply_background_generic(image->data, size, background, 4, 1);
+         break;
+      }
+      case PIXEL_RGBA64:
+      {
+         const int background[3] = { r * 257, g * 257, b * 257 };
+         image_t_make_writable(image);
+         apply_background_generic(image->data, size, background, 4, 2);
+         break;
+      }
+      case PIXEL_INDEX8:
+      {
+         // Blending only depends on the color, so we just blend the palette entries
+         const int background[3] = { r, g, b };
+         apply_background_generic((unsigned char*) image->palette, 256, background, 4, 1);
+         break;
+      }
    }
 }
 
@@ -407,27 +4460,31 @@ image_t_crop_background
    ,  int b
    )
 {
-   color32_t background = {r, g, b, 0};
+   const uint32_t background = (uint32_t) r | ((uint32_t) g << 8) | ((uint32_t) b << 16);
    
    // Find crop indeces
    int y, x;
    int crop_y_begin = image->height, crop_y_end = 0;
    int crop_x_begin = image->width,  crop_x_end = 0;
 
-   color32_t* data = (color32_t*) image->data;
+   const pixel_format_info_t* info = &pixel_format_info[image->format];
+   const unsigned char*       data = (const unsigned char*) image->data;
 
    for(y = 0; y < image->height; ++y)
    {
       for(x = 0; x < image->width; ++x)
       {
-         if(!color32_t_is_equal_rgb(*data, background))
+         const uint32_t rgb = (image->format == PIXEL_INDEX8) 
+                            ? pixel_rgb((const unsigned char*) &image->palette[*data], 3, 1) 
+                            : pixel_rgb(data, info->channels, info->depth);
+         if(rgb != background)
          {
             crop_y_begin = min(crop_y_begin, y);
             crop_y_end   = max(crop_y_end,   y);
             crop_x_begin = min(crop_x_begin, x);
             crop_x_end   = max(crop_x_end,   x);
          }
-         ++data;
+         data += info->size;
       }
    }
    
@@ -549,66 +4606,181 @@ image_t_standardize_edge
 /**
  * Utilities for drawing image to terminal
  **/
-#define BYTE_TO_TEXT(buf_, byte_) do {\
-	*(buf_)++ = '0' + (byte_) / 100u;\
-	*(buf_)++ = '0' + (byte_) / 10u % 10u;\
-	*(buf_)++ = '0' + (byte_) % 10u;\
-} while (0)
 
 /**
- * Draw image using a work buffer. 
+ * Decimal text of each byte value without leading zeros, followed by a ';', packed in 4 bytes.
+ * A color channel is written with one 4 byte store, after which the buffer is advanced by sgr_digits_len (the digits and the ';').
+ * Built once, on first draw.
  **/
-void image_t_draw
-   (  const image_t* const image
-   ,  char* buffer
-   ,  int   x_pos
-   ,  int   y_pos
-   ,  FILE* file
+static char           sgr_digits[256][4];
+static unsigned char  sgr_digits_len[256];
+static pthread_once_t sgr_digits_once = PTHREAD_ONCE_INIT;
+
+static void
+sgr_digits_init
+   (
    )
 {
-	/* fill output buffer */
-   int resx = image->width;
-   int resy = image->height;
+   int i;
+   for(i = 0; i < 256; ++i)
+   {
+      char text[8];
+      sgr_digits_len[i] = sprintf(text, "%i;", i);
+      memcpy(sgr_digits[i], text, 4);
+   }
+}
 
-	uint32_t color_fg     = 0xFFFFFF00;
-	uint32_t color_bg     = 0xFFFFFF00;
-	color32_t *pixel_bg = (color32_t *) image->data;
-	color32_t *pixel_fg = pixel_bg + resx;
-	char *buf = buffer;
-   
-   if(x_pos && y_pos)
+/**
+ * Write the SGR parameters setting the foreground ('3') or background ('4') color to a packed 0x00BBGGRR color,
+ * as "38;2;R;G;B;" with a trailing ';'. May write up to 3 bytes past the returned end.
+ **/
+static inline char*
+sgr_write_color
+   (  char*    buf
+   ,  char     ground
+   ,  uint32_t rgb
+   )
+{
+   int c;
+   *buf++ = ground; *buf++ = '8';
+   *buf++ = ';'; *buf++ = '2'; *buf++ = ';';
+   for(c = 0; c < 3; ++c)
+   {
+      const unsigned int byte = (rgb >> (8 * c)) & 0xFF;
+      memcpy(buf, sgr_digits[byte], 4);
+      buf += sgr_digits_len[byte];
+   }
+   return buf;
+}
+
+/**
+ * Write one SGR sequence setting the foreground and/or background color (whichever is set_fg/set_bg),
+ * as ESC[38;2;R;G;B;48;2;R;G;Bm with no leading zeros. Returns pointer to the end of the written sequence.
+ **/
+static inline char*
+sgr_write
+   (  char*    buf
+   ,  int      set_fg
+   ,  uint32_t rgb_fg
+   ,  int      set_bg
+   ,  uint32_t rgb_bg
+   )
+{
+   *buf++ = '\033'; *buf++ = '[';
+   if(set_fg)
+      buf = sgr_write_color(buf, '3', rgb_fg);
+   if(set_bg)
+      buf = sgr_write_color(buf, '4', rgb_bg);
+   buf[-1] = 'm'; // Replace the last ';'
+   return buf;
+}
+
+/**
+ * Fill the draw buffer with pixel rows [row_begin, row_end) of an index8 image, row_begin being even.
+ * The foreground and background SGR parameters are rendered once per palette entry, 
+ * and then just copied for each cell where the index changes.
+ **/
+static char*
+image_t_draw_index
+   (  const image_t* const image
+   ,  char* buf
+   ,  int   row_begin
+   ,  int   row_end
+   )
+{
+   char sgr_fg[256][24];
+   char sgr_bg[256][24];
+   int  sgr_fg_len[256];
+   int  sgr_bg_len[256];
+   int  i;
+   for(i = 0; i < 256; ++i)
    {
-      // Set buffer to write from 1,1
-      *buf++ = '\033'; *buf++ = '[';
-      buf += sprintf(buf, "%i", y_pos);
-      *buf++ = ';';
-      buf += sprintf(buf, "%i", x_pos);
-      *buf++ = 'H';
+      const uint32_t rgb = pixel_rgb((const unsigned char*) &image->palette[i], 3, 1);
+      sgr_fg_len[i] = sgr_write_color(sgr_fg[i], '3', rgb) - sgr_fg[i];
+      sgr_bg_len[i] = sgr_write_color(sgr_bg[i], '4', rgb) - sgr_bg[i];
    }
 
-	for (int row = 0; row < resy; row+=2) {
+   int resx = image->width;
+   int resy = row_end;
+
+   int index_fg = -1;
+   int index_bg = -1;
+	const unsigned char *pixel_bg = (const unsigned char *) image->data + (size_t) row_begin * resx;
+	const unsigned char *pixel_fg = pixel_bg + resx;
+
+	for (int row = row_begin; row < resy; row+=2) {
+      if (row + 1 == resy)
+         pixel_fg = pixel_bg; /* Odd height, the last row fills whole cells */
 		for (int col = 0; col < resx; col++) {
-         /* Handle foreground */
-			if ((color_fg ^ *(uint32_t*)pixel_fg) & 0x00FFFFFF) {
-				*buf++ = '\033'; *buf++ = '[';
-				*buf++ = '3'; *buf++ = '8'; /* Set foreground color */
-				*buf++ = ';'; *buf++ = '2';
-				*buf++ = ';'; BYTE_TO_TEXT(buf, pixel_fg->r);
-				*buf++ = ';'; BYTE_TO_TEXT(buf, pixel_fg->g);
-				*buf++ = ';'; BYTE_TO_TEXT(buf, pixel_fg->b);
-				*buf++ = 'm';
-				color_fg = *(uint32_t*)pixel_fg;
-			}
-         /* Handle background */
-			if ((color_bg ^ *(uint32_t*)pixel_bg) & 0x00FFFFFF) {
-				*buf++ = '\033'; *buf++ = '[';
-				*buf++ = '4'; *buf++ = '8'; /* Set background color */
-				*buf++ = ';'; *buf++ = '2';
-				*buf++ = ';'; BYTE_TO_TEXT(buf, pixel_bg->r);
-				*buf++ = ';'; BYTE_TO_TEXT(buf, pixel_bg->g);
-				*buf++ = ';'; BYTE_TO_TEXT(buf, pixel_bg->b);
-				*buf++ = 'm';
-				color_bg = *(uint32_t*)pixel_bg;
+         if (index_fg != *pixel_fg || index_bg != *pixel_bg) {
+            *buf++ = '\033'; *buf++ = '[';
+            if (index_fg != *pixel_fg) {
+               index_fg = *pixel_fg;
+               memcpy(buf, sgr_fg[index_fg], sgr_fg_len[index_fg]);
+               buf += sgr_fg_len[index_fg];
+            }
+            if (index_bg != *pixel_bg) {
+               index_bg = *pixel_bg;
+               memcpy(buf, sgr_bg[index_bg], sgr_bg_len[index_bg]);
+               buf += sgr_bg_len[index_bg];
+            }
+            buf[-1] = 'm';
+         }
+         /* Write U+2584 (solid block in lower half of cell) */
+			*buf++ = (char)0xe2; 
+			*buf++ = (char)0x96; 
+			*buf++ = (char)0x84; 
+			pixel_fg++;
+			pixel_bg++;
+		}
+
+		*buf++ = '\n';
+
+	   pixel_fg += resx;
+	   pixel_bg += resx;
+	}
+
+   return buf;
+}
+
+/**
+ * Fill the draw buffer with pixel rows [row_begin, row_end) for one pixel format, row_begin being even.
+ * Always inlined with constant channels/depth, so each format gets its own loop.
+ * Pixels are compared as packed 0x00BBGGRR, which for rgba32 is just the pixel with alpha masked off.
+ * The colors start out unknown, so the first cell sets both.
+ **/
+static inline __attribute__((always_inline)) char*
+image_t_draw_generic
+   (  const image_t* const image
+   ,  char*     buf
+   ,  int       row_begin
+   ,  int       row_end
+   ,  const int channels
+   ,  const int depth
+   )
+{
+   int resx = image->width;
+   int resy = row_end;
+   const int pixel_size = channels * depth;
+
+	uint32_t color_fg     = 0xFF000000; /* Unknown, outside of any 0x00BBGGRR color */
+	uint32_t color_bg     = 0xFF000000;
+	const unsigned char *pixel_bg = (const unsigned char *) image->data + (size_t) row_begin * resx * pixel_size;
+	const unsigned char *pixel_fg = pixel_bg + resx * pixel_size;
+
+	for (int row = row_begin; row < resy; row+=2) {
+      if (row + 1 == resy)
+         pixel_fg = pixel_bg; /* Odd height, the last row fills whole cells */
+		for (int col = 0; col < resx; col++) {
+         uint32_t rgb_fg = pixel_rgb(pixel_fg, channels, depth);
+         uint32_t rgb_bg = pixel_rgb(pixel_bg, channels, depth);
+         /* Set foreground and/or background color in one sequence */
+         const int set_fg = color_fg != rgb_fg;
+         const int set_bg = color_bg != rgb_bg;
+			if (set_fg || set_bg) {
+				buf = sgr_write(buf, set_fg, rgb_fg, set_bg, rgb_bg);
+				color_fg = rgb_fg;
+				color_bg = rgb_bg;
 			}
          /* Write U+2584 (solid block in lower half of cell) */
          char two_pixel_pr_char[] = { (char)0xe2, (char)0x96, (char)0x84 };
@@ -616,25 +4788,538 @@ void image_t_draw
 			*buf++ = two_pixel_pr_char[1]; 
 			*buf++ = two_pixel_pr_char[2]; 
          /* Increment pointers */
-			pixel_fg++;
-			pixel_bg++;
+			pixel_fg += pixel_size;
+			pixel_bg += pixel_size;
 		}
 
 		*buf++ = '\n';
 
-	   pixel_fg += resx;
-	   pixel_bg += resx;
+	   pixel_fg += resx * pixel_size;
+	   pixel_bg += resx * pixel_size;
 	}
-   /* Reset char (not really needed, but also doesn't cost that much) and NULL terminate */
-	*buf++ = '\033'; *buf++ = '[';
-	*buf++ = '0';
-	*buf++ = 'm';
-	*buf = '\0'; /* NULL termination */
-
-	/* flush output buffer */
-	//CALL_STDOUT(fputs(buffer, stdout), "DG_DrawFrame: fputs error %d");
-	fputs(buffer, file);
-
-	/* clear output buffer */
-	//memset(buffer, '\0', buf - buffer + 1u);
+
+   return buf;
+}
+
+//! Largest SGR sequence, setting both colors: ESC[38;2;255;255;255;48;2;255;255;255m
+#define DRAW_SGR_MAX_SIZE 36
+
+//! Largest cursor position sequence: ESC[y;xH
+#define DRAW_POS_MAX_SIZE (2 * 11 + 4)
+
+//! Fewest cells worth encoding on a separate thread.
+#define IMAGE_DRAW_MIN_CELLS (1 << 14)
+
+/**
+ * Worst case size of cell_rows rows of output, when every cell sets both colors.
+ * The bytes sgr_write_color stores past the end of shorter sequences stay within this as well.
+ **/
+static size_t
+image_draw_band_size
+   (  int width
+   ,  int cell_rows
+   )
+{
+   return (size_t) cell_rows * width * (DRAW_SGR_MAX_SIZE + 3) // SGR and U+2584
+        + cell_rows;                                           // '\n'
+}
+
+//! Worst case number of bytes image_t_draw writes to its buffer for image.
+size_t
+image_t_draw_size
+   (  const image_t* const image
+   )
+{
+   return DRAW_POS_MAX_SIZE
+        + image_draw_band_size(image->width, (image->height + 1) / 2)
+        + 4; // ESC[0m
+}
+
+typedef struct
+{
+   const image_t* image;
+   char*          buffer;
+   int            x_pos;
+   int            y_pos;
+   int            bands;
+   struct iovec*  iov;
+}  image_draw_job_t;
+
+//! Encode bands [band_begin, band_end) of a draw job, each into its own part of the buffer.
+static void
+image_t_draw_band_func
+   (  void* job_ptr
+   ,  int   band_begin
+   ,  int   band_end
+   )
+{
+   image_draw_job_t* job       = (image_draw_job_t*) job_ptr;
+   const image_t*    image     = job->image;
+   const int         cell_rows = (image->height + 1) / 2;
+   int band;
+   for(band = band_begin; band < band_end; ++band)
+   {
+      const int row_begin = 2 * (int) ((int64_t) cell_rows *  band      / job->bands);
+      const int row_end   = min(2 * (int) ((int64_t) cell_rows * (band + 1) / job->bands), image->height);
+      
+      // Bands are laid out at their worst case offsets, after room for the cursor position
+      char* buf   = job->buffer + DRAW_POS_MAX_SIZE + image_draw_band_size(image->width, row_begin / 2);
+      char* begin = buf;
+
+      if(band == 0 && job->x_pos && job->y_pos)
+      {
+         // Set buffer to write from x_pos, y_pos, in the room left in front of the first band
+         char pos[DRAW_POS_MAX_SIZE + 1];
+         const int pos_size = snprintf(pos, sizeof(pos), "\033[%i;%iH", job->y_pos, job->x_pos);
+         begin -= pos_size;
+         memcpy(begin, pos, pos_size);
+      }
+
+      switch(image->format)
+      {
+         case PIXEL_GRAY8:
+            buf = image_t_draw_generic(image, buf, row_begin, row_end, 1, 1);
+            break;
+         case PIXEL_GRAY_ALPHA16:
+            buf = image_t_draw_generic(image, buf, row_begin, row_end, 2, 1);
+            break;
+         case PIXEL_RGB24:
+            buf = image_t_draw_generic(image, buf, row_begin, row_end, 3, 1);
+            break;
+         case PIXEL_RGBA32:
+            buf = image_t_draw_generic(image, buf, row_begin, row_end, 4, 1);
+            break;
+         case PIXEL_RGBA64:
+            buf = image_t_draw_generic(image, buf, row_begin, row_end, 4, 2);
+            break;
+         case PIXEL_INDEX8:
+            buf = image_t_draw_index(image, buf, row_begin, row_end);
+            break;
+      }
+
+      if(band == job->bands - 1)
+      {
+         /* Reset char (not really needed, but also doesn't cost that much) */
+         *buf++ = '\033'; *buf++ = '[';
+         *buf++ = '0';
+         *buf++ = 'm';
+      }
+
+      job->iov[band].iov_base = begin;
+      job->iov[band].iov_len  = buf - begin;
+   }
+}
+
+/**
+ * Draw image into buffer, which must hold at least image_t_draw_size(image) bytes. 
+ * Pairs of pixel rows are encoded as cells in bands on up to threads threads (0 means one per core).
+ * Every band starts by setting both colors, so it does not depend on the one before it.
+ * The output is left in buffer as one chunk per band, which are described by iov (of IMAGE_DRAW_MAX_BANDS entries) in order.
+ * Returns the number of chunks.
+ **/
+int 
+image_t_draw
+   (  const image_t* const image
+   ,  char*         buffer
+   ,  int           x_pos
+   ,  int           y_pos
+   ,  int           threads
+   ,  struct iovec* iov
+   )
+{
+   pthread_once(&sgr_digits_once, sgr_digits_init);
+
+   const int cell_rows = (image->height + 1) / 2;
+   if(threads <= 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   int bands = min(threads, cell_rows);
+   bands = min(bands, (int) min((size_t) cell_rows * image->width / IMAGE_DRAW_MIN_CELLS, (size_t) IMAGE_DRAW_MAX_BANDS));
+   bands = max(bands, 1);
+
+   image_draw_job_t job = { image, buffer, x_pos, y_pos, bands, iov };
+   image_run_bands(image_t_draw_band_func, &job, bands, (size_t) bands * IMAGE_THREAD_MIN_PIXELS, bands);
+
+   return bands;
+}
+
+/**
+ * Differential drawing against the cells of the previous frame
+ **/
+
+//! Synchronized update (DEC mode 2026): the terminal holds off repainting between begin and end.
+#define DRAW_SYNC_BEGIN "\033[?2026h"
+#define DRAW_SYNC_END   "\033[?2026l"
+
+//! Magic at the start of a saved draw cache.
+#define DRAW_CACHE_MAGIC "TPNGDRW1"
+
+void
+draw_cache_t_init
+   (  draw_cache_t* const cache
+   )
+{
+   cache->width  = 0;
+   cache->height = 0;
+   cache->x_pos  = 0;
+   cache->y_pos  = 0;
+   cache->hash   = 0;
+   cache->cells  = NULL;
+}
+
+void
+draw_cache_t_destroy
+   (  draw_cache_t* const cache
+   )
+{
+   free(cache->cells);
+   draw_cache_t_init(cache);
+}
+
+/**
+ * Load a cache saved by draw_cache_t_save, so a separate run can diff against the frame it drew.
+ * Returns 1 on success. A missing or broken file leaves the cache empty, and the next frame is drawn in full.
+ **/
+int
+draw_cache_t_load
+   (  draw_cache_t* const cache
+   ,  const char*         path
+   )
+{
+   draw_cache_t_destroy(cache);
+
+   FILE* file = fopen(path, "rb");
+   if(!file)
+      return 0;
+
+   char    magic[8];
+   int32_t header[4];
+   int     ok = fread(magic, sizeof(magic), 1, file) == 1
+             && memcmp(magic, DRAW_CACHE_MAGIC, sizeof(magic)) == 0
+             && fread(header, sizeof(header), 1, file) == 1
+             && fread(&cache->hash, sizeof(cache->hash), 1, file) == 1
+             && header[0] > 0 && header[1] > 0 && header[0] <= INT_MAX / header[1];
+   if(ok)
+   {
+      const size_t cells = (size_t) header[0] * header[1];
+      cache->cells = (uint64_t*) malloc(cells * sizeof(uint64_t));
+      ok = cache->cells && fread(cache->cells, sizeof(uint64_t), cells, file) == cells;
+   }
+   fclose(file);
+
+   if(!ok)
+   {
+      draw_cache_t_destroy(cache);
+      return 0;
+   }
+   cache->width  = header[0];
+   cache->height = header[1];
+   cache->x_pos  = header[2];
+   cache->y_pos  = header[3];
+   return 1;
+}
+
+//! Save cache to path. Returns 1 on success.
+int
+draw_cache_t_save
+   (  const draw_cache_t* const cache
+   ,  const char*               path
+   )
+{
+   if(!cache->cells)
+      return 0;
+
+   FILE* file = fopen(path, "wb");
+   if(!file)
+      return 0;
+
+   const int32_t header[4] = { cache->width, cache->height, cache->x_pos, cache->y_pos };
+   const size_t  cells     = (size_t) cache->width * cache->height;
+   int ok = fwrite(DRAW_CACHE_MAGIC, 8, 1, file) == 1
+         && fwrite(header, sizeof(header), 1, file) == 1
+         && fwrite(&cache->hash, sizeof(cache->hash), 1, file) == 1
+         && fwrite(cache->cells, sizeof(uint64_t), cells, file) == cells;
+   return (fclose(file) == 0) && ok;
+}
+
+//! Mix 8 bytes into a running hash.
+static inline uint64_t
+hash_mix
+   (  uint64_t hash
+   ,  uint64_t value
+   )
+{
+   value *= 0x87c37b91114253d5ULL;
+   value  = (value << 31) | (value >> 33);
+   hash  ^= value * 0x4cf5ad432745937fULL;
+   return ((hash << 27) | (hash >> 37)) * 5 + 0x52dce729;
+}
+
+/**
+ * Fast 64 bit hash of the size, format, pixels and palette of an image, 8 bytes at a time.
+ * Not cryptographic, only used to tell whether a frame is the same as the one before it.
+ **/
+uint64_t
+image_t_hash
+   (  const image_t* const image
+   )
+{
+   uint64_t hash = hash_mix(0, ((uint64_t) image->width << 32) | (uint32_t) image->height);
+   hash = hash_mix(hash, image->format);
+
+   const unsigned char* data = (const unsigned char*) image->data;
+   const size_t         size = (size_t) image->width * image->height * pixel_format_size(image->format);
+   size_t   i;
+   uint64_t value;
+   for(i = 0; i + 8 <= size; i += 8)
+   {
+      memcpy(&value, data + i, 8);
+      hash = hash_mix(hash, value);
+   }
+   value = 0;
+   memcpy(&value, data + i, size - i);
+   hash = hash_mix(hash, value ^ size);
+
+   if(image->format == PIXEL_INDEX8)
+   {
+      for(i = 0; i < 256; i += 2)
+      {
+         memcpy(&value, &image->palette[i], 8);
+         hash = hash_mix(hash, value);
+      }
+   }
+
+   return hash;
+}
+
+//! Colors of the cells of cell row of an image of one pixel format, always inlined with constant channels/depth.
+static inline __attribute__((always_inline)) void
+image_t_cell_row_generic
+   (  const image_t* const image
+   ,  int       row
+   ,  uint64_t* cells
+   ,  const int channels
+   ,  const int depth
+   )
+{
+   const int            pixel_size = channels * depth;
+   const unsigned char* pixel_bg   = (const unsigned char*) image->data + (size_t) 2 * row * image->width * pixel_size;
+   const unsigned char* pixel_fg   = (2 * row + 1 < image->height) ? pixel_bg + (size_t) image->width * pixel_size : pixel_bg;
+   int col;
+   for(col = 0; col < image->width; ++col)
+   {
+      cells[col] = ((uint64_t) pixel_rgb(pixel_fg, channels, depth) << 32) | pixel_rgb(pixel_bg, channels, depth);
+      pixel_fg  += pixel_size;
+      pixel_bg  += pixel_size;
+   }
+}
+
+/**
+ * Colors of the cells of cell row of an image, packed as in draw_cache_t.
+ * As in image_t_draw, the last row of an odd height image fills whole cells.
+ **/
+static void
+image_t_cell_row
+   (  const image_t* const image
+   ,  int       row
+   ,  uint64_t* cells
+   )
+{
+   switch(image->format)
+   {
+      case PIXEL_GRAY8:
+         image_t_cell_row_generic(image, row, cells, 1, 1);
+         break;
+      case PIXEL_GRAY_ALPHA16:
+         image_t_cell_row_generic(image, row, cells, 2, 1);
+         break;
+      case PIXEL_RGB24:
+         image_t_cell_row_generic(image, row, cells, 3, 1);
+         break;
+      case PIXEL_RGBA32:
+         image_t_cell_row_generic(image, row, cells, 4, 1);
+         break;
+      case PIXEL_RGBA64:
+         image_t_cell_row_generic(image, row, cells, 4, 2);
+         break;
+      case PIXEL_INDEX8:
+      {
+         const unsigned char* index_bg = (const unsigned char*) image->data + (size_t) 2 * row * image->width;
+         const unsigned char* index_fg = (2 * row + 1 < image->height) ? index_bg + image->width : index_bg;
+         int col;
+         for(col = 0; col < image->width; ++col)
+         {
+            const uint32_t rgb_fg = pixel_rgb((const unsigned char*) &image->palette[index_fg[col]], 3, 1);
+            const uint32_t rgb_bg = pixel_rgb((const unsigned char*) &image->palette[index_bg[col]], 3, 1);
+            cells[col] = ((uint64_t) rgb_fg << 32) | rgb_bg;
+         }
+         break;
+      }
+   }
+}
+
+//! Worst case number of bytes image_t_draw_diff writes to its buffer for image, when every cell is a run of its own.
+size_t
+image_t_draw_diff_size
+   (  const image_t* const image
+   )
+{
+   const size_t cell_rows = (image->height + 1) / 2;
+   return sizeof(DRAW_SYNC_BEGIN) + DRAW_POS_MAX_SIZE                                        // Move up over the previous frame
+        + cell_rows * image->width * (DRAW_POS_MAX_SIZE + DRAW_SGR_MAX_SIZE + 3) + cell_rows // Cells and '\n'
+        + cell_rows * 7 + 3                                                                  // ESC[0m ESC[K after rows, and ESC[J
+        + 4 + sizeof(DRAW_SYNC_END) + 1;                                                     // ESC[0m, and the '\0' of the last snprintf
+}
+
+/**
+ * Draw image into buffer, which must hold at least image_t_draw_diff_size(image) bytes,
+ * writing only the runs of cells that changed since the frame in cache, which is then updated to this frame.
+ * At x_pos, y_pos (when both are set) runs are placed with cursor positioning sequences.
+ * Otherwise the frame is drawn at the cursor, as image_t_draw does, and left with the cursor on the line below it,
+ * from where the next frame moves back up. When the size changes, what is left of a wider or taller previous frame is erased.
+ * The frame is wrapped in a synchronized update, so the terminal repaints once.
+ * Returns the number of bytes written, 0 if the image is the same as the last one and nothing needs to be drawn.
+ **/
+size_t
+image_t_draw_diff
+   (  const image_t* const image
+   ,  draw_cache_t* const  cache
+   ,  char*                buffer
+   ,  int                  x_pos
+   ,  int                  y_pos
+   )
+{
+   pthread_once(&sgr_digits_once, sgr_digits_init);
+
+   const int      width      = image->width;
+   const int      height     = (image->height + 1) / 2;
+   const int      positioned = x_pos && y_pos;
+   const uint64_t hash       = image_t_hash(image);
+   const int      same_place = cache->cells && cache->width == width && cache->height == height
+                            && cache->x_pos == x_pos && cache->y_pos == y_pos;
+   if(same_place && cache->hash == hash)
+      return 0;
+
+   uint64_t* cells = (uint64_t*) malloc((size_t) width * height * sizeof(uint64_t));
+   if(!cells)
+      abort_("[draw] Could not allocate cells.");
+
+   char* buf = buffer;
+   memcpy(buf, DRAW_SYNC_BEGIN, sizeof(DRAW_SYNC_BEGIN) - 1);
+   buf += sizeof(DRAW_SYNC_BEGIN) - 1;
+
+   // Cursor, in cells from the top left of the frame. 
+   // Drawing at the cursor we are below the previous frame, positioned drawing starts out anywhere.
+   int cursor_row  = 0;
+   int cursor_col  = 0;
+   int clear_right = 0; // Erase the rest of each row, as the previous frame was wider
+   int clear_below = 0; // Erase the rows below the frame, as the previous frame was taller
+   if(positioned)
+   {
+      cursor_row = -1;
+   }
+   else if(cache->cells && !same_place)
+   {
+      // Size changed, move back up and draw over the previous frame
+      buf += snprintf(buf, DRAW_POS_MAX_SIZE, "\033[%dA\r", cache->height);
+      clear_right = cache->width  > width;
+      clear_below = cache->height > height;
+   }
+   else if(same_place)
+   {
+      cursor_row = height;
+   }
+
+   uint32_t color_fg = 0xFF000000; // Unknown, outside of any 0x00BBGGRR color
+   uint32_t color_bg = 0xFF000000;
+   int row, col;
+   for(row = 0; row < height; ++row)
+   {
+      uint64_t*       row_cells = cells + (size_t) row * width;
+      const uint64_t* old_cells = same_place ? cache->cells + (size_t) row * width : NULL;
+      image_t_cell_row(image, row, row_cells);
+      for(col = 0; col < width; ++col)
+      {
+         if(old_cells && old_cells[col] == row_cells[col])
+            continue;
+         
+         // Move to the start of the run
+         if(positioned)
+         {
+            if(row == cursor_row && col > cursor_col)
+               buf += snprintf(buf, DRAW_POS_MAX_SIZE, "\033[%dC", col - cursor_col);
+            else if(row != cursor_row || col != cursor_col)
+               buf += snprintf(buf, DRAW_POS_MAX_SIZE, "\033[%d;%dH", y_pos + row, x_pos + col);
+         }
+         else
+         {
+            if(row < cursor_row)
+            {
+               buf += snprintf(buf, DRAW_POS_MAX_SIZE, "\033[%dA", cursor_row - row);
+            }
+            for(; cursor_row < row; ++cursor_row)
+            {
+               *buf++ = '\n';
+               cursor_col = 0;
+            }
+            if(col > cursor_col)
+               buf += snprintf(buf, DRAW_POS_MAX_SIZE, "\033[%dC", col - cursor_col);
+         }
+         cursor_row = row;
+
+         const uint32_t rgb_fg = row_cells[col] >> 32;
+         const uint32_t rgb_bg = row_cells[col] & 0xFFFFFFFF;
+         const int      set_fg = color_fg != rgb_fg;
+         const int      set_bg = color_bg != rgb_bg;
+         if(set_fg || set_bg)
+         {
+            buf = sgr_write(buf, set_fg, rgb_fg, set_bg, rgb_bg);
+            color_fg = rgb_fg;
+            color_bg = rgb_bg;
+         }
+         /* Write U+2584 (solid block in lower half of cell) */
+         *buf++ = (char)0xe2;
+         *buf++ = (char)0x96;
+         *buf++ = (char)0x84;
+         cursor_col = col + 1;
+      }
+
+      if(clear_right)
+      {
+         // Every cell was drawn, so we are at the end of the row. Erase with the default background.
+         memcpy(buf, "\033[0m\033[K", 7);
+         buf += 7;
+         color_fg = 0xFF000000;
+         color_bg = 0xFF000000;
+      }
+   }
+
+   /* Reset char, before any newline can scroll in a colored line */
+   *buf++ = '\033'; *buf++ = '[';
+   *buf++ = '0';
+   *buf++ = 'm';
+
+   // Drawing at the cursor, leave it below the frame
+   if(!positioned)
+   {
+      for(; cursor_row < height; ++cursor_row)
+         *buf++ = '\n';
+      if(clear_below)
+      {
+         memcpy(buf, "\033[J", 3);
+         buf += 3;
+      }
+   }
+
+   memcpy(buf, DRAW_SYNC_END, sizeof(DRAW_SYNC_END) - 1);
+   buf += sizeof(DRAW_SYNC_END) - 1;
+
+   free(cache->cells);
+   cache->width  = width;
+   cache->height = height;
+   cache->x_pos  = x_pos;
+   cache->y_pos  = y_pos;
+   cache->hash   = hash;
+   cache->cells  = cells;
+
+   return buf - buffer;
 }
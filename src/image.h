@@ -3,8 +3,12 @@
 #define IMAGE_H_INCLUDED
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <png.h>
+#include <sys/uio.h>
+
+#include "input.h"
 
 typedef enum 
 {  ERROR
@@ -17,6 +21,15 @@ typedef enum
 ,  SCALE_FIRST
 ,  SCALE_LAST
 ,  SCALE_CENTER
+,  SCALE_AREA   // Exact area average, weighting source pixels by their fractional coverage of the output pixel.
+,  SCALE_BILINEAR
+,  SCALE_BICUBIC
+,  SCALE_LANCZOS3
+,  SCALE_SSAA_LINEAR // SSAA averaging in linear light instead of on sRGB values.
+,  SCALE_MAX         // Per channel maximum of each SSAA block.
+,  SCALE_MIN         // Per channel minimum of each SSAA block.
+,  SCALE_MEDIAN      // Per channel median of each SSAA block.
+,  SCALE_MODE        // Most frequent color of each SSAA block.
 } scale_t;
 
 typedef struct 
@@ -41,14 +54,52 @@ convert_color64_t_to_color32_t
    ,        color32_t* const color32
    );
 
+/**
+ * Pixel storage formats. 
+ * Images are kept in the most compact format that can represent the source PNG.
+ **/
+typedef enum
+{  PIXEL_GRAY8         //  8 bit gray.
+,  PIXEL_GRAY_ALPHA16  //  8 bit gray + 8 bit alpha.
+,  PIXEL_RGB24         //  8 bit r, g, b.
+,  PIXEL_RGBA32        //  8 bit r, g, b, a (color32_t).
+,  PIXEL_RGBA64        // 16 bit r, g, b, a (color64_t) in host byte order.
+,  PIXEL_INDEX8        //  8 bit index into image_t palette.
+} pixel_format_t;
+
+//! Size of one pixel in bytes.
+int 
+pixel_format_size
+   (  pixel_format_t format
+   );
+
+/**
+ * Ownership of image data.
+ **/
+typedef enum
+{  STORAGE_HEAP    // data is malloc'ed and owned by the image.
+,  STORAGE_MAPPED  // data points into a private (copy-on-write) file mapping owned by the image.
+,  STORAGE_BORROWED// data is owned by someone else (e.g. a shared-memory frame) and is read-only. Copied to the heap before any in-place change.
+} image_storage_t;
+
 typedef struct
 {
    int width, height;
-   png_byte   color_type;
-   png_byte   bit_depth;
-   void*      data;
+   png_byte       color_type; // Color type of the source PNG
+   png_byte       bit_depth;  // Bit depth of the source PNG
+   pixel_format_t format;     // Format of data
+   void*          data;
+   color32_t*     palette;    // 256 palette entries for PIXEL_INDEX8, otherwise NULL
+   image_storage_t storage;   // Who owns data
+   void*          map;        // Mapping to unmap for STORAGE_MAPPED
+   size_t         map_size;
 } image_t;
 
+void 
+image_t_init
+   (  image_t* image
+   );
+
 void 
 image_t_destroy
    (  image_t* image
@@ -60,6 +111,12 @@ image_t_swap
    ,  image_t* image2
    );
 
+void 
+image_t_copy
+   (  const image_t* const image
+   ,        image_t* const copy
+   );
+
 void 
 image_t_print
    (  const image_t* const image
@@ -67,10 +124,88 @@ image_t_print
 
 status_t 
 image_t_read_png
-   (  const char* const file_name
+   (  input_t* const input
    ,  image_t* image
    );
 
+//! Called with the partially decoded image after each pass of a progressive read.
+typedef void (*image_t_progress_t)
+   (  const image_t* const image
+   ,  int                  pass
+   ,  int                  number_of_passes
+   ,  void*                user
+   );
+
+status_t 
+image_t_read_png_progressive
+   (  input_t* const     input
+   ,  image_t* const     image
+   ,  image_t_progress_t progress
+   ,  void*              user
+   );
+
+status_t 
+image_t_read_png_scale
+   (  input_t* const    input
+   ,  image_t* const    scaled
+   ,  int               scaled_width
+   ,  int               scaled_height
+   ,  double            percent
+   ,  scale_t           scale
+   ,  int               threads
+   );
+
+status_t 
+image_t_read_png_scale_background
+   (  input_t* const    input
+   ,  image_t* const    scaled
+   ,  int               scaled_width
+   ,  int               scaled_height
+   ,  double            percent
+   ,  scale_t           scale
+   ,  int               threads
+   ,  int               r
+   ,  int               g
+   ,  int               b
+   );
+
+status_t 
+image_t_read_png_crop
+   (  input_t* const    input
+   ,  image_t* const    cropped
+   ,  int               x_crop_begin
+   ,  int               y_crop_begin
+   ,  int               x_crop_end
+   ,  int               y_crop_end
+   );
+
+/**
+ * Called for each tile of a tiled read, with rows [y, y + tile->height) of an image that is height rows high.
+ * The tile data is borrowed and only valid during the call. The tile itself (and its palette) is the callee's to destroy.
+ **/
+typedef void (*image_t_tile_t)
+   (  image_t* const tile
+   ,  int            y
+   ,  int            height
+   ,  void*          user
+   );
+
+status_t 
+image_t_read_png_tiles
+   (  input_t* const input
+   ,  size_t         max_tile_size
+   ,  image_t_tile_t tile
+   ,  void*          user
+   );
+
+void
+image_t_tiles
+   (  image_t* const image
+   ,  size_t         max_tile_size
+   ,  image_t_tile_t tile
+   ,  void*          user
+   );
+
 void 
 image_t_scale
    (  const image_t* const image
@@ -78,6 +213,60 @@ image_t_scale
    ,  int                  scaled_width
    ,  int                  scaled_height
    ,  scale_t              scale
+   ,  int                  threads
+   );
+
+void 
+image_t_scale_background
+   (  const image_t* const image
+   ,  image_t* const       scaled
+   ,  int                  scaled_width
+   ,  int                  scaled_height
+   ,  double               percent
+   ,  scale_t              scale
+   ,  int                  threads
+   ,  int                  r
+   ,  int                  g
+   ,  int                  b
+   );
+
+/**
+ * Streaming scaler, for images that are produced a row at a time (e.g. by a decoder) and never held in full.
+ * Rows are pushed top to bottom with image_scaler_t_push_row, and image_scaler_t_destroy finishes the scaled image.
+ **/
+typedef struct image_scaler_struct image_scaler_t;
+
+image_scaler_t*
+image_scaler_t_create
+   (  const image_t* const   header
+   ,  image_t* const         scaled
+   ,  int                    scaled_width
+   ,  int                    scaled_height
+   ,  double                 percent
+   ,  scale_t                scale
+   ,  const color32_t* const background
+   );
+
+void
+image_scaler_t_set_threads
+   (  image_scaler_t* const scaler
+   ,  int                   threads
+   );
+
+void
+image_scaler_t_push_row
+   (  image_scaler_t* const scaler
+   ,  const void*           data_row
+   );
+
+size_t
+image_scaler_t_memory
+   (  const image_scaler_t* const scaler
+   );
+
+void
+image_scaler_t_destroy
+   (  image_scaler_t* const scaler
    );
 
 void 
@@ -86,14 +275,128 @@ image_t_scale_percent
    ,  image_t* const       scaled
    ,  double               percent
    ,  scale_t              scale
+   ,  int                  threads
+   );
+
+void
+image_t_halve
+   (  const image_t* const image
+   ,  image_t* const       halved
+   ,  int                  threads
+   );
+
+/**
+ * Mip pyramid of successive 2x2 halvings of an image, built on demand.
+ * Callers rendering several sizes of one image can keep a pyramid and reuse its levels.
+ **/
+#define MIP_PYRAMID_MAX_LEVELS 16
+
+typedef struct
+{
+   const image_t* image;                          // Level 0, not owned
+   image_t        level[MIP_PYRAMID_MAX_LEVELS];  // Levels 1 and up
+   int            levels;                         // Number of levels built, not counting level 0
+   int            threads;
+}  mip_pyramid_t;
+
+void
+mip_pyramid_t_init
+   (  mip_pyramid_t* const pyramid
+   ,  const image_t* const image
+   ,  int                  threads
+   );
+
+void
+mip_pyramid_t_destroy
+   (  mip_pyramid_t* const pyramid
+   );
+
+const image_t*
+mip_pyramid_t_level
+   (  mip_pyramid_t* const pyramid
+   ,  int                  level
+   );
+
+void
+mip_pyramid_t_scale
+   (  mip_pyramid_t* const pyramid
+   ,  image_t* const       scaled
+   ,  int                  scaled_width
+   ,  int                  scaled_height
+   ,  scale_t              scale
+   );
+
+//! Most chunks image_t_draw splits its output into.
+#define IMAGE_DRAW_MAX_BANDS 64
+
+size_t
+image_t_draw_size
+   (  const image_t* const image
+   );
+
+int 
+image_t_draw
+   (  const image_t* const image
+   ,  char*         buffer
+   ,  int           x_pos
+   ,  int           y_pos
+   ,  int           threads
+   ,  struct iovec* iov
+   );
+
+/**
+ * Cell grid of the last frame drawn by image_t_draw_diff, which the next frame is compared against.
+ * Every cell is a U+2584 block, so a cell is just its colors.
+ **/
+typedef struct
+{
+   int       width;  // In cells
+   int       height; // In cells
+   int       x_pos;  // Where the frame was drawn, 0 if drawn at the cursor
+   int       y_pos;
+   uint64_t  hash;   // image_t_hash of the image the frame was drawn from
+   uint64_t* cells;  // Foreground 0x00BBGGRR in the high 32 bits and background in the low 32 bits, NULL if nothing was drawn
+}  draw_cache_t;
+
+void
+draw_cache_t_init
+   (  draw_cache_t* const cache
+   );
+
+void
+draw_cache_t_destroy
+   (  draw_cache_t* const cache
+   );
+
+int
+draw_cache_t_load
+   (  draw_cache_t* const cache
+   ,  const char*         path
+   );
+
+int
+draw_cache_t_save
+   (  const draw_cache_t* const cache
+   ,  const char*               path
+   );
+
+uint64_t
+image_t_hash
+   (  const image_t* const image
+   );
+
+size_t
+image_t_draw_diff_size
+   (  const image_t* const image
    );
 
-void image_t_draw
+size_t
+image_t_draw_diff
    (  const image_t* const image
-   ,  char* buffer
-   ,  int   x_pos
-   ,  int   y_pos
-   ,  FILE* file
+   ,  draw_cache_t* const  cache
+   ,  char*                buffer
+   ,  int                  x_pos
+   ,  int                  y_pos
    );
 
 void 
@@ -0,0 +1,206 @@
+#include "input.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+
+int 
+input_t_open
+   (  input_t* const    input
+   ,  const char* const path
+   )
+{
+   input->name        = path;
+   input->map         = NULL;
+   input->map_size    = 0;
+   input->buffer      = NULL;
+   input->buffer_size = 0;
+   input->begin       = 0;
+   input->end         = 0;
+
+   if(strcmp(path, "-") == 0)
+   {
+      input->fd = STDIN_FILENO;
+   }
+   else
+   {
+      input->fd = open(path, O_RDONLY);
+      if(input->fd < 0)
+         return 0;
+   }
+   
+   // Map regular files (this also covers stdin redirected from a file), otherwise fall back to buffered reads
+   struct stat st;
+   if(fstat(input->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+   {
+      off_t offset = lseek(input->fd, 0, SEEK_CUR);
+      void* map    = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, input->fd, 0);
+      if(map != MAP_FAILED)
+      {
+         madvise(map, st.st_size, MADV_SEQUENTIAL);
+         input->map      = (unsigned char*) map;
+         input->map_size = st.st_size;
+         input->begin    = offset > 0 ? offset : 0;
+         input->end      = st.st_size;
+         return 1;
+      }
+   }
+
+   input->buffer_size = INPUT_BUFFER_SIZE;
+   input->buffer      = (unsigned char*) malloc(input->buffer_size);
+
+   return 1;
+}
+
+void 
+input_t_close
+   (  input_t* const input
+   )
+{
+   if(input->map)
+      munmap(input->map, input->map_size);
+   if(input->buffer)
+      free(input->buffer);
+   if(input->fd != STDIN_FILENO && input->fd >= 0)
+      close(input->fd);
+   input->map    = NULL;
+   input->buffer = NULL;
+   input->fd     = -1;
+}
+
+//! read(2) wrapper that retries on EINTR. Returns bytes read, 0 on end of input or error.
+static size_t 
+input_t_read_fd
+   (  input_t* const input
+   ,  void*          dst
+   ,  size_t         size
+   )
+{
+   ssize_t nread;
+   do
+   {
+      nread = read(input->fd, dst, size);
+   } while(nread < 0 && errno == EINTR);
+
+   return nread > 0 ? (size_t) nread : 0;
+}
+
+size_t 
+input_t_read
+   (  input_t* const input
+   ,  void*          dst
+   ,  size_t         size
+   )
+{
+   unsigned char* out = (unsigned char*) dst;
+   size_t total = 0;
+
+   while(total < size)
+   {
+      // Copy what is available in the map/buffer
+      size_t available = input->end - input->begin;
+      if(available)
+      {
+         size_t n = min(available, size - total);
+         memcpy(out + total, (input->map ? input->map : input->buffer) + input->begin, n);
+         input->begin += n;
+         total        += n;
+         continue;
+      }
+
+      if(input->map || !input->buffer)
+         break;
+
+      // Large requests bypass the buffer, small ones refill it
+      size_t nread;
+      if(size - total >= input->buffer_size)
+      {
+         nread = input_t_read_fd(input, out + total, size - total);
+         total += nread;
+      }
+      else
+      {
+         nread = input_t_read_fd(input, input->buffer, input->buffer_size);
+         input->begin = 0;
+         input->end   = nread;
+      }
+
+      if(!nread)
+         break;
+   }
+
+   return total;
+}
+
+const unsigned char* 
+input_t_peek
+   (  input_t* const input
+   ,  size_t         size
+   )
+{
+   if(input->map)
+   {
+      return (input->end - input->begin >= size) ? input->map + input->begin : NULL;
+   }
+
+   if(size > input->buffer_size)
+      return NULL;
+
+   // Move what is left to the front of the buffer and fill up behind it
+   if(input->end - input->begin < size)
+   {
+      memmove(input->buffer, input->buffer + input->begin, input->end - input->begin);
+      input->end  -= input->begin;
+      input->begin = 0;
+      while(input->end < size)
+      {
+         size_t nread = input_t_read_fd(input, input->buffer + input->end, input->buffer_size - input->end);
+         if(!nread)
+            return NULL;
+         input->end += nread;
+      }
+   }
+
+   return input->buffer + input->begin;
+}
+
+void* 
+input_t_take_map
+   (  input_t* const input
+   ,  size_t*        size
+   )
+{
+   void* map = input->map;
+   *size = input->map_size;
+   
+   // Mark everything as consumed, so the input reads as empty from here on
+   input->map      = NULL;
+   input->map_size = 0;
+   input->begin    = 0;
+   input->end      = 0;
+
+   return map;
+}
+
+void 
+input_t_release
+   (  input_t* const input
+   )
+{
+   if(!input->map)
+      return;
+
+   // Only whole pages before the read position can go
+   const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+   const size_t consumed  = input->begin - input->begin % page_size;
+   if(consumed)
+      madvise(input->map, consumed, MADV_DONTNEED);
+}
@@ -0,0 +1,72 @@
+#pragma once
+#ifndef INPUT_H_INCLUDED
+#define INPUT_H_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * Byte input source.
+ * Regular files are memory-mapped and read directly from the mapped pages.
+ * Everything else (e.g. stdin or pipes) is read with read(2) through a large buffer.
+ **/
+typedef struct
+{
+   const char*    name;
+   int            fd;
+   unsigned char* map;         // Mapped file, or NULL if input is buffered.
+   size_t         map_size;
+   unsigned char* buffer;      // Read buffer for non-mappable input.
+   size_t         buffer_size;
+   size_t         begin;       // Current position in map/buffer.
+   size_t         end;         // End of valid data in map/buffer.
+}  input_t;
+
+//! Open input. The path "-" means stdin. Returns 1 on success, 0 on failure.
+int 
+input_t_open
+   (  input_t* const    input
+   ,  const char* const path
+   );
+
+//! Close input, unmapping and freeing any storage.
+void 
+input_t_close
+   (  input_t* const input
+   );
+
+//! Read up to size bytes into dst. Returns the number of bytes read, which is only less than size at end of input.
+size_t 
+input_t_read
+   (  input_t* const input
+   ,  void*          dst
+   ,  size_t         size
+   );
+
+//! Look at the next size bytes without consuming them. Returns NULL if fewer than size bytes are left.
+const unsigned char* 
+input_t_peek
+   (  input_t* const input
+   ,  size_t         size
+   );
+
+/**
+ * Take ownership of the file mapping, if input is mapped (otherwise returns NULL).
+ * The mapping is private and writable (copy-on-write), and must be released with munmap(map, *size).
+ * Pointers into the mapping are obtained with input_t_peek before taking it.
+ **/
+void* 
+input_t_take_map
+   (  input_t* const input
+   ,  size_t*        size
+   );
+
+/**
+ * Drop the already consumed pages of a mapped input from memory, so long sequential reads do not keep the whole file resident.
+ * Consumed data must not be accessed afterwards. Does nothing for buffered input.
+ **/
+void 
+input_t_release
+   (  input_t* const input
+   );
+
+#endif /* INPUT_H_INCLUDED */
@@ -0,0 +1,138 @@
+#include "shm_ring.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+#include "util.h"
+
+int 
+shm_ring_t_attach
+   (  shm_ring_t* const ring
+   ,  const char* const name
+   )
+{
+   ring->name          = name;
+   ring->header        = NULL;
+   ring->size          = 0;
+   ring->last_sequence = 0;
+
+   int fd = shm_open(name, O_RDONLY, 0);
+   if(fd < 0)
+      return 0;
+
+   struct stat st;
+   if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(shm_ring_header_t))
+   {
+      close(fd);
+      return 0;
+   }
+   
+   // The mapping stays valid after the descriptor is closed
+   void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(map == MAP_FAILED)
+      return 0;
+
+   ring->header = (const shm_ring_header_t*) map;
+   ring->size   = st.st_size;
+
+   // Read the header once, the producer could be changing it while we look
+   const shm_ring_header_t* header = ring->header;
+   const uint32_t magic       = __atomic_load_n(&header->magic,       __ATOMIC_RELAXED);
+   const uint32_t version     = __atomic_load_n(&header->version,     __ATOMIC_RELAXED);
+   const uint32_t width       = __atomic_load_n(&header->width,       __ATOMIC_RELAXED);
+   const uint32_t height      = __atomic_load_n(&header->height,      __ATOMIC_RELAXED);
+   const uint32_t format      = __atomic_load_n(&header->format,      __ATOMIC_RELAXED);
+   const uint32_t slot_count  = __atomic_load_n(&header->slot_count,  __ATOMIC_RELAXED);
+   const uint64_t slot_size   = __atomic_load_n(&header->slot_size,   __ATOMIC_RELAXED);
+   const uint64_t data_offset = __atomic_load_n(&header->data_offset, __ATOMIC_RELAXED);
+
+   // Validate header, without any products that could overflow
+   if(  magic != SHM_RING_MAGIC 
+     || version != SHM_RING_VERSION
+     || slot_count == 0 
+     || slot_count > SHM_RING_MAX_SLOTS
+     || format > PIXEL_RGBA64
+     || width == 0 || width > INT_MAX
+     || height == 0 || height > INT_MAX
+     || (uint64_t) width * height > slot_size / pixel_format_size(format)
+     || data_offset < sizeof(shm_ring_header_t)
+     || data_offset > ring->size
+     || slot_size > (ring->size - data_offset) / slot_count
+     )
+   {
+      shm_ring_t_detach(ring);
+      return 0;
+   }
+
+   ring->width      = width;
+   ring->height     = height;
+   ring->format     = (pixel_format_t) format;
+   ring->slot_count = slot_count;
+   ring->slot_size  = slot_size;
+   ring->slots      = (const unsigned char*) header + data_offset;
+
+   return 1;
+}
+
+void 
+shm_ring_t_detach
+   (  shm_ring_t* const ring
+   )
+{
+   if(ring->header)
+      munmap((void*) ring->header, ring->size);
+   ring->header = NULL;
+   ring->size   = 0;
+}
+
+uint64_t 
+shm_ring_t_borrow_newest
+   (  shm_ring_t* const ring
+   ,  image_t* const    frame
+   )
+{
+   const shm_ring_header_t* header = ring->header;
+   
+   uint64_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+   if(sequence == ring->last_sequence)
+      return 0;
+
+   // If the producer has already started overwriting the newest frame, it is far ahead of us, and we just try again later
+   const uint32_t slot = sequence % ring->slot_count;
+   if(__atomic_load_n(&header->slot_sequence[slot], __ATOMIC_ACQUIRE) != sequence)
+      return 0;
+   
+   image_t_init(frame);
+   frame->width   = ring->width;
+   frame->height  = ring->height;
+   frame->format  = ring->format;
+   frame->data    = (void*) (ring->slots + slot * ring->slot_size);
+   frame->storage = STORAGE_BORROWED;
+
+   ring->last_sequence = sequence;
+
+   return sequence;
+}
+
+int 
+shm_ring_t_valid
+   (  const shm_ring_t* const ring
+   ,  uint64_t                sequence
+   )
+{
+   // Make sure all our reads of the pixels happen before re-checking the slot
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   return __atomic_load_n(&ring->header->slot_sequence[sequence % ring->slot_count], __ATOMIC_RELAXED) == sequence;
+}
+
+int 
+shm_ring_t_closed
+   (  const shm_ring_t* const ring
+   )
+{
+   return __atomic_load_n(&ring->header->closed, __ATOMIC_ACQUIRE);
+}
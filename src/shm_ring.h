@@ -0,0 +1,99 @@
+#pragma once
+#ifndef SHM_RING_H_INCLUDED
+#define SHM_RING_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image.h"
+
+/**
+ * Shared-memory frame ring, for displaying live frames published by another process.
+ *
+ * The producer creates a POSIX shared-memory object (shm_open) laid out as a shm_ring_header_t, 
+ * followed by slot_count frame slots of slot_size bytes each, starting at data_offset.
+ * Frame number n (starting from 1) is written to slot n % slot_count as tightly packed rows of the given pixel_format_t.
+ *
+ * To publish frame n the producer:
+ *    1. stores 0 in slot_sequence[n % slot_count],
+ *    2. writes the pixels,
+ *    3. stores n in slot_sequence[n % slot_count] (release),
+ *    4. stores n in sequence (release).
+ * Readers use the slot_sequence as a seqlock: a frame is only valid while its slot_sequence still holds its number.
+ **/
+#define SHM_RING_MAGIC     0x474E5054u // "TPNG"
+#define SHM_RING_VERSION   1
+#define SHM_RING_MAX_SLOTS 16
+
+typedef struct
+{
+   uint32_t magic;                              // SHM_RING_MAGIC
+   uint32_t version;                            // SHM_RING_VERSION
+   uint32_t width;
+   uint32_t height;
+   uint32_t format;                             // pixel_format_t of frames (not PIXEL_INDEX8)
+   uint32_t slot_count;                         // Number of slots, at most SHM_RING_MAX_SLOTS
+   uint64_t slot_size;                          // Bytes per slot, at least width * height * pixel size
+   uint64_t data_offset;                        // Offset of first slot from start of shared memory
+   uint64_t sequence;                           // Number of newest complete frame, 0 if none yet
+   uint64_t slot_sequence[SHM_RING_MAX_SLOTS];  // Number of frame in each slot, 0 while being written
+   uint32_t closed;                             // Set by producer when no more frames will come
+}  shm_ring_header_t;
+
+/**
+ * Reader side of a shared-memory frame ring.
+ **/
+typedef struct
+{
+   const char*              name;
+   const shm_ring_header_t* header;
+   size_t                   size;
+   uint64_t                 last_sequence; // Newest frame handed out so far
+   // Frame geometry, copied out of the header and validated on attach, as the producer could change the header afterwards
+   int                      width;
+   int                      height;
+   pixel_format_t           format;
+   uint32_t                 slot_count;
+   uint64_t                 slot_size;
+   const unsigned char*     slots;         // First slot
+}  shm_ring_t;
+
+//! Attach read-only to shared-memory ring name (as given to shm_open). Returns 1 on success, 0 on failure.
+int 
+shm_ring_t_attach
+   (  shm_ring_t* const ring
+   ,  const char* const name
+   );
+
+//! Detach from ring.
+void 
+shm_ring_t_detach
+   (  shm_ring_t* const ring
+   );
+
+/**
+ * Borrow the newest complete frame, if it is newer than the last one borrowed.
+ * frame is set to point straight into the shared memory (STORAGE_BORROWED), so no pixels are copied.
+ * Returns the frame number, or 0 if there is no new frame.
+ * The producer may overwrite the slot at any time, so check shm_ring_t_valid after reading the pixels.
+ **/
+uint64_t 
+shm_ring_t_borrow_newest
+   (  shm_ring_t* const ring
+   ,  image_t* const    frame
+   );
+
+//! Check that frame number sequence has not been overwritten since it was borrowed.
+int 
+shm_ring_t_valid
+   (  const shm_ring_t* const ring
+   ,  uint64_t                sequence
+   );
+
+//! Check if the producer has closed the ring.
+int 
+shm_ring_t_closed
+   (  const shm_ring_t* const ring
+   );
+
+#endif /* SHM_RING_H_INCLUDED */
@@ -0,0 +1,703 @@
+#include "ssaa.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include <pthread.h>
+
+/**
+ * Fixed-point reciprocal of n, such that ceil(x / n) == ((x + n - 1) * m) >> s for all 0 <= x <= 255 * n.
+ * With s = 8 + 2 * ceil(log2(n)) we have 2^s >= 256 * n^2 > (x + n - 1) * n, which makes m = ceil(2^s / n) exact,
+ * and for n <= SSAA_KERNEL_MAX_AREA both m and x + n - 1 fit in 32 bits.
+ **/
+typedef struct
+{
+   uint32_t m;
+   uint32_t s;
+   uint32_t bias; // n - 1
+}  ssaa_reciprocal_t;
+
+static ssaa_reciprocal_t
+ssaa_reciprocal
+   (  uint32_t n
+   )
+{
+   ssaa_reciprocal_t reciprocal;
+   uint32_t log2n = 0;
+   while((1u << log2n) < n)
+      ++log2n;
+   reciprocal.s    = 8 + 2 * log2n;
+   reciprocal.m    = (uint32_t) (((1ull << reciprocal.s) + n - 1) / n);
+   reciprocal.bias = n - 1;
+   return reciprocal;
+}
+
+//! Load one pixel of 1 to 4 8 bit channels into the low bytes of an int.
+static inline __attribute__((always_inline)) int
+ssaa_load_pixel
+   (  const unsigned char* data
+   ,  const int            channels
+   )
+{
+   // Three bytes are put together in registers, as a 3 byte memcpy into an int stalls on store forwarding
+   if(channels == 3)
+      return data[0] | (data[1] << 8) | (data[2] << 16);
+   uint32_t pixel = 0;
+   memcpy(&pixel, data, channels);
+   return (int) pixel;
+}
+
+/**
+ * Store premultiplied sums of pixels with alpha. The divisor is the alpha sum of each block,
+ * so this is done in scalar code shared by the kernels.
+ **/
+static inline __attribute__((always_inline)) void
+ssaa_store_row_premultiplied_generic
+   (  unsigned char*       scale_data_row
+   ,  const ssaa_sum32_t*  sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  y_block_size
+   ,  const int            channels
+   ,  const int*           background
+   )
+{
+   int x_scaled, c;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      const uint64_t n     = (uint64_t) (x_block_size_min + (x_scaled < x_block_rest ? 1 : 0)) * y_block_size;
+      const uint64_t alpha = sum[x_scaled][channels - 1];
+      for(c = 0; c < channels - 1; ++c)
+      {
+         if(background)
+            scale_data_row[c] = (sum[x_scaled][c] + background[c] * (255 * n - alpha) + 255 * n - 1) / (255 * n);
+         else
+            scale_data_row[c] = alpha ? (sum[x_scaled][c] + alpha - 1) / alpha : 0;
+      }
+      scale_data_row[channels - 1] = (alpha + n - 1) / n;
+      scale_data_row += channels;
+   }
+}
+
+static void
+ssaa_store_row_premultiplied
+   (  unsigned char*       scale_data_row
+   ,  const ssaa_sum32_t*  sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  y_block_size
+   ,  int                  channels
+   ,  const int*           background
+   )
+{
+   if(channels == 2)
+      ssaa_store_row_premultiplied_generic(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, 2, background);
+   else
+      ssaa_store_row_premultiplied_generic(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, 4, background);
+}
+
+/**
+ * SSE4.1 kernel.
+ **/
+
+/**
+ * Multiply the colors of a gray+alpha or rgba pixel, widened to 32 bit lanes, by its alpha, leaving alpha itself.
+ * The multiplier lanes are alpha (1 for alpha), gathered with a byte shuffle, and pmaddwd gives the exact 32 bit products.
+ **/
+static inline __attribute__((always_inline, target("sse4.1"))) __m128i
+ssaa_premultiply_sse41
+   (  __m128i   v
+   ,  const int channels
+   )
+{
+   const __m128i alpha = (channels == 4)
+      ? _mm_or_si128(_mm_shuffle_epi8(v, _mm_setr_epi8(12, -1, -1, -1, 12, -1, -1, -1, 12, -1, -1, -1, -1, -1, -1, -1)), _mm_setr_epi32(0, 0, 0, 1))
+      : _mm_or_si128(_mm_shuffle_epi8(v, _mm_setr_epi8( 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)), _mm_setr_epi32(0, 1, 0, 0));
+   return _mm_madd_epi16(v, alpha);
+}
+
+static inline __attribute__((always_inline, target("sse4.1"))) void
+ssaa_accumulate_row_sse41_generic
+   (  const unsigned char* data_row
+   ,  ssaa_sum32_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  const int            channels
+   ,  const color32_t*     palette
+   )
+{
+   int x_scaled, x_block;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      const int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+      __m128i acc = _mm_loadu_si128((const __m128i*) sum[x_scaled]);
+      for(x_block = 0; x_block < x_block_size; ++x_block)
+      {
+         const int pixel = palette ? ssaa_load_pixel((const unsigned char*) &palette[*data_row], 4) : ssaa_load_pixel(data_row, channels);
+         if(channels == 2 || channels == 4)
+            acc = _mm_add_epi32(acc, ssaa_premultiply_sse41(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel)), channels));
+         else
+            acc = _mm_add_epi32(acc, _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel)));
+         data_row += palette ? 1 : channels;
+      }
+      _mm_storeu_si128((__m128i*) sum[x_scaled], acc);
+   }
+}
+
+static __attribute__((target("sse4.1"))) void
+ssaa_accumulate_row_sse41
+   (  const unsigned char* data_row
+   ,  ssaa_sum32_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  channels
+   ,  const color32_t*     palette
+   )
+{
+   if(palette)
+   {
+      ssaa_accumulate_row_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, palette);
+      return;
+   }
+
+   switch(channels)
+   {
+      case 1: ssaa_accumulate_row_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 1, NULL); break;
+      case 2: ssaa_accumulate_row_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 2, NULL); break;
+      case 3: ssaa_accumulate_row_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 3, NULL); break;
+      case 4: ssaa_accumulate_row_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, NULL); break;
+   }
+}
+
+//! Divide the four sums in v by the reciprocal, giving four results in the low byte of each 32 bit lane.
+static inline __attribute__((always_inline, target("sse4.1"))) __m128i
+ssaa_divide_sse41
+   (  __m128i                         v
+   ,  const ssaa_reciprocal_t* const  reciprocal
+   )
+{
+   const __m128i m     = _mm_set1_epi32(reciprocal->m);
+   const __m128i shift = _mm_cvtsi32_si128(reciprocal->s);
+   v = _mm_add_epi32(v, _mm_set1_epi32(reciprocal->bias));
+   __m128i even = _mm_srl_epi64(_mm_mul_epu32(v, m), shift);
+   __m128i odd  = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(v, 32), m), shift);
+   return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+//! Pack four 32 bit lanes holding values 0-255 into bytes, and store the first channels of them.
+static inline __attribute__((always_inline, target("sse4.1"))) void
+ssaa_store_pixel_sse41
+   (  unsigned char* scale_data
+   ,  __m128i        v
+   ,  const int      channels
+   )
+{
+   v = _mm_packus_epi32(v, v);
+   v = _mm_packus_epi16(v, v);
+   const uint32_t pixel = (uint32_t) _mm_cvtsi128_si32(v);
+   memcpy(scale_data, &pixel, channels);
+}
+
+static inline __attribute__((always_inline, target("sse4.1"))) void
+ssaa_store_row_sse41_generic
+   (  unsigned char*       scale_data_row
+   ,  const ssaa_sum32_t*  sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  y_block_size
+   ,  const int            channels
+   )
+{
+   const ssaa_reciprocal_t reciprocal[2] = 
+   {  ssaa_reciprocal(x_block_size_min * y_block_size)
+   ,  ssaa_reciprocal((x_block_size_min + 1) * y_block_size)
+   };
+
+   int x_scaled;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      const __m128i v = ssaa_divide_sse41(_mm_loadu_si128((const __m128i*) sum[x_scaled]), &reciprocal[x_scaled < x_block_rest]);
+      ssaa_store_pixel_sse41(scale_data_row, v, channels);
+      scale_data_row += channels;
+   }
+}
+
+static __attribute__((target("sse4.1"))) void
+ssaa_store_row_sse41
+   (  unsigned char*       scale_data_row
+   ,  const ssaa_sum32_t*  sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  y_block_size
+   ,  int                  channels
+   ,  const int*           background
+   )
+{
+   if(channels == 2 || channels == 4)
+   {
+      ssaa_store_row_premultiplied(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, channels, background);
+      return;
+   }
+
+   switch(channels)
+   {
+      case 1: ssaa_store_row_sse41_generic(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, 1); break;
+      case 3: ssaa_store_row_sse41_generic(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, 3); break;
+   }
+}
+
+/**
+ * Linear light without AVX-512. The lookups are scalar, so the sums of a block row are kept in general purpose registers,
+ * two 32 bit channels in each 64 bit register (products of a 16 bit linear value and 8 bit alpha do not carry between them).
+ **/
+static inline __attribute__((always_inline, target("sse4.1"))) void
+ssaa_accumulate_row_linear_sse41_generic
+   (  const unsigned char* data_row
+   ,  ssaa_sum64_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  const int            channels
+   ,  const color32_t*     palette
+   ,  const uint16_t*      srgb_to_linear
+   )
+{
+   const __m128i scale = _mm_set1_epi64x((channels == 2 || channels == 4) ? 257 : 1);
+   int x_scaled, x_block;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      // Sum the block row in registers, as data_row may alias sum
+      const int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+      uint64_t acc_lo = 0, acc_hi = 0;
+      for(x_block = 0; x_block < x_block_size; ++x_block)
+      {
+         const unsigned char* pixel = palette ? (const unsigned char*) &palette[*data_row] : data_row;
+         switch(channels)
+         {
+            case 1:
+               acc_lo += srgb_to_linear[pixel[0]];
+               break;
+            case 2:
+               acc_lo += (srgb_to_linear[pixel[0]] | ((uint64_t) 1 << 32)) * pixel[1];
+               break;
+            case 3:
+               acc_lo += srgb_to_linear[pixel[0]] | ((uint64_t) srgb_to_linear[pixel[1]] << 32);
+               acc_hi += srgb_to_linear[pixel[2]];
+               break;
+            default:
+               acc_lo += (srgb_to_linear[pixel[0]] | ((uint64_t) srgb_to_linear[pixel[1]] << 32)) * pixel[3];
+               acc_hi += (srgb_to_linear[pixel[2]] | ((uint64_t) 1 << 32)) * pixel[3];
+               break;
+         }
+         data_row += palette ? 1 : channels;
+      }
+      const __m128i acc = _mm_set_epi64x(acc_hi, acc_lo);
+      
+      // Widen to 64 bits and add to the sums
+      __m128i* sum_lo = (__m128i*) &sum[x_scaled][0];
+      __m128i* sum_hi = (__m128i*) &sum[x_scaled][2];
+      _mm_storeu_si128(sum_lo, _mm_add_epi64(_mm_loadu_si128(sum_lo), _mm_mul_epu32(_mm_cvtepu32_epi64(acc), scale)));
+      _mm_storeu_si128(sum_hi, _mm_add_epi64(_mm_loadu_si128(sum_hi), _mm_mul_epu32(_mm_cvtepu32_epi64(_mm_srli_si128(acc, 8)), scale)));
+      sum[x_scaled][4] += x_block_size;
+   }
+}
+
+/**
+ * Index8 rows in linear light, through the premultiplied linear colors of the 256 palette entries.
+ * Looking up the palette once per row pays off for rows of more than a few hundred pixels, shorter rows look up each pixel.
+ **/
+static inline __attribute__((always_inline, target("sse4.1"))) void
+ssaa_accumulate_row_linear_palette_sse41
+   (  const unsigned char* data_row
+   ,  ssaa_sum64_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  const color32_t*     palette
+   ,  const uint16_t*      srgb_to_linear
+   )
+{
+   __m128i color[256];
+   const __m128i one   = _mm_setr_epi32(0, 0, 0, 1);
+   const __m128i scale = _mm_set1_epi64x(257);
+   int i, x_scaled, x_block;
+   for(i = 0; i < 256; ++i)
+   {
+      const unsigned char* entry = (const unsigned char*) &palette[i];
+      color[i] = _mm_mullo_epi32
+         (  _mm_or_si128(_mm_setr_epi32(srgb_to_linear[entry[0]], srgb_to_linear[entry[1]], srgb_to_linear[entry[2]], 0), one)
+         ,  _mm_set1_epi32(entry[3])
+         );
+   }
+   
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      const int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+      __m128i acc = _mm_setzero_si128();
+      for(x_block = 0; x_block < x_block_size; ++x_block)
+      {
+         acc = _mm_add_epi32(acc, color[*data_row]);
+         ++data_row;
+      }
+      
+      __m128i* sum_lo = (__m128i*) &sum[x_scaled][0];
+      __m128i* sum_hi = (__m128i*) &sum[x_scaled][2];
+      _mm_storeu_si128(sum_lo, _mm_add_epi64(_mm_loadu_si128(sum_lo), _mm_mul_epu32(_mm_cvtepu32_epi64(acc), scale)));
+      _mm_storeu_si128(sum_hi, _mm_add_epi64(_mm_loadu_si128(sum_hi), _mm_mul_epu32(_mm_cvtepu32_epi64(_mm_srli_si128(acc, 8)), scale)));
+      sum[x_scaled][4] += x_block_size;
+   }
+}
+
+static __attribute__((target("sse4.1"))) void
+ssaa_accumulate_row_linear_sse41
+   (  const unsigned char* data_row
+   ,  ssaa_sum64_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  channels
+   ,  const color32_t*     palette
+   ,  const uint16_t*      srgb_to_linear
+   )
+{
+   if(palette && scaled_width * x_block_size_min + x_block_rest >= 512)
+   {
+      ssaa_accumulate_row_linear_palette_sse41(data_row, sum, scaled_width, x_block_size_min, x_block_rest, palette, srgb_to_linear);
+      return;
+   }
+   else if(palette)
+   {
+      ssaa_accumulate_row_linear_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, palette, srgb_to_linear);
+      return;
+   }
+
+   switch(channels)
+   {
+      case 1: ssaa_accumulate_row_linear_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 1, NULL, srgb_to_linear); break;
+      case 2: ssaa_accumulate_row_linear_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 2, NULL, srgb_to_linear); break;
+      case 3: ssaa_accumulate_row_linear_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 3, NULL, srgb_to_linear); break;
+      case 4: ssaa_accumulate_row_linear_sse41_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, NULL, srgb_to_linear); break;
+   }
+}
+
+static const ssaa_kernel_t ssaa_kernel_sse41 = { "sse4.1", ssaa_accumulate_row_sse41, ssaa_store_row_sse41, ssaa_accumulate_row_linear_sse41 };
+
+/**
+ * AVX2 kernel. Rgba32 rows are premultiplied and accumulated two pixels at a time, and opaque pixels are stored in pairs. 
+ * Other formats, and linear light, use the SSE4.1 accumulation.
+ **/
+//! ssaa_premultiply_sse41 of two rgba pixels, one in each 128 bit lane.
+static inline __attribute__((always_inline, target("avx2"))) __m256i
+ssaa_premultiply_avx2
+   (  __m256i v
+   )
+{
+   const __m256i alpha = _mm256_or_si256
+      (  _mm256_shuffle_epi8(v, _mm256_setr_epi8(12, -1, -1, -1, 12, -1, -1, -1, 12, -1, -1, -1, -1, -1, -1, -1, 12, -1, -1, -1, 12, -1, -1, -1, 12, -1, -1, -1, -1, -1, -1, -1))
+      ,  _mm256_setr_epi32(0, 0, 0, 1, 0, 0, 0, 1)
+      );
+   return _mm256_madd_epi16(v, alpha);
+}
+
+static __attribute__((target("avx2"))) void
+ssaa_accumulate_row_avx2
+   (  const unsigned char* data_row
+   ,  ssaa_sum32_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  channels
+   ,  const color32_t*     palette
+   )
+{
+   if(palette || channels != 4)
+   {
+      ssaa_accumulate_row_sse41(data_row, sum, scaled_width, x_block_size_min, x_block_rest, channels, palette);
+      return;
+   }
+
+   int x_scaled, x_block;
+   for(x_scaled = 0; x_scaled < scaled_width; ++x_scaled)
+   {
+      const int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+      __m256i acc2 = _mm256_setzero_si256();
+      for(x_block = 0; x_block + 1 < x_block_size; x_block += 2)
+      {
+         acc2 = _mm256_add_epi32(acc2, ssaa_premultiply_avx2(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) data_row))));
+         data_row += 8;
+      }
+      __m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc2), _mm256_extracti128_si256(acc2, 1));
+      if(x_block < x_block_size)
+      {
+         acc = _mm_add_epi32(acc, ssaa_premultiply_sse41(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(ssaa_load_pixel(data_row, 4))), 4));
+         data_row += 4;
+      }
+      _mm_storeu_si128((__m128i*) sum[x_scaled], _mm_add_epi32(_mm_loadu_si128((const __m128i*) sum[x_scaled]), acc));
+   }
+}
+
+static inline __attribute__((always_inline, target("avx2"))) void
+ssaa_store_row_avx2_generic
+   (  unsigned char*       scale_data_row
+   ,  const ssaa_sum32_t*  sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  y_block_size
+   ,  const int            channels
+   )
+{
+   const ssaa_reciprocal_t reciprocal[2] = 
+   {  ssaa_reciprocal(x_block_size_min * y_block_size)
+   ,  ssaa_reciprocal((x_block_size_min + 1) * y_block_size)
+   };
+   
+   int x_scaled;
+   for(x_scaled = 0; x_scaled + 1 < scaled_width; x_scaled += 2)
+   {
+      const ssaa_reciprocal_t* r0 = &reciprocal[x_scaled     < x_block_rest];
+      const ssaa_reciprocal_t* r1 = &reciprocal[x_scaled + 1 < x_block_rest];
+      const __m256i m     = _mm256_setr_epi32(r0->m, r0->m, r0->m, r0->m, r1->m, r1->m, r1->m, r1->m);
+      const __m256i bias  = _mm256_setr_epi32(r0->bias, r0->bias, r0->bias, r0->bias, r1->bias, r1->bias, r1->bias, r1->bias);
+      const __m256i shift = _mm256_setr_epi64x(r0->s, r0->s, r1->s, r1->s);
+
+      __m256i v    = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*) sum[x_scaled]), bias);
+      __m256i even = _mm256_srlv_epi64(_mm256_mul_epu32(v, m), shift);
+      __m256i odd  = _mm256_srlv_epi64(_mm256_mul_epu32(_mm256_srli_epi64(v, 32), m), shift);
+      v = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+
+      ssaa_store_pixel_sse41(scale_data_row           , _mm256_castsi256_si128(v)     , channels);
+      ssaa_store_pixel_sse41(scale_data_row + channels, _mm256_extracti128_si256(v, 1), channels);
+      scale_data_row += 2 * channels;
+   }
+   if(x_scaled < scaled_width)
+   {
+      const __m128i v = ssaa_divide_sse41(_mm_loadu_si128((const __m128i*) sum[x_scaled]), &reciprocal[x_scaled < x_block_rest]);
+      ssaa_store_pixel_sse41(scale_data_row, v, channels);
+   }
+}
+
+static __attribute__((target("avx2"))) void
+ssaa_store_row_avx2
+   (  unsigned char*       scale_data_row
+   ,  const ssaa_sum32_t*  sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  y_block_size
+   ,  int                  channels
+   ,  const int*           background
+   )
+{
+   if(channels == 2 || channels == 4)
+   {
+      ssaa_store_row_premultiplied(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, channels, background);
+      return;
+   }
+
+   switch(channels)
+   {
+      case 1: ssaa_store_row_avx2_generic(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, 1); break;
+      case 3: ssaa_store_row_avx2_generic(scale_data_row, sum, scaled_width, x_block_size_min, x_block_rest, y_block_size, 3); break;
+   }
+}
+
+static const ssaa_kernel_t ssaa_kernel_avx2 = { "avx2", ssaa_accumulate_row_avx2, ssaa_store_row_avx2, ssaa_accumulate_row_linear_sse41 };
+
+/**
+ * AVX-512 kernel, the AVX2 kernel with linear light looked up in registers. srgb_to_linear is held in eight registers of 32 entries,
+ * and vpermi2w looks up 32 channels in two of them at once, so the table lookups that bound the other kernels are vectorized.
+ * A chunk of the row is looked up, premultiplied and widened to 32 bit channels, which the blocks then sum with SSE adds.
+ **/
+#define SSAA_LINEAR_CHUNK 768 // Channels looked up at a time, a whole number of pixels of 1 to 4 channels
+
+static inline __attribute__((always_inline, target("avx2,avx512bw,avx512vl"))) void
+ssaa_lookup_linear_avx512
+   (  const unsigned char* data
+   ,  uint32_t*            linear
+   ,  int                  count
+   ,  const int            channels
+   ,  const __m512i*       table
+   )
+{
+   const __m512i bit6 = _mm512_set1_epi16(64);
+   const __m512i bit7 = _mm512_set1_epi16(128);
+   int i;
+   for(i = 0; i < count; i += 32)
+   {
+      const __mmask32 load  = (count - i >= 32) ? 0xFFFFFFFFu : (1u << (count - i)) - 1;
+      const __m512i   index = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(load, data + i));
+
+      // Index bits 0 to 5 select an entry of a pair of tables, and bits 6 and 7 the pair
+      const __mmask32 high6 = _mm512_test_epi16_mask(index, bit6);
+      const __mmask32 high7 = _mm512_test_epi16_mask(index, bit7);
+      __m512i value = _mm512_mask_blend_epi16
+         (  high7
+         ,  _mm512_mask_blend_epi16(high6, _mm512_permutex2var_epi16(table[0], index, table[1]), _mm512_permutex2var_epi16(table[2], index, table[3]))
+         ,  _mm512_mask_blend_epi16(high6, _mm512_permutex2var_epi16(table[4], index, table[5]), _mm512_permutex2var_epi16(table[6], index, table[7]))
+         );
+      
+      __m512i lo, hi;
+      if(channels == 2 || channels == 4)
+      {
+         // Premultiply colors by the alpha of their pixel, and keep alpha itself (times 1)
+         const __m512i alpha = (channels == 4)
+            ? _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(index, 0xFF), 0xFF)
+            : _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(index, 0xF5), 0xF5);
+         value = _mm512_mask_blend_epi16((channels == 4) ? 0x88888888u : 0xAAAAAAAAu, value, _mm512_set1_epi16(1));
+         lo    = _mm512_mullo_epi32(_mm512_cvtepu16_epi32(_mm512_castsi512_si256(value)),    _mm512_cvtepu16_epi32(_mm512_castsi512_si256(alpha)));
+         hi    = _mm512_mullo_epi32(_mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(value, 1)), _mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(alpha, 1)));
+      }
+      else
+      {
+         lo = _mm512_cvtepu16_epi32(_mm512_castsi512_si256(value));
+         hi = _mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(value, 1));
+      }
+      _mm512_storeu_si512(linear + i,      lo);
+      _mm512_storeu_si512(linear + i + 16, hi);
+   }
+}
+
+static inline __attribute__((always_inline, target("avx2,avx512bw,avx512vl"))) void
+ssaa_accumulate_row_linear_avx512_generic
+   (  const unsigned char* data_row
+   ,  ssaa_sum64_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  const int            channels
+   ,  const uint16_t*      srgb_to_linear
+   )
+{
+   uint32_t linear[SSAA_LINEAR_CHUNK + 32]; // Lookups write whole registers, and rgb24 loads one channel past the last pixel
+   __m512i  table[8];
+   int k;
+   for(k = 0; k < 8; ++k)
+      table[k] = _mm512_loadu_si512(srgb_to_linear + 32 * k);
+
+   const __m128i scale        = _mm_set1_epi64x((channels == 2 || channels == 4) ? 257 : 1);
+   const __m128i keep         = _mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(channels)); // Channels of one pixel
+   const int     width        = scaled_width * x_block_size_min + x_block_rest;
+   const int     chunk_pixels = SSAA_LINEAR_CHUNK / channels;
+   int     x_scaled     = 0;
+   int     x_block_left = x_block_size_min + (0 < x_block_rest ? 1 : 0);
+   __m128i acc          = _mm_setzero_si128();
+   int x, i;
+   for(x = 0; x < width; x += chunk_pixels)
+   {
+      // The whole chunk is read before the sums of its blocks are written, as data_row may alias sum
+      const int pixels = min(chunk_pixels, width - x);
+      ssaa_lookup_linear_avx512(data_row + x * channels, linear, pixels * channels, channels, table);
+      const uint32_t* value = linear;
+      for(i = 0; i < pixels; )
+      {
+         // Sum the part of the current block in this chunk
+         const int span = min(x_block_left, pixels - i);
+         const uint32_t* end = value + span * channels;
+         if(channels != 3)
+         {
+            // Whole registers hold a whole number of pixels, which are folded onto one pixel
+            __m512i wide = _mm512_setzero_si512();
+            for(; value + 16 <= end; value += 16)
+               wide = _mm512_add_epi32(wide, _mm512_loadu_si512(value));
+            __m128i folded = _mm_add_epi32
+               (  _mm_add_epi32(_mm512_castsi512_si128(wide), _mm512_extracti32x4_epi32(wide, 1))
+               ,  _mm_add_epi32(_mm512_extracti32x4_epi32(wide, 2), _mm512_extracti32x4_epi32(wide, 3))
+               );
+            if(channels <= 2)
+               folded = _mm_add_epi32(folded, _mm_srli_si128(folded, 8));
+            if(channels == 1)
+               folded = _mm_add_epi32(folded, _mm_srli_si128(folded, 4));
+            acc = _mm_add_epi32(acc, folded);
+         }
+         for(; value < end; value += channels)
+         {
+            switch(channels)
+            {
+               case 1:  acc = _mm_add_epi32(acc, _mm_cvtsi32_si128((int) *value)); break;
+               case 2:  acc = _mm_add_epi32(acc, _mm_loadl_epi64((const __m128i*) value)); break;
+               default: acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*) value)); break;
+            }
+         }
+         i            += span;
+         x_block_left -= span;
+         if(x_block_left == 0)
+         {
+            const int x_block_size = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+            __m128i* sum_lo = (__m128i*) &sum[x_scaled][0];
+            __m128i* sum_hi = (__m128i*) &sum[x_scaled][2];
+            acc = _mm_and_si128(acc, keep);
+            _mm_storeu_si128(sum_lo, _mm_add_epi64(_mm_loadu_si128(sum_lo), _mm_mul_epu32(_mm_cvtepu32_epi64(acc), scale)));
+            _mm_storeu_si128(sum_hi, _mm_add_epi64(_mm_loadu_si128(sum_hi), _mm_mul_epu32(_mm_cvtepu32_epi64(_mm_srli_si128(acc, 8)), scale)));
+            sum[x_scaled][4] += x_block_size;
+            
+            ++x_scaled;
+            x_block_left = x_block_size_min + (x_scaled < x_block_rest ? 1 : 0);
+            acc          = _mm_setzero_si128();
+         }
+      }
+   }
+}
+
+static __attribute__((target("avx2,avx512bw,avx512vl"))) void
+ssaa_accumulate_row_linear_avx512
+   (  const unsigned char* data_row
+   ,  ssaa_sum64_t*        sum
+   ,  int                  scaled_width
+   ,  int                  x_block_size_min
+   ,  int                  x_block_rest
+   ,  int                  channels
+   ,  const color32_t*     palette
+   ,  const uint16_t*      srgb_to_linear
+   )
+{
+   if(palette)
+   {
+      ssaa_accumulate_row_linear_sse41(data_row, sum, scaled_width, x_block_size_min, x_block_rest, channels, palette, srgb_to_linear);
+      return;
+   }
+
+   switch(channels)
+   {
+      case 1: ssaa_accumulate_row_linear_avx512_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 1, srgb_to_linear); break;
+      case 2: ssaa_accumulate_row_linear_avx512_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 2, srgb_to_linear); break;
+      case 3: ssaa_accumulate_row_linear_avx512_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 3, srgb_to_linear); break;
+      case 4: ssaa_accumulate_row_linear_avx512_generic(data_row, sum, scaled_width, x_block_size_min, x_block_rest, 4, srgb_to_linear); break;
+   }
+}
+
+static const ssaa_kernel_t ssaa_kernel_avx512 = { "avx512", ssaa_accumulate_row_avx2, ssaa_store_row_avx2, ssaa_accumulate_row_linear_avx512 };
+
+static const ssaa_kernel_t* ssaa_kernel        = NULL;
+static pthread_once_t       ssaa_kernel_once   = PTHREAD_ONCE_INIT;
+
+static void
+ssaa_kernel_init
+   (
+   )
+{
+   const char* limit = getenv("TERMPNG_SSAA");
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && (!limit || strcmp(limit, "avx512") == 0))
+      ssaa_kernel = &ssaa_kernel_avx512;
+   else if(__builtin_cpu_supports("avx2") && (!limit || strcmp(limit, "avx512") == 0 || strcmp(limit, "avx2") == 0))
+      ssaa_kernel = &ssaa_kernel_avx2;
+   else if(__builtin_cpu_supports("sse4.1") && (!limit || strcmp(limit, "avx512") == 0 || strcmp(limit, "avx2") == 0 || strcmp(limit, "sse4.1") == 0))
+      ssaa_kernel = &ssaa_kernel_sse41;
+}
+
+const ssaa_kernel_t* 
+ssaa_kernel_get
+   (
+   )
+{
+   pthread_once(&ssaa_kernel_once, ssaa_kernel_init);
+   return ssaa_kernel;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#ifndef SSAA_H_INCLUDED
+#define SSAA_H_INCLUDED
+
+#include <stdint.h>
+
+#include "image.h"
+
+/**
+ * SIMD row kernels for SSAA scaling of 8 bit pixel formats (gray8, gray_alpha16, rgb24, rgba32 and index8 through its palette).
+ * All channels of a pixel are widened into one vector of 32 bit sums, sum[x][0..3], and averages are
+ * rounded up with exact fixed-point reciprocals, so the result is bit-identical to ceil(sum / n) in integers.
+ * Pixels with alpha (2 and 4 channels, alpha last) are summed premultiplied, color * alpha, so transparent pixels 
+ * do not bleed their color into the average. They are stored as ceil(sum / alpha sum), or blended onto a background.
+ * The block of each output pixel is x_block_size_min (+ 1 for the first x_block_rest blocks) by y_block_size pixels,
+ * and 32 bit sums limit the block area to SSAA_KERNEL_MAX_AREA pixels, or SSAA_KERNEL_MAX_AREA_ALPHA when premultiplied.
+ **/
+typedef uint32_t ssaa_sum32_t[4];
+
+#define SSAA_KERNEL_MAX_AREA       (1 << 22)
+#define SSAA_KERNEL_MAX_AREA_ALPHA (1 << 16)
+
+/**
+ * Linear-light SSAA adds to the 64 bit sums of the scalar path, four channels and the pixel count.
+ * Colors are looked up as 16 bit linear values and premultiplied by the 8 bit alpha, and each block row is summed in 32 bit lanes,
+ * which are widened (times 257 with alpha, as the scalar path premultiplies by 16 bit alpha) when added to the sums.
+ * So the sums are exactly those of the scalar path, and block rows are limited to 
+ * SSAA_KERNEL_LINEAR_MAX_WIDTH pixels, or SSAA_KERNEL_LINEAR_MAX_WIDTH_ALPHA when premultiplied.
+ * The table lookups bound the cost, so only the AVX-512 kernel, which looks up 32 channels per instruction, 
+ * gets close to the sRGB kernels for direct color. Index8 looks up its palette once per row in all kernels.
+ **/
+typedef int64_t ssaa_sum64_t[5];
+
+#define SSAA_KERNEL_LINEAR_MAX_WIDTH       (1 << 16)
+#define SSAA_KERNEL_LINEAR_MAX_WIDTH_ALPHA (1 << 8)
+
+typedef struct
+{
+   const char* name;
+   
+   //! Add one source row to the sums. If palette is given, the row is index8 and channels must be 4 (palette colors have alpha).
+   void (*accumulate_row)
+      (  const unsigned char* data_row
+      ,  ssaa_sum32_t*        sum
+      ,  int                  scaled_width
+      ,  int                  x_block_size_min
+      ,  int                  x_block_rest
+      ,  int                  channels
+      ,  const color32_t*     palette
+      );
+
+   /**
+    * Store the rounded up averages of y_block_size accumulated rows.
+    * If background is given, pixels with alpha are blended onto the background color (one value per color channel),
+    * ceil((sum + background * (255 * n - alpha sum)) / (255 * n)), and the averaged alpha is kept.
+    **/
+   void (*store_row)
+      (  unsigned char*       scale_data_row
+      ,  const ssaa_sum32_t*  sum
+      ,  int                  scaled_width
+      ,  int                  x_block_size_min
+      ,  int                  x_block_rest
+      ,  int                  y_block_size
+      ,  int                  channels
+      ,  const int*           background
+      );
+
+   //! Add one source row to linear-light sums, with colors converted through srgb_to_linear (256 entries). Palette as for accumulate_row.
+   void (*accumulate_row_linear)
+      (  const unsigned char* data_row
+      ,  ssaa_sum64_t*        sum
+      ,  int                  scaled_width
+      ,  int                  x_block_size_min
+      ,  int                  x_block_rest
+      ,  int                  channels
+      ,  const color32_t*     palette
+      ,  const uint16_t*      srgb_to_linear
+      );
+}  ssaa_kernel_t;
+
+/**
+ * Get the best SSAA kernel supported by the CPU (AVX-512, AVX2 or SSE4.1), or NULL if there is none, in which case the scalar path is used.
+ * The environment variable TERMPNG_SSAA=scalar|sse4.1|avx2|avx512 limits the choice, e.g. for comparing kernels.
+ **/
+const ssaa_kernel_t* 
+ssaa_kernel_get
+   (
+   );
+
+#endif /* SSAA_H_INCLUDED */
@@ -140,6 +140,7 @@ int main(int argc, char* argv[])
    
    // Read and run transformation pipeline
    image_t image;
+   image_t_init(&image);
    transform_t* transform = (transform_t*) malloc(sizeof(transform_t));
    transform_t_init(transform);
    int argn = 1;
@@ -3,8 +3,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #include "util.h"
+#include "input.h"
+#include "formats.h"
+#include "frame_queue.h"
+#include "shm_ring.h"
 
 int TRANSFORM_FAILLURE = 0;
 int TRANSFORM_SUCCESS  = 1;
@@ -16,6 +27,13 @@ transform_options_destroy
    ,  void*             options
    );
 
+static int 
+transform_apply_list
+   (  image_t*             image
+   ,  const transform_t*   transform
+   ,  int                  verbose
+   );
+
 /**
  * transform_t helper functions.
  **/
@@ -77,13 +95,49 @@ transform_t_destroy
  **/
 
 /**
- * Parse "read".
+ * Parse "read". The path "-" reads from stdin.
+ * PNG, QOI and binary PGM/PPM/PAM are detected automatically, 
+ * while "--width W --height H" reads headerless raw rgba32 data.
+ * With "--progressive", interlaced images are drawn as coarse previews that are refined as the Adam7 passes arrive.
+ * With "--max-memory N[K|M|G]", the image is read in tiles that are cropped, blended and scaled by the transforms that follow,
+ * so the full size image is never held in memory. QOI, stdin and converted PNM input is read whole though, and must fit in 
+ * a quarter of the budget, while the result and the state of the scaler must fit in half. Not used with "--progressive".
  **/
 typedef struct
 {
-   char* path;
+   char*  path;
+   int    progressive;
+   int    width;       // Width of raw input
+   int    height;      // Height of raw input
+   size_t max_memory;  // Memory budget for tiled reads, 0 for no limit
 }  transform_read_options_t;
 
+//! Parse a size in bytes, with an optional K, M or G suffix. Sizes that do not fit in a size_t are rejected.
+static size_t
+transform_parse_size
+   (  const char* str
+   )
+{
+   char*  end;
+   int    shift = 0;
+   errno = 0;
+   const unsigned long long size = strtoull(str, &end, 10);
+   switch(*end)
+   {
+      case 'G': case 'g': shift = 30; ++end; break;
+      case 'M': case 'm': shift = 20; ++end; break;
+      case 'K': case 'k': shift = 10; ++end; break;
+   }
+   if(end == str || *end != '\0' || str[0] == '-')
+   {
+      printf("[transform:read] Invalid size '%s'.\n", str);
+      assert(0);
+   }
+   if(errno == ERANGE || size > (SIZE_MAX >> shift))
+      abort_("[transform:read] Size '%s' is too large", str);
+   return (size_t) size << shift;
+}
+
 static int
 transform_parse_read
    (  int*           argn_ptr
@@ -99,21 +153,222 @@ transform_parse_read
 
    transform_read_options_t* transform_read_options = (transform_read_options_t*) malloc(sizeof(transform_read_options_t));
 
+   transform_read_options->progressive = 0;
+   transform_read_options->width       = 0;
+   transform_read_options->height      = 0;
+   transform_read_options->max_memory  = 0;
+
    int argn = *argn_ptr;
    assert(argn + 1 < argc);
    transform_read_options->path = string_allocate_and_copy(argv[argn + 1]); 
+   argn += 2;
+
+   while(argn < argc)
+   {
+      // Check if first char is a '-'
+      if(argv[argn][0] != '-')
+      {
+         printf("Breaking on '%s' (first char: '%c').\n", argv[argn], argv[argn][0]);
+         break;
+      }
+
+      // If first char is '-', we try to parse options
+      if(strcmp(argv[argn], "--progressive") == 0)
+      {
+         transform_read_options->progressive = 1;
+      }
+      else if(strcmp(argv[argn], "--width") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_read_options->width = atoi(argv[argn + 1]);
+         argn += 1;
+      }
+      else if(strcmp(argv[argn], "--height") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_read_options->height = atoi(argv[argn + 1]);
+         argn += 1;
+      }
+      else if(strcmp(argv[argn], "--max-memory") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_read_options->max_memory = transform_parse_size(argv[argn + 1]);
+         argn += 1;
+      }
+      else
+      {
+         printf("[transform:read] Unknown option '%s'.\n", argv[argn]);
+         assert(0);
+      }
+
+      argn += 1;
+   }
    
    transform->options = transform_read_options;
 
+   *argn_ptr = argn;
+
+   return 1;
+}
+
+
+/**
+ * Parse "stream". Reads back-to-back PNG (or PNM) frames from path, e.g. "stream - --fps 25" on the output of 
+ * "ffmpeg -i video -f image2pipe -c:v png -", and applies the rest of the transforms to every frame.
+ * Frames are decoded on a separate thread, into a queue of "--queue" frames.
+ * With "--fps 0" (default) frames are drawn as soon as they are ready.
+ **/
+typedef struct
+{
+   char*  path;
+   double fps;
+   int    queue_size;
+}  transform_stream_options_t;
+
+static int 
+transform_parse_stream
+   (  int*           argn_ptr
+   ,  int            argc
+   ,  char**         argv
+   ,  transform_t**  transform_ptr
+   )
+{
+   *transform_ptr = transform_t_make_next(*transform_ptr);
+   transform_t* transform = *transform_ptr;
+   
+   // Set type
+   transform->type = STREAM;
+   
+   // Create options with defaults
+   transform_stream_options_t* transform_stream_options = (transform_stream_options_t*) malloc(sizeof(transform_stream_options_t));
+   transform_stream_options->fps        = 0.0;
+   transform_stream_options->queue_size = 4;
+
+   int argn = *argn_ptr;
+   assert(argn + 1 < argc);
+   transform_stream_options->path = string_allocate_and_copy(argv[argn + 1]); 
    argn += 2;
+   
+   while(argn < argc)
+   {
+      // Check if first char is a '-'
+      if(argv[argn][0] != '-')
+      {
+         printf("Breaking on '%s' (first char: '%c').\n", argv[argn], argv[argn][0]);
+         break;
+      }
+
+      if(strcmp(argv[argn], "--fps") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_stream_options->fps = atof(argv[argn + 1]);
+         argn += 1;
+      }
+      else if(strcmp(argv[argn], "--queue") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_stream_options->queue_size = atoi(argv[argn + 1]);
+         assert(transform_stream_options->queue_size > 0);
+         argn += 1;
+      }
+      else
+      {
+         printf("[transform:stream] Unknown option '%s'.\n", argv[argn]);
+         assert(0);
+      }
+      
+      argn += 1;
+   }
+   
+   // Set options
+   transform->options = transform_stream_options;
+
    *argn_ptr = argn;
 
    return 1;
 }
 
+/**
+ * Parse "shm". Attaches to a shared-memory frame ring (see shm_ring.h) published by another process, 
+ * and applies the rest of the transforms to the newest frame, polling "--fps" times per second (default 30).
+ * Runs until the producer closes the ring, or "--frames" frames have been shown.
+ **/
+typedef struct
+{
+   char*  name;
+   double fps;
+   int    frames;
+}  transform_shm_options_t;
+
+static int 
+transform_parse_shm
+   (  int*           argn_ptr
+   ,  int            argc
+   ,  char**         argv
+   ,  transform_t**  transform_ptr
+   )
+{
+   *transform_ptr = transform_t_make_next(*transform_ptr);
+   transform_t* transform = *transform_ptr;
+   
+   // Set type
+   transform->type = SHM;
+   
+   // Create options with defaults
+   transform_shm_options_t* transform_shm_options = (transform_shm_options_t*) malloc(sizeof(transform_shm_options_t));
+   transform_shm_options->fps    = 30.0;
+   transform_shm_options->frames = 0;
+
+   int argn = *argn_ptr;
+   assert(argn + 1 < argc);
+   transform_shm_options->name = string_allocate_and_copy(argv[argn + 1]); 
+   argn += 2;
+   
+   while(argn < argc)
+   {
+      // Check if first char is a '-'
+      if(argv[argn][0] != '-')
+      {
+         printf("Breaking on '%s' (first char: '%c').\n", argv[argn], argv[argn][0]);
+         break;
+      }
+
+      if(strcmp(argv[argn], "--fps") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_shm_options->fps = atof(argv[argn + 1]);
+         assert(transform_shm_options->fps > 0.0);
+         argn += 1;
+      }
+      else if(strcmp(argv[argn], "--frames") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_shm_options->frames = atoi(argv[argn + 1]);
+         argn += 1;
+      }
+      else
+      {
+         printf("[transform:shm] Unknown option '%s'.\n", argv[argn]);
+         assert(0);
+      }
+      
+      argn += 1;
+   }
+   
+   // Set options
+   transform->options = transform_shm_options;
+
+   *argn_ptr = argn;
+
+   return 1;
+}
 
 /**
  * Parse "scale".
+ * With "--threads N" output rows are scaled in N bands in parallel, by default one per core.
+ * When a PNG is scaled while it is read, this applies to SSAA and pooling, 
+ * while "area" and the filters scale each row on the reading thread as it is decoded.
+ * With "--linear" SSAA averages in linear light instead of on the sRGB encoded values.
  **/
 typedef struct
 {
@@ -121,6 +376,7 @@ typedef struct
    int     height;
    double  percent;
    scale_t scale;
+   int     threads; // 0 is one thread per core
 }  transform_scale_t;
 
 static int 
@@ -143,6 +399,8 @@ transform_parse_scale
    transform_scale->width   = 0;
    transform_scale->height  = 0;
    transform_scale->percent = 0.0;
+   transform_scale->threads = 0;
+   int linear = 0;
    
    // Read options
    int argn = *argn_ptr;
@@ -175,6 +433,16 @@ transform_parse_scale
          transform_scale->percent = atof(argv[argn + 1]);
          ++argn;
       }
+      else if(strcmp(argv[argn], "--threads") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_scale->threads = atoi(argv[argn + 1]);
+         ++argn;
+      }
+      else if(strcmp(argv[argn], "--linear") == 0)
+      {
+         linear = 1;
+      }
       else if(strcmp(argv[argn], "--type") == 0)
       {
          assert(argn + 1 < argc);
@@ -194,6 +462,38 @@ transform_parse_scale
          {
             transform_scale->scale = SCALE_SSAA;
          }
+         else if(strcmp(argv[argn + 1], "area") == 0)
+         {
+            transform_scale->scale = SCALE_AREA;
+         }
+         else if(strcmp(argv[argn + 1], "bilinear") == 0)
+         {
+            transform_scale->scale = SCALE_BILINEAR;
+         }
+         else if(strcmp(argv[argn + 1], "bicubic") == 0)
+         {
+            transform_scale->scale = SCALE_BICUBIC;
+         }
+         else if(strcmp(argv[argn + 1], "lanczos3") == 0)
+         {
+            transform_scale->scale = SCALE_LANCZOS3;
+         }
+         else if(strcmp(argv[argn + 1], "max") == 0)
+         {
+            transform_scale->scale = SCALE_MAX;
+         }
+         else if(strcmp(argv[argn + 1], "min") == 0)
+         {
+            transform_scale->scale = SCALE_MIN;
+         }
+         else if(strcmp(argv[argn + 1], "median") == 0)
+         {
+            transform_scale->scale = SCALE_MEDIAN;
+         }
+         else if(strcmp(argv[argn + 1], "mode") == 0)
+         {
+            transform_scale->scale = SCALE_MODE;
+         }
          else
          {
             assert(0);
@@ -209,6 +509,12 @@ transform_parse_scale
 
       ++argn;
    }
+   if(linear)
+   {
+      // Only box averaging has a linear-light variant
+      assert(transform_scale->scale == SCALE_SSAA);
+      transform_scale->scale = SCALE_SSAA_LINEAR;
+   }
    *argn_ptr = argn;
    
    // Set options
@@ -218,7 +524,14 @@ transform_parse_scale
 }
 
 /**
- * Parse "draw" (takes no options).
+ * Parse "draw".
+ * With "--threads N" the escape sequences are generated in N bands of cell rows in parallel (0 is one per core),
+ * which are written out in order with one writev.
+ * With "--diff" only the cells that changed since the previous frame are drawn, as runs placed with cursor movement,
+ * in a synchronized update. A frame that is the same as the previous one is skipped. Not used with "--file".
+ * With "--diff-cache PATH" (implies "--diff") a positioned draw also saves its cells to PATH,
+ * so the next run drawing at the same place only draws what changed, as long as the screen was left alone in between.
+ * Terminal rows and columns start at 1, so a 0 "--x_pos" or "--y_pos" of a positioned draw is read as 1, as terminals do.
  **/
 typedef enum
 {  DRAW_DEFAULT
@@ -231,6 +544,13 @@ typedef struct
    int         x_pos;
    int         y_pos;
    char*       path;
+   int         lines_drawn; // Lines written to stdout by the previous draw, used to redraw in place
+   char*       buffer;      // Output buffer, kept between draws and grown to image_t_draw_size when needed
+   size_t      buffer_size;
+   int         threads;     // Threads encoding bands of the output, 0 is one per core
+   int         diff;        // Only draw the cells that changed since the previous frame
+   char*       cache_path;  // Where cells are kept between runs for "--diff-cache", or NULL
+   draw_cache_t cache;      // Cells of the previous frame for "--diff"
 } transform_draw_options_t;
 
 static int 
@@ -250,6 +570,13 @@ transform_parse_draw
    transform_draw->x_pos   = 0;
    transform_draw->y_pos   = 0;
    transform_draw->path    = NULL;
+   transform_draw->lines_drawn = 0;
+   transform_draw->buffer      = NULL;
+   transform_draw->buffer_size = 0;
+   transform_draw->threads     = 1;
+   transform_draw->diff        = 0;
+   transform_draw->cache_path  = NULL;
+   draw_cache_t_init(&transform_draw->cache);
 
    // Set type
    transform->type    = DRAW;
@@ -286,6 +613,23 @@ transform_parse_draw
          transform_draw->path = string_allocate_and_copy(argv[argn + 1]);
          ++argn;
       }
+      else if(strcmp(argv[argn], "--threads") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_draw->threads = atoi(argv[argn + 1]);
+         ++argn;
+      }
+      else if(strcmp(argv[argn], "--diff") == 0)
+      {
+         transform_draw->diff = 1;
+      }
+      else if(strcmp(argv[argn], "--diff-cache") == 0)
+      {
+         assert(argn + 1 < argc);
+         transform_draw->diff       = 1;
+         transform_draw->cache_path = string_allocate_and_copy(argv[argn + 1]);
+         ++argn;
+      }
       else
       {
          printf("Unknown option '%s'.\n", argv[argn]);
@@ -297,6 +641,16 @@ transform_parse_draw
    }
    *argn_ptr = argn;
 
+   if(transform_draw->type == DRAW_POS)
+   {
+      transform_draw->x_pos = max(transform_draw->x_pos, 1);
+      transform_draw->y_pos = max(transform_draw->y_pos, 1);
+   }
+
+   // Only a positioned draw knows where the cells of a previous run are on screen
+   if(transform_draw->cache_path && transform_draw->type == DRAW_POS)
+      draw_cache_t_load(&transform_draw->cache, transform_draw->cache_path);
+
    transform->options    = transform_draw;
 
    return 1;
@@ -523,6 +877,25 @@ transform_options_destroy
          transform_draw_options_t* options_draw = (transform_draw_options_t*) options;
          if(options_draw->path)
             free(options_draw->path);
+         if(options_draw->buffer)
+            free(options_draw->buffer);
+         if(options_draw->cache_path)
+            free(options_draw->cache_path);
+         draw_cache_t_destroy(&options_draw->cache);
+         break;
+      }
+      case STREAM:
+      {
+         transform_stream_options_t* options_stream = (transform_stream_options_t*) options;
+         if(options_stream->path)
+            free(options_stream->path);
+         break;
+      }
+      case SHM:
+      {
+         transform_shm_options_t* options_shm = (transform_shm_options_t*) options;
+         if(options_shm->name)
+            free(options_shm->name);
          break;
       }
       case NONE:
@@ -550,6 +923,8 @@ static transform_command_t command_table [] =
 ,  {  "bg"        , transform_parse_background  }
 ,  {  "background", transform_parse_background  }
 ,  {  "crop"      , transform_parse_crop  }
+,  {  "stream"    , transform_parse_stream  }
+,  {  "shm"       , transform_parse_shm  }
 };
 
 //! Get index of command with name, if it exists, otherwise returns -1.
@@ -559,7 +934,7 @@ transform_command_index
    )
 {
    int i;
-   for(i = 0; i < 6; ++i)
+   for(i = 0; i < (int) (sizeof(command_table) / sizeof(command_table[0])); ++i)
    {
       printf("Testing keyword '%s'.\n", command_table[i].name);
       if(strcmp(command_table[i].name, name) == 0)
@@ -608,20 +983,383 @@ transform_parse_args
    return 1;
 }
 
-int
-transform_apply_read
+//! Progress callback for progressive reads. Renders a preview by applying the rest of the pipeline to a copy of the image.
+static void
+transform_read_progress
+   (  const image_t* const image
+   ,  int                  pass
+   ,  int                  number_of_passes
+   ,  void*                user
+   )
+{
+   // Only preview after passes 1, 3 and 5, where the resolution has doubled in both directions.
+   // The last pass is handled by the caller on the final image.
+   if(pass % 2 != 0 || pass == number_of_passes - 1)
+      return;
+
+   image_t preview;
+   image_t_copy(image, &preview);
+   transform_apply_list(&preview, (const transform_t*) user, 0);
+   image_t_destroy(&preview);
+}
+
+//! Read and scale in one streaming pass, used when "read" is directly followed by "scale", blending onto background if not NULL.
+static int
+transform_apply_read_scale
+   (  image_t* image
+   ,  input_t* input
+   ,  const void* const options_scale_ptr
+   ,  const color32_t*  background
+   )
+{
+   transform_scale_t* options_scale = (transform_scale_t*) options_scale_ptr;
+   
+   if(background)
+      image_t_read_png_scale_background(input, image, options_scale->width, options_scale->height, options_scale->percent, options_scale->scale, options_scale->threads, background->r, background->g, background->b);
+   else
+      image_t_read_png_scale(input, image, options_scale->width, options_scale->height, options_scale->percent, options_scale->scale, options_scale->threads);
+   
+   return TRANSFORM_SUCCESS;
+}
+
+//! Read only the crop window, used when "read" is directly followed by a "crop --define".
+static int
+transform_apply_read_crop
    (  image_t* image
-   ,  const void* const options
+   ,  input_t* input
+   ,  const void* const options_crop_ptr
+   )
+{
+   transform_crop_options_t* options_crop = (transform_crop_options_t*) options_crop_ptr;
+   
+   image_t_read_png_crop(input, image, options_crop->x_crop_begin, options_crop->y_crop_begin, options_crop->x_crop_end, options_crop->y_crop_end);
+   
+   return TRANSFORM_SUCCESS;
+}
+
+/**
+ * State of a tiled read, see "read --max-memory".
+ * Tiles are passed through the transforms [first, last) in turn. These are "crop"s (without --edge) and "background"s,
+ * optionally ending in a "scale" that streams the tiles into a scaled image (blending onto a "background" right after it).
+ * Without a "scale" the tiles are put back together.
+ **/
+typedef struct
+{
+   const transform_t* first;
+   const transform_t* last;
+   int                stages;     // Number of transforms in [first, last)
+   int*               width;      // Size of the input of each transform, and of the result
+   int*               height;
+   int*               y;          // Rows of the input of each transform seen so far, and of the result
+   image_t*           image;      // Result
+   image_scaler_t*    scaler;
+   size_t             max_memory;
+}  transform_tiles_t;
+
+//! Work out the size of the input of each transform of a tiled read, and of the result, from the size of the image read.
+static void
+transform_tiles_t_set_size
+   (  transform_tiles_t* const tiles
+   ,  int                      width
+   ,  int                      height
+   )
+{
+   const transform_t* transform = tiles->first;
+   int stage;
+   for(stage = 0; stage <= tiles->stages; ++stage)
+   {
+      tiles->width[stage]  = width;
+      tiles->height[stage] = height;
+      if(stage < tiles->stages && transform->type == CROP)
+      {
+         // Clamp like image_t_crop
+         const transform_crop_options_t* options = (const transform_crop_options_t*) transform->options;
+         const int x_end = min(width , options->x_crop_end);
+         const int y_end = min(height, options->y_crop_end);
+         width  = x_end - min(options->x_crop_begin, x_end);
+         height = y_end - min(options->y_crop_begin, y_end);
+      }
+      if(stage < tiles->stages)
+         transform = transform->next;
+   }
+
+   if(width <= 0 || height <= 0)
+      abort_("[read] Nothing is left of the image after cropping");
+}
+
+//! Check that the result of a tiled read, and the state of its scaler, fit in the memory budget, leaving the other half for tiles.
+static void
+transform_tiles_t_check_size
+   (  const transform_tiles_t* const tiles
+   )
+{
+   const image_t* image = tiles->image;
+   const size_t   size  = (size_t) image->width * image->height * pixel_format_size(image->format);
+   const size_t   state = tiles->scaler ? image_scaler_t_memory(tiles->scaler) : 0;
+   if(size + state > tiles->max_memory / 2)
+      abort_("[read] Result of %i x %i pixels (%zu bytes, and %zu bytes of scaler state) does not fit in half of --max-memory %zu, scale or crop it further", image->width, image->height, size, state, tiles->max_memory);
+}
+
+//! Tile callback of a tiled read, applying the transforms [first, last) to the tile.
+static void
+transform_read_tile
+   (  image_t* const tile
+   ,  int            y
+   ,  int            height
+   ,  void*          user
+   )
+{
+   transform_tiles_t* tiles = (transform_tiles_t*) user;
+   if(y == 0)
+      transform_tiles_t_set_size(tiles, tile->width, height);
+
+   image_t            band      = *tile;
+   const transform_t* transform = tiles->first;
+   int stage, row;
+   for(stage = 0; stage < tiles->stages; ++stage, transform = transform->next)
+   {
+      const int y_band = tiles->y[stage];
+      tiles->y[stage] += band.height;
+
+      switch(transform->type)
+      {
+         case CROP:
+         {
+            const transform_crop_options_t* options = (const transform_crop_options_t*) transform->options;
+            const int x_end   = min(band.width, options->x_crop_end);
+            const int y_end   = max(min(band.height, options->y_crop_end - y_band), 0);
+            const int y_begin = min(max(options->y_crop_begin - y_band, 0), y_end);
+            if(y_begin == y_end)
+            {
+               // No rows of this tile are in the window
+               image_t_destroy(&band);
+               return;
+            }
+            image_t cropped;
+            image_t_crop(&band, &cropped, min(options->x_crop_begin, x_end), y_begin, x_end, y_end);
+            image_t_destroy(&band);
+            band = cropped;
+            break;
+         }
+         case BACKGROUND:
+         {
+            const color32_t* color = &((const transform_background_options_t*) transform->options)->color;
+            image_t_apply_background(&band, color->r, color->g, color->b);
+            break;
+         }
+         case SCALE:
+         {
+            if(!tiles->scaler)
+            {
+               // Background may have changed the format, so the scaler is set up from the first tile that gets here
+               const transform_scale_t* options    = (const transform_scale_t*) transform->options;
+               const transform_t*       background = (transform->next != tiles->last) ? transform->next : NULL;
+               image_t header = band;
+               header.height  = tiles->height[stage];
+               tiles->scaler  = image_scaler_t_create(&header, tiles->image, options->width, options->height, options->percent, options->scale, background ? &((const transform_background_options_t*) background->options)->color : NULL);
+               transform_tiles_t_check_size(tiles);
+            }
+            const size_t row_size = (size_t) band.width * pixel_format_size(band.format);
+            for(row = 0; row < band.height; ++row)
+               image_scaler_t_push_row(tiles->scaler, (const unsigned char*) band.data + row * row_size);
+            image_t_destroy(&band);
+            return;
+         }
+         default:
+            break;
+      }
+   }
+
+   // No "scale", so put the tiles together
+   image_t* image = tiles->image;
+   if(!image->data)
+   {
+      image_t_init(image);
+      image->width      = tiles->width [tiles->stages];
+      image->height     = tiles->height[tiles->stages];
+      image->color_type = band.color_type;
+      image->bit_depth  = band.bit_depth;
+      image->format     = band.format;
+      image->palette    = band.palette;
+      band.palette      = NULL;
+      transform_tiles_t_check_size(tiles);
+      image->data       = malloc((size_t) image->width * image->height * pixel_format_size(image->format));
+   }
+   const size_t row_size = (size_t) image->width * pixel_format_size(image->format);
+   memcpy((unsigned char*) image->data + (size_t) tiles->y[tiles->stages] * row_size, band.data, (size_t) band.height * row_size);
+   tiles->y[tiles->stages] += band.height;
+   image_t_destroy(&band);
+}
+
+/**
+ * Tiled read, used when "read" has a --max-memory budget. 
+ * PNGs are decoded a tile at a time, other formats are read as usual (mapped where possible) and then handed out as tiles.
+ * The following crops, backgrounds and first scale are applied to the tiles, and *transform_ptr is advanced past them.
+ **/
+static int
+transform_apply_read_tiles
+   (  image_t*             image
+   ,  input_t*             input
+   ,  file_format_t        format
+   ,  const transform_t**  transform_ptr
+   ,  int                  verbose
+   )
+{
+   const transform_t*        transform    = *transform_ptr;
+   transform_read_options_t* options_read = (transform_read_options_t*) transform->options;
+
+   transform_tiles_t tiles;
+   tiles.first      = transform->next;
+   tiles.last       = tiles.first;
+   tiles.stages     = 0;
+   tiles.image      = image;
+   tiles.scaler     = NULL;
+   tiles.max_memory = options_read->max_memory;
+   while(tiles.last && (tiles.last->type == BACKGROUND || tiles.last->type == SCALE || (tiles.last->type == CROP && ((transform_crop_options_t*) tiles.last->options)->type == CROP_DEFAULT)))
+   {
+      const transform_type_t type = tiles.last->type;
+      *transform_ptr = tiles.last;
+      tiles.last     = tiles.last->next;
+      ++tiles.stages;
+      if(verbose)
+         printf(type == SCALE ? "SCALE\n" : type == CROP ? "CROP\n" : "BACKGROUND\n");
+      if(type == SCALE)
+      {
+         // Blend onto a directly following background while scaling, and stop
+         if(tiles.last && tiles.last->type == BACKGROUND)
+         {
+            if(verbose)
+               printf("BACKGROUND\n");
+            *transform_ptr = tiles.last;
+            tiles.last     = tiles.last->next;
+            ++tiles.stages;
+         }
+         break;
+      }
+   }
+   tiles.width  = (int*) malloc((tiles.stages + 1) * sizeof(int));
+   tiles.height = (int*) malloc((tiles.stages + 1) * sizeof(int));
+   tiles.y      = (int*) calloc( tiles.stages + 1 , sizeof(int));
+
+   image_t_init(image);
+   
+   // Tiles take an eighth of the budget, as there may be a few of them in flight between transforms.
+   // Other formats than PNG are read whole, which may take a quarter, as the result and tiles take the rest.
+   const size_t max_tile_size = options_read->max_memory / 8;
+   const size_t max_read_size = options_read->max_memory / 4;
+   if(!(options_read->width && options_read->height) && (format == FORMAT_PNG || format == FORMAT_UNKNOWN))
+   {
+      image_t_read_png_tiles(input, max_tile_size, transform_read_tile, &tiles);
+   }
+   else
+   {
+      image_t read;
+      if(options_read->width && options_read->height)
+         image_t_read_raw(input, &read, options_read->width, options_read->height, max_read_size);
+      else if(format == FORMAT_QOI)
+         image_t_read_qoi(input, &read, max_read_size);
+      else
+         image_t_read_pnm(input, &read, max_read_size);
+      image_t_tiles(&read, max_tile_size, transform_read_tile, &tiles);
+      image_t_destroy(&read);
+   }
+
+   if(tiles.scaler)
+      image_scaler_t_destroy(tiles.scaler);
+
+   free(tiles.width);
+   free(tiles.height);
+   free(tiles.y);
+
+   return TRANSFORM_SUCCESS;
+}
+
+/**
+ * Apply "read". The file format is detected from the magic bytes, unless a raw size is given.
+ * PNG reads may be fused with the following transforms, in which case *transform_ptr is advanced to the last transform applied.
+ **/
+static int
+transform_apply_read
+   (  image_t*             image
+   ,  const transform_t**  transform_ptr
+   ,  int                  verbose
    )
 {
-   transform_read_options_t* options_read = (transform_read_options_t*) options;
+   const transform_t*        transform    = *transform_ptr;
+   const transform_t*        next         = transform->next;
+   transform_read_options_t* options_read = (transform_read_options_t*) transform->options;
+   int status = TRANSFORM_SUCCESS;
+   
+   input_t input;
+   if(!input_t_open(&input, options_read->path))
+      abort_("[read] File %s could not be opened for reading", options_read->path);
+
+   file_format_t format = (options_read->width && options_read->height) ? FORMAT_UNKNOWN : input_t_detect_format(&input);
+   int           is_png = !(options_read->width && options_read->height) && (format == FORMAT_PNG || format == FORMAT_UNKNOWN);
+   
+   // Check whether the next transform can be fused with a png read
+   transform_type_t fused = NONE;
+   if(is_png && !options_read->progressive && !options_read->max_memory && next)
+   {
+      if(next->type == SCALE)
+         fused = SCALE;
+      else if(next->type == CROP && ((transform_crop_options_t*) next->options)->type == CROP_DEFAULT)
+         fused = CROP;
+   }
+   // A "background" after the fused scale is blended while scaling
+   const transform_t* background = (fused == SCALE && next->next && next->next->type == BACKGROUND) ? next->next : NULL;
+   if(verbose && fused == SCALE)
+      printf(background ? "SCALE\nBACKGROUND\n" : "SCALE\n");
+   if(verbose && fused == CROP)
+      printf("CROP\n");
+   if(verbose && is_png && options_read->progressive)
+      printf("\n");
    
    printf("Filename '%s'.\n", options_read->path);
    fflush(stdout);
 
-   image_t_read_png(options_read->path, image);
+   if(options_read->max_memory && !options_read->progressive)
+   {
+      // Tiled read, never holding the full size image
+      status = transform_apply_read_tiles(image, &input, format, transform_ptr, verbose);
+   }
+   else if(!is_png)
+   {
+      if(format == FORMAT_QOI)
+         image_t_read_qoi(&input, image, 0);
+      else if(format == FORMAT_PNM)
+         image_t_read_pnm(&input, image, 0);
+      else
+         image_t_read_raw(&input, image, options_read->width, options_read->height, 0);
+   }
+   else if(options_read->progressive)
+   {
+      // Progressive read applies the rest of the pipeline itself
+      image_t_read_png_progressive(&input, image, transform_read_progress, (void*) next);
+      status = transform_apply_list(image, next, 0);
+      while((*transform_ptr)->next)
+         *transform_ptr = (*transform_ptr)->next;
+   }
+   else if(fused == SCALE)
+   {
+      // Fuse read and scale, so we never hold the full size image in memory
+      status         = transform_apply_read_scale(image, &input, next->options, background ? &((transform_background_options_t*) background->options)->color : NULL);
+      *transform_ptr = background ? background : next;
+   }
+   else if(fused == CROP)
+   {
+      // Push the crop window down into the decoder
+      status         = transform_apply_read_crop(image, &input, next->options);
+      *transform_ptr = next;
+   }
+   else
+   {
+      image_t_read_png(&input, image);
+   }
+
+   input_t_close(&input);
    
-   return TRANSFORM_SUCCESS;
+   return status;
 }
 
 int 
@@ -636,11 +1374,11 @@ transform_apply_scale
    // Scale
    if(options->percent)
    {
-      image_t_scale_percent(image, &scaled, options->percent, options->scale);
+      image_t_scale_percent(image, &scaled, options->percent, options->scale, options->threads);
    }
    else
    {
-      image_t_scale(image, &scaled, options->width, options->height, options->scale);
+      image_t_scale(image, &scaled, options->width, options->height, options->scale, options->threads);
    }
 
    // Clean-up
@@ -650,6 +1388,25 @@ transform_apply_scale
    return TRANSFORM_SUCCESS;
 }
 
+//! Scale and blend onto a background in one pass, used when "scale" is directly followed by "background".
+static int 
+transform_apply_scale_background
+   (  image_t*          image
+   ,  const void* const options_ptr
+   ,  const color32_t*  background
+   )
+{
+   image_t scaled;
+   transform_scale_t* options = (transform_scale_t*) options_ptr;
+   
+   image_t_scale_background(image, &scaled, options->width, options->height, options->percent, options->scale, options->threads, background->r, background->g, background->b);
+
+   image_t_swap(image, &scaled);
+   image_t_destroy(&scaled);
+
+   return TRANSFORM_SUCCESS;
+}
+
 int 
 transform_apply_crop
    (  image_t*          image
@@ -677,6 +1434,37 @@ transform_apply_crop
    return TRANSFORM_SUCCESS;
 }
 
+//! Draw only what changed since the previous frame, for "draw --diff".
+static int
+transform_apply_draw_diff
+   (  image_t*                  image
+   ,  transform_draw_options_t* options
+   )
+{
+   const size_t size = image_t_draw_diff_size(image);
+   if(size > options->buffer_size)
+   {
+      free(options->buffer);
+      options->buffer      = (char*) malloc(size);
+      options->buffer_size = size;
+   }
+
+   struct iovec iov;
+   iov.iov_base = options->buffer;
+   iov.iov_len  = image_t_draw_diff(image, &options->cache, options->buffer, options->x_pos, options->y_pos);
+   if(!iov.iov_len)
+      return TRANSFORM_SUCCESS; // Same frame as before
+
+   // Anything printed through stdio goes first
+   fflush(stdout);
+   const int written = write_all(STDOUT_FILENO, &iov, 1);
+
+   if(written && options->cache_path && options->type == DRAW_POS)
+      draw_cache_t_save(&options->cache, options->cache_path);
+
+   return written ? TRANSFORM_SUCCESS : TRANSFORM_FAILLURE;
+}
+
 int
 transform_apply_draw
    (  image_t*    image
@@ -685,30 +1473,321 @@ transform_apply_draw
 {
    transform_draw_options_t* options = (transform_draw_options_t*) options_ptr;
 
-   char buffer[1024 * 1024 * 4];
+   if(options->diff && !options->path)
+      return transform_apply_draw_diff(image, options);
+
+   const size_t size = image_t_draw_size(image);
+   if(size > options->buffer_size)
+   {
+      free(options->buffer);
+      options->buffer      = (char*) malloc(size);
+      options->buffer_size = size;
+   }
+
+   struct iovec iov[1 + IMAGE_DRAW_MAX_BANDS];
+   int          iovcnt = 0;
+   char         move[32];
+   int          fd     = STDOUT_FILENO;
 
    if(options->path)
    {
-      FILE* file = fopen(options->path, "w+");
-      image_t_draw(image, buffer, options->x_pos, options->y_pos, file);
-      fclose(file);
+      fd = open(options->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if(fd < 0)
+         abort_("[draw] File %s could not be opened for writing", options->path);
    }
    else
    {
-      // No path given, we just print ot stdout
-      image_t_draw(image, buffer, options->x_pos, options->y_pos, stdout);
+      // No path given, we just print ot stdout.
+      // If this draw has already written an image, move the cursor back up and draw on top of it.
+      if(options->type == DRAW_DEFAULT && options->lines_drawn)
+      {
+         iov[iovcnt].iov_base = move;
+         iov[iovcnt].iov_len  = sprintf(move, "\033[%dA\r", options->lines_drawn);
+         ++iovcnt;
+      }
+      options->lines_drawn = (image->height + 1) / 2;
+
+      // Anything printed through stdio goes first
+      fflush(stdout);
    }
 
-   return TRANSFORM_SUCCESS;
+   // The bands of the output go out in order, in the same writev
+   iovcnt += image_t_draw(image, options->buffer, options->x_pos, options->y_pos, options->threads, iov + iovcnt);
+
+   const int written = write_all(fd, iov, iovcnt);
+   if(options->path)
+      close(fd);
+
+   return written ? TRANSFORM_SUCCESS : TRANSFORM_FAILLURE;
 }
 
 /**
- * Apply a transform pipeline to an image.
+ * Stream decoding thread.
  **/
-int 
-transform_apply_pipeline
+typedef struct
+{
+   input_t*           input;
+   const void*        options_scale; // Scale options if scaling is fused with decoding, otherwise NULL
+   frame_queue_t*     queue;
+}  transform_stream_decoder_t;
+
+static void*
+transform_stream_decode
+   (  void* decoder_ptr
+   )
+{
+   transform_stream_decoder_t* decoder = (transform_stream_decoder_t*) decoder_ptr;
+   image_t frame;
+   image_t_init(&frame);
+   
+   // Decode frames until the input runs dry, or the consumer closes the queue
+   while(input_t_peek(decoder->input, 1))
+   {
+      switch(input_t_detect_format(decoder->input))
+      {
+         case FORMAT_PNG:
+            if(decoder->options_scale)
+               transform_apply_read_scale(&frame, decoder->input, decoder->options_scale, NULL);
+            else
+               image_t_read_png(decoder->input, &frame);
+            break;
+         case FORMAT_PNM:
+            image_t_read_pnm(decoder->input, &frame, 0);
+            if(decoder->options_scale)
+               transform_apply_scale(&frame, decoder->options_scale);
+            break;
+         case FORMAT_QOI:
+         case FORMAT_UNKNOWN:
+            abort_("[stream] Frame in %s is not a PNG or PNM image", decoder->input->name);
+      }
+      
+      if(!frame_queue_t_push(decoder->queue, &frame))
+         break;
+   }
+   
+   image_t_destroy(&frame);
+   frame_queue_t_close(decoder->queue);
+
+   return NULL;
+}
+
+//! Add seconds to a timespec.
+static void
+timespec_add
+   (  struct timespec* const time
+   ,  double                 seconds
+   )
+{
+   long nsec = time->tv_nsec + (long) (seconds * 1e9);
+   time->tv_sec += nsec / 1000000000L;
+   time->tv_nsec = nsec % 1000000000L;
+}
+
+//! Check if time a is before time b.
+static int
+timespec_before
+   (  const struct timespec* const a
+   ,  const struct timespec* const b
+   )
+{
+   return (a->tv_sec < b->tv_sec) || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * Apply "stream". Frames are decoded (and scaled, if "scale" directly follows) on a decoder thread, 
+ * while this thread applies the remaining transforms to each frame and keeps the frame rate.
+ * The rest of the pipeline is consumed, so *transform_ptr is advanced to the last transform. The last frame is left in image.
+ **/
+static int
+transform_apply_stream
+   (  image_t*             image
+   ,  const transform_t**  transform_ptr
+   ,  int                  verbose
+   )
+{
+   const transform_t*          transform      = *transform_ptr;
+   const transform_t*          rest           = transform->next;
+   transform_stream_options_t* options_stream = (transform_stream_options_t*) transform->options;
+   int status = TRANSFORM_SUCCESS;
+   
+   input_t input;
+   if(!input_t_open(&input, options_stream->path))
+      abort_("[stream] File %s could not be opened for reading", options_stream->path);
+
+   // Fuse scaling into the decoder thread
+   transform_stream_decoder_t decoder;
+   frame_queue_t              queue;
+   decoder.input         = &input;
+   decoder.options_scale = NULL;
+   decoder.queue         = &queue;
+   if(rest && rest->type == SCALE)
+   {
+      if(verbose)
+         printf("SCALE");
+      decoder.options_scale = rest->options;
+      rest                  = rest->next;
+   }
+   if(verbose)
+      printf("\n");
+   
+   printf("Filename '%s'.\n", options_stream->path);
+   fflush(stdout);
+   
+   frame_queue_t_init(&queue, options_stream->queue_size);
+   pthread_t thread;
+   if(pthread_create(&thread, NULL, transform_stream_decode, &decoder) != 0)
+      abort_("[stream] Could not create decoder thread");
+
+   // Draw frames as they come out of the queue, at most at the requested frame rate
+   struct timespec deadline;
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+   image_t frame;
+   image_t_init(&frame);
+   while(frame_queue_t_pop(&queue, &frame))
+   {
+      status = transform_apply_list(&frame, rest, 0);
+      if(status == TRANSFORM_FAILLURE)
+         break;
+      fflush(stdout);
+      image_t_swap(image, &frame);
+
+      if(options_stream->fps > 0.0)
+      {
+         struct timespec now;
+         timespec_add(&deadline, 1.0 / options_stream->fps);
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         if(timespec_before(&now, &deadline))
+         {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+         }
+         else
+         {
+            // Running behind, so restart the clock instead of rushing to catch up
+            deadline = now;
+         }
+      }
+   }
+   image_t_destroy(&frame);
+
+   frame_queue_t_close(&queue);
+   pthread_join(thread, NULL);
+   frame_queue_t_destroy(&queue);
+   input_t_close(&input);
+
+   while((*transform_ptr)->next)
+      *transform_ptr = (*transform_ptr)->next;
+
+   return status;
+}
+
+/**
+ * Apply "shm". Frames are borrowed straight from shared memory, and the first scale or crop reads them in place.
+ * Without a leading scale or crop the frame is copied once, so the rest of the pipeline never sees a frame that changes under it.
+ * Frames overwritten by the producer while being read are dropped.
+ * The rest of the pipeline is consumed, so *transform_ptr is advanced to the last transform. The last frame is left in image.
+ **/
+static int
+transform_apply_shm
+   (  image_t*             image
+   ,  const transform_t**  transform_ptr
+   ,  int                  verbose
+   )
+{
+   const transform_t*       transform   = *transform_ptr;
+   const transform_t*       first       = transform->next;
+   const transform_t*       rest        = NULL;
+   transform_shm_options_t* options_shm = (transform_shm_options_t*) transform->options;
+   int status = TRANSFORM_SUCCESS;
+   
+   shm_ring_t ring;
+   if(!shm_ring_t_attach(&ring, options_shm->name))
+      abort_("[shm] Shared memory %s could not be attached, or is not a frame ring", options_shm->name);
+
+   // The first scale or crop copies out of the shared memory
+   if(first && (first->type == SCALE || first->type == CROP))
+   {
+      if(verbose)
+         printf("%s", first->type == SCALE ? "SCALE" : "CROP");
+      rest = first->next;
+   }
+   else
+   {
+      rest  = first;
+      first = NULL;
+   }
+   if(verbose)
+      printf("\n");
+   
+   printf("Shared memory '%s'.\n", options_shm->name);
+   fflush(stdout);
+
+   struct timespec deadline;
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+   
+   int frames = 0;
+   image_t frame;
+   image_t_init(&frame);
+   while(!options_shm->frames || frames < options_shm->frames)
+   {
+      uint64_t sequence = shm_ring_t_borrow_newest(&ring, &frame);
+      if(sequence)
+      {
+         if(!first)
+         {
+            image_t borrowed = frame;
+            image_t_copy(&borrowed, &frame);
+         }
+         else if(first->type == SCALE)
+         {
+            transform_apply_scale(&frame, first->options);
+         }
+         else
+         {
+            transform_apply_crop(&frame, first->options);
+         }
+         
+         if(shm_ring_t_valid(&ring, sequence))
+         {
+            status = transform_apply_list(&frame, rest, 0);
+            if(status == TRANSFORM_FAILLURE)
+               break;
+            fflush(stdout);
+            image_t_swap(image, &frame);
+            ++frames;
+         }
+         image_t_destroy(&frame);
+      }
+      else if(shm_ring_t_closed(&ring))
+      {
+         break;
+      }
+      
+      // Wait for next poll
+      struct timespec now;
+      timespec_add(&deadline, 1.0 / options_shm->fps);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if(timespec_before(&now, &deadline))
+         clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+      else
+         deadline = now;
+   }
+   image_t_destroy(&frame);
+   
+   shm_ring_t_detach(&ring);
+
+   while((*transform_ptr)->next)
+      *transform_ptr = (*transform_ptr)->next;
+
+   return status;
+}
+
+//! Apply a list of transforms to an image. If verbose, each step is printed.
+static int 
+transform_apply_list
    (  image_t*             image
    ,  const transform_t*   transform
+   ,  int                  verbose
    )
 {
    int status = TRANSFORM_SUCCESS;
@@ -719,38 +1798,67 @@ transform_apply_pipeline
       {
          case NONE:
          {
-            printf("NONE\n");
+            if(verbose)
+               printf("NONE\n");
             break;
          }
          case READ:
          {
-            printf("READ");
-            status = transform_apply_read(image, transform->options);
+            if(verbose)
+               printf("READ");
+            status = transform_apply_read(image, &transform, verbose);
             break;
          }
          case SCALE:
          {
-            printf("SCALE\n");
-            status = transform_apply_scale(image, transform->options);
+            if(verbose)
+               printf("SCALE\n");
+            if(transform->next && transform->next->type == BACKGROUND)
+            {
+               // Blend onto the background while scaling
+               if(verbose)
+                  printf("BACKGROUND\n");
+               status    = transform_apply_scale_background(image, transform->options, &((transform_background_options_t*) transform->next->options)->color);
+               transform = transform->next;
+            }
+            else
+            {
+               status = transform_apply_scale(image, transform->options);
+            }
             break;
          }
          case CROP:
          {
-            printf("CROP\n");
+            if(verbose)
+               printf("CROP\n");
             status = transform_apply_crop(image, transform->options);
             break;
          }
          case DRAW:
          {
-            printf("DRAW\n");
-            //char buffer[1024 * 1024 * 4];
-            //image_t_draw(image, buffer);
+            if(verbose)
+               printf("DRAW\n");
             status = transform_apply_draw(image, transform->options);
             break;
          }
+         case STREAM:
+         {
+            if(verbose)
+               printf("STREAM");
+            status = transform_apply_stream(image, &transform, verbose);
+            break;
+         }
+         case SHM:
+         {
+            if(verbose)
+               printf("SHM");
+            status = transform_apply_shm(image, &transform, verbose);
+            break;
+         }
          case BACKGROUND:
          {
-            printf("BACKGROUND\n");
+            if(verbose)
+               printf("BACKGROUND\n");
             color32_t* color = &((transform_background_options_t*) transform->options)->color;
             image_t_apply_background(image, color->r, color->g, color->b);
             break;
@@ -765,3 +1873,15 @@ transform_apply_pipeline
 
    return status;
 }
+
+/**
+ * Apply a transform pipeline to an image.
+ **/
+int 
+transform_apply_pipeline
+   (  image_t*             image
+   ,  const transform_t*   transform
+   )
+{
+   return transform_apply_list(image, transform, 1);
+}
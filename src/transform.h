@@ -11,6 +11,8 @@ typedef enum
 ,  CROP
 ,  DRAW
 ,  BACKGROUND
+,  STREAM
+,  SHM
 }  transform_type_t;
 
 /**
@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "util.h"
 
 void 
 abort_
@@ -35,3 +40,38 @@ string_allocate_and_copy
 
    return str_copy;
 }
+
+int 
+write_all
+   (  int           fd
+   ,  struct iovec* iov
+   ,  int           iovcnt
+   )
+{
+   while(iovcnt > 0)
+   {
+      ssize_t nwritten = writev(fd, iov, min(iovcnt, UIO_MAXIOV));
+      if(nwritten < 0)
+      {
+         if(errno == EINTR)
+            continue;
+         return 0;
+      }
+
+      // Skip what was written, which may end in the middle of a buffer
+      size_t done = (size_t) nwritten;
+      while(iovcnt > 0 && done >= iov->iov_len)
+      {
+         done -= iov->iov_len;
+         ++iov;
+         --iovcnt;
+      }
+      if(iovcnt > 0)
+      {
+         iov->iov_base  = (char*) iov->iov_base + done;
+         iov->iov_len  -= done;
+      }
+   }
+
+   return 1;
+}
@@ -27,4 +27,17 @@ string_allocate_and_copy
    (  const char* const str
    );
 
+/**
+ * Write all of iovcnt buffers to fd with writev(2), retrying on partial writes and EINTR. The iov array is modified.
+ * Returns 1 on success, 0 on error.
+ **/
+struct iovec;
+
+int 
+write_all
+   (  int           fd
+   ,  struct iovec* iov
+   ,  int           iovcnt
+   );
+
 #endif /* UTIL_H_INCLUDED */